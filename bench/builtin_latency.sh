@@ -0,0 +1,46 @@
+#!/bin/sh
+# Per-command latency of in-process builtins against the same utilities run as programs.
+# usage: bench/builtin_latency.sh [tinysh binary] [commands per run]
+TINYSH=${1:-./tinysh}
+COUNT=${2:-5000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+# full path of a program, "command -v" would name the sh builtin
+find_program() {
+	IFS=:
+	for dir in $PATH; do
+		if [ -x "$dir/$1" ]; then
+			unset IFS
+			echo "$dir/$1"
+			return
+		fi
+	done
+	unset IFS
+	echo "$1"
+}
+
+now_ns() {
+	date +%s%N
+}
+
+# run_case name command: COUNT copies of command as a script, prints ns per command
+run_case() {
+	i=0
+	: > "$SCRIPT"
+	while [ $i -lt "$COUNT" ]; do
+		echo "$2" >> "$SCRIPT"
+		i=$((i + 1))
+	done
+	start=$(now_ns)
+	"$TINYSH" "$SCRIPT" > /dev/null
+	end=$(now_ns)
+	echo "{\"benchmark\":\"builtin_latency\",\"case\":\"$1\",\"commands\":$COUNT,\"ns_per_command\":$(( (end - start) / COUNT ))}"
+}
+
+run_case builtin_true "true"
+run_case program_true "$(find_program true)"
+run_case builtin_echo "echo hello"
+run_case program_echo "$(find_program echo) hello"
+run_case builtin_test "[ -f /etc/passwd ]"
+run_case program_test "$(find_program test) -f /etc/passwd"
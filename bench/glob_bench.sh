@@ -0,0 +1,48 @@
+#!/bin/sh
+# Pathname expansion over one big directory: ms per expanded word for tinysh, per run of the
+# find | xargs pipeline it replaces, and for several patterns over the same directory in one
+# command, which reads it once.
+# usage: bench/glob_bench.sh [tinysh binary] [files] [repeats]
+TINYSH=${1:-./tinysh}
+FILES=${2:-100000}
+REPEATS=${3:-20}
+WORK_DIR=$(mktemp -d)
+SCRIPT="$WORK_DIR/script.sh"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+now_ns() {
+	date +%s%N
+}
+
+# one file in ten is a .log, the rest .txt
+mkdir "$WORK_DIR/files"
+(cd "$WORK_DIR/files" && awk -v files="$FILES" 'BEGIN {
+	for (i = 0; i < files; i++) print "file" i (i % 10 == 0 ? ".log" : ".txt") }' | xargs touch)
+
+# run_case name words_per_repeat: runs SCRIPT, prints ms per word
+run_case() {
+	start=$(now_ns)
+	"$TINYSH" "$SCRIPT" > /dev/null
+	end=$(now_ns)
+	awk -v name="$1" -v files="$FILES" -v words=$(($2 * REPEATS)) -v ns=$((end - start)) 'BEGIN {
+		printf "{\"benchmark\":\"glob\",\"case\":\"%s\",\"files\":%d,\"ms_per_word\":%.2f}\n",
+			name, files, ns / 1e6 / words }'
+}
+
+# repeat_line line: SCRIPT runs it REPEATS times in the files directory
+repeat_line() {
+	echo "cd $WORK_DIR/files" > "$SCRIPT"
+	awk -v count="$REPEATS" -v line="$1" 'BEGIN { for (i = 0; i < count; i++) print line }' >> "$SCRIPT"
+}
+
+repeat_line 'true *.log'
+run_case glob_suffix 1
+repeat_line 'true file1*'
+run_case glob_prefix 1
+repeat_line 'true *'
+run_case glob_all 1
+repeat_line 'find . -name "*.log" | xargs true'
+run_case find_xargs 1
+# four patterns, one directory read
+repeat_line 'true *.log file1* file2?.txt [!f]*'
+run_case glob_cached 4
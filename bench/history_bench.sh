@@ -0,0 +1,56 @@
+#!/bin/sh
+# History over a million entries: startup with the file against without one, the index build
+# (done while a shell waits for input, here input is a file that is never waited for so the
+# first look at the history pays for it), and us per lookup (history -s, history -p, which is
+# what !prefix runs) for text found only in the oldest entry and for text found nowhere.
+# usage: bench/history_bench.sh [tinysh binary] [entries] [lookups]
+TINYSH=${1:-./tinysh}
+ENTRIES=${2:-1000000}
+LOOKUPS=${3:-10000}
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+now_ns() {
+	date +%s%N
+}
+
+# the oldest entry is the only one with "oldest" in it
+awk -v entries="$ENTRIES" 'BEGIN {
+	print "make oldest-target"
+	for (i = 1; i < entries; i++) printf "git commit -m \"change %d\" src/file%d.c\n", i, i % 5000 }' \
+	> "$WORK_DIR/history"
+
+# session line count [history file]: ns for a piped session that runs line count times
+session() {
+	awk -v count="$2" -v line="$1" 'BEGIN { for (i = 0; i < count; i++) print line }' > "$WORK_DIR/input"
+	start=$(now_ns)
+	TINYSH_HISTFILE=${3-"$WORK_DIR/history.copy"} "$TINYSH" < "$WORK_DIR/input" > /dev/null
+	end=$(now_ns)
+	echo $((end - start))
+}
+
+# fresh_session line count: session on a fresh copy of the history
+fresh_session() {
+	cp "$WORK_DIR/history" "$WORK_DIR/history.copy"
+	session "$1" "$2"
+}
+
+# mapping the file is all startup does
+startup_ns=0
+no_history_ns=0
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	startup_ns=$((startup_ns + $(fresh_session true 1)))
+	no_history_ns=$((no_history_ns + $(session true 1 "")))
+done
+index_ns=$(fresh_session 'history 1' 1)
+echo "{\"benchmark\":\"history_load\",\"entries\":$ENTRIES,\"startup_ns\":$((startup_ns / 10)),\"no_history_startup_ns\":$((no_history_ns / 10)),\"index_ns\":$((index_ns - startup_ns / 10))}"
+
+# every line also appends to the history file, the baseline does that too. The text looked
+# for is split by quotes so that the lines doing the lookups do not have it
+base_ns=$(fresh_session 'history 1' "$LOOKUPS")
+for lookup in "history -s old''est 1" "history -s no-such''-text 1" 'history -p make 1' 'history -p no-such-prefix 1'; do
+	ns=$(fresh_session "$lookup" "$LOOKUPS")
+	awk -v lookup="$lookup" -v entries="$ENTRIES" -v ns=$((ns - base_ns)) -v lookups="$LOOKUPS" 'BEGIN {
+		printf "{\"benchmark\":\"history_lookup\",\"lookup\":\"%s\",\"entries\":%d,\"us_per_lookup\":%.1f}\n",
+			lookup, entries, ns / 1e3 / lookups }'
+done
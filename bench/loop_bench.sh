@@ -0,0 +1,53 @@
+#!/bin/sh
+# Per-iteration cost of a for loop, whose body is compiled once, against the same commands
+# unrolled into distinct lines that each have to be tokenized and compiled, and the cost per
+# line run of loops whose body spans thousands of lines of the script.
+# usage: bench/loop_bench.sh [tinysh binary] [iterations]
+TINYSH=${1:-./tinysh}
+COUNT=${2:-20000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+now_ns() {
+	date +%s%N
+}
+
+# run_case name: runs SCRIPT, prints ns per iteration
+run_case() {
+	start=$(now_ns)
+	"$TINYSH" "$SCRIPT" > /dev/null
+	end=$(now_ns)
+	echo "{\"benchmark\":\"loop\",\"case\":\"$1\",\"iterations\":$COUNT,\"ns_per_iteration\":$(( (end - start) / COUNT ))}"
+}
+
+# for_loop name body: one loop over 1..COUNT, the body uses $i
+for_loop() {
+	awk -v count="$COUNT" -v body="$2" 'BEGIN {
+		printf "for i in"; for (i = 1; i <= count; i++) printf " %d", i; printf "; do %s; done\n", body }' > "$SCRIPT"
+	run_case "$1"
+}
+
+# unrolled name body: COUNT lines with $i replaced by 1..COUNT, none the same as another
+unrolled() {
+	awk -v count="$COUNT" -v body="$2" 'BEGIN {
+		for (i = 1; i <= count; i++) { line = body; gsub(/\$i/, i, line); print line } }' > "$SCRIPT"
+	run_case "$1"
+}
+
+# long_body lines: a loop of two iterations whose body is that many lines of the script,
+# compiled once the loop is closed; ns per body line run
+long_body() {
+	awk -v lines="$1" 'BEGIN {
+		print "for i in 1 2; do"; for (i = 0; i < lines; i++) print "true " i; print "done" }' > "$SCRIPT"
+	start=$(now_ns)
+	"$TINYSH" "$SCRIPT" > /dev/null
+	end=$(now_ns)
+	echo "{\"benchmark\":\"loop\",\"case\":\"long_body\",\"body_lines\":$1,\"ns_per_line\":$(( (end - start) / ($1 * 2) ))}"
+}
+
+for_loop loop_true 'true $i'
+unrolled unrolled_true 'true $i'
+for_loop loop_echo 'echo $i > /dev/null'
+unrolled unrolled_echo 'echo $i > /dev/null'
+long_body 1000
+long_body 4000
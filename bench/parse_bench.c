@@ -0,0 +1,77 @@
+// Tokenizer and expansion throughput: ParseCommand and ExpandVariables on synthetic lines.
+// Built against tinysh.c itself (its main renamed), prints one JSON record per case.
+// usage: parse_bench [line bytes] [iterations]
+#define main tinysh_main
+#include "../tinysh.c"
+#undef main
+
+static const char* g_sample_words[] = {
+	"echo", "\"quoted words here\"", "$$", "plain", "'single quoted'", "esc\\ aped",
+	"$HOME", "\"${USER}:$?\"", "'$literal'",
+	"arg$$tail", "--long-option=value", "|", "<", "input.txt", ">", "out.log",
+};
+
+// a line of roughly line_bytes, words separated by blanks
+static char* MakeSyntheticLine(size_t line_bytes) {
+	char* line = (char*)malloc(line_bytes + 64);
+	size_t length = 0;
+	size_t num_words = sizeof(g_sample_words) / sizeof(g_sample_words[0]);
+	size_t i = 0;
+
+	while (length < line_bytes) {
+		length += sprintf(line + length, "%s ", g_sample_words[i++ % num_words]);
+	}
+	line[length] = '\0';
+	return line;
+}
+
+static void RunCase(size_t line_bytes, int iterations) {
+	char* line = MakeSyntheticLine(line_bytes);
+	size_t length = strlen(line);
+	struct Token* tokens = NULL;
+	struct Token* expanded_tokens;
+	uint64_t parse_ns = 0;
+	uint64_t expand_ns = 0;
+	uint64_t start;
+	long long total_tokens = 0;
+	int num_tokens;
+	int i;
+
+	for (i = 0; i < iterations; i++) {
+		ArenaReset(&g_command_arena);
+		start = MonotonicNs();
+		num_tokens = ParseCommand(&g_command_arena, line, &tokens);
+		parse_ns += MonotonicNs() - start;
+		start = MonotonicNs();
+		num_tokens = ExpandVariables(tokens, num_tokens, &expanded_tokens);
+		expand_ns += MonotonicNs() - start;
+		total_tokens += num_tokens;
+	}
+	printf("{\"benchmark\":\"parse\",\"line_bytes\":%zu,\"iterations\":%d,"
+		"\"mb_per_s\":%.1f,\"tokens_per_s\":%.0f,\"ns_per_line\":%.0f}\n",
+		length, iterations, (double)length * iterations / (parse_ns / 1e9) / 1e6,
+		total_tokens / (parse_ns / 1e9), (double)parse_ns / iterations);
+	printf("{\"benchmark\":\"expand\",\"line_bytes\":%zu,\"iterations\":%d,"
+		"\"mb_per_s\":%.1f,\"tokens_per_s\":%.0f,\"ns_per_line\":%.0f}\n",
+		length, iterations, (double)length * iterations / (expand_ns / 1e9) / 1e6,
+		total_tokens / (expand_ns / 1e9), (double)expand_ns / iterations);
+	free(line);
+}
+
+int main(int argc, char** argv) {
+	size_t line_bytes = argc > 1 ? (size_t)atol(argv[1]) : 0;
+	int iterations = argc > 2 ? atoi(argv[2]) : 0;
+
+	snprintf(g_shell_pid_string, sizeof(g_shell_pid_string), "%d", (int)getpid());
+	ImportEnvironment();
+
+	if (line_bytes > 0) {
+		RunCase(line_bytes, iterations > 0 ? iterations : 1000);
+		return 0;
+	}
+	// a typical interactive line, a long generated one, a huge one
+	RunCase(80, 200000);
+	RunCase(4096, 20000);
+	RunCase(1 << 20, 50);
+	return 0;
+}
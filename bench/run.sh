@@ -0,0 +1,95 @@
+#!/bin/sh
+# Benchmark harness, one JSON record per line on stdout:
+#   launch throughput of trivial external commands fed through stdin,
+#   p50/p99 spawn-to-reap latency from the shell's own trace records,
+#   tokenizer and expansion throughput (parse_bench),
+#   background job launch and reaping cost with many jobs in flight,
+#   per-task cost over --serve against a fresh tinysh -c per task,
+#   pathname expansion over a 100k entry directory,
+#   history load and lookups over a million entries.
+# usage: bench/run.sh [tinysh binary] [commands per case]
+TINYSH=${1:-./tinysh}
+COUNT=${2:-2000}
+BENCH_DIR=$(dirname "$0")
+PARSE_BENCH=${PARSE_BENCH:-$BENCH_DIR/parse_bench}
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+# full path of a program, "command -v" would name the sh builtin
+find_program() {
+	IFS=:
+	for dir in $PATH; do
+		if [ -x "$dir/$1" ]; then
+			unset IFS
+			echo "$dir/$1"
+			return
+		fi
+	done
+	unset IFS
+	echo "$1"
+}
+
+now_ns() {
+	date +%s%N
+}
+
+# repeat_line count line > file
+repeat_line() {
+	awk -v count="$1" -v line="$2" 'BEGIN { for (i = 0; i < count; i++) print line }'
+}
+
+TRUE_PROGRAM=$(find_program true)
+
+for backend in posix_spawn fork; do
+	repeat_line "$COUNT" "$TRUE_PROGRAM" > "$WORK_DIR/true.sh"
+
+	# commands/s through stdin, the way an interactive session or a pipe feeds it
+	start=$(now_ns)
+	TINYSH_SPAWN=$backend "$TINYSH" < "$WORK_DIR/true.sh" > /dev/null
+	end=$(now_ns)
+	awk -v backend=$backend -v count="$COUNT" -v ns=$((end - start)) 'BEGIN {
+		printf "{\"benchmark\":\"launch_throughput\",\"backend\":\"%s\",\"commands\":%d,\"commands_per_s\":%.1f}\n",
+			backend, count, count / (ns / 1e9) }'
+
+	# spawn to reap of each command, from the trace records
+	rm -f "$WORK_DIR/trace.json"
+	TINYSH_SPAWN=$backend TINYSH_TRACE="$WORK_DIR/trace.json" "$TINYSH" "$WORK_DIR/true.sh" > /dev/null
+	sed -e 's/.*"spawn_ns":\([0-9]*\).*"exec_ns":\([0-9]*\).*"wait_ns":\([0-9]*\).*/\1 \2 \3/' \
+		"$WORK_DIR/trace.json" | awk '{ print $1 + $2 + $3 }' | sort -n > "$WORK_DIR/latency"
+	awk -v backend=$backend '{ latency[NR] = $1 } END {
+		p50 = latency[int((NR - 1) * 0.50) + 1]; p99 = latency[int((NR - 1) * 0.99) + 1]
+		printf "{\"benchmark\":\"spawn_to_exit\",\"backend\":\"%s\",\"commands\":%d,\"p50_ns\":%d,\"p99_ns\":%d}\n",
+			backend, NR, p50, p99 }' "$WORK_DIR/latency"
+done
+
+# tokenizer and $$ expansion
+if [ -x "$PARSE_BENCH" ]; then
+	"$PARSE_BENCH"
+fi
+
+# many jobs in flight: each sleeps SLEEP_S, the rest of the run time is launching and reaping
+SLEEP_S=0.5
+for jobs in 100 1000; do
+	{ repeat_line "$jobs" "sleep $SLEEP_S &"; echo "wait"; } > "$WORK_DIR/jobs.sh"
+	start=$(now_ns)
+	"$TINYSH" "$WORK_DIR/jobs.sh" > /dev/null
+	end=$(now_ns)
+	awk -v jobs=$jobs -v ns=$((end - start)) -v sleep_s=$SLEEP_S 'BEGIN {
+		printf "{\"benchmark\":\"background_jobs\",\"jobs\":%d,\"total_ms\":%.1f,\"ns_per_job\":%.0f}\n",
+			jobs, ns / 1e6, (ns - sleep_s * 1e9) / jobs }'
+done
+
+# in-process builtins against the programs
+"$BENCH_DIR/builtin_latency.sh" "$TINYSH" "$COUNT"
+
+# loop bodies compiled once against the same commands compiled line by line
+"$BENCH_DIR/loop_bench.sh" "$TINYSH" "$COUNT"
+
+# a long-lived --serve shell against tinysh -c per task
+"$BENCH_DIR/serve_bench.sh" "$TINYSH" "$COUNT"
+
+# patterns over one big directory against find | xargs
+"$BENCH_DIR/glob_bench.sh" "$TINYSH"
+
+# history file mapping, index build and lookups
+"$BENCH_DIR/history_bench.sh" "$TINYSH"
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Per-task cost of a long-lived tinysh --serve against starting tinysh -c for every task:
+# the same trivial program run COUNT times each way, one request per line over one connection.
+# usage: bench/serve_bench.sh [tinysh binary] [tasks]
+TINYSH=${1:-./tinysh}
+COUNT=${2:-2000}
+WORK_DIR=$(mktemp -d)
+SOCKET=$WORK_DIR/serve.sock
+SERVER_PID=
+trap '[ -n "$SERVER_PID" ] && kill "$SERVER_PID"; rm -rf "$WORK_DIR"' EXIT
+
+# full path of a program, "command -v" would name the sh builtin
+find_program() {
+	IFS=:
+	for dir in $PATH; do
+		if [ -x "$dir/$1" ]; then
+			unset IFS
+			echo "$dir/$1"
+			return
+		fi
+	done
+	unset IFS
+	echo "$1"
+}
+
+now_ns() {
+	date +%s%N
+}
+
+# repeat_line count line > file
+repeat_line() {
+	awk -v count="$1" -v line="$2" 'BEGIN { for (i = 0; i < count; i++) print line }'
+}
+
+# report name start end
+report() {
+	echo "{\"benchmark\":\"serve\",\"case\":\"$1\",\"tasks\":$COUNT,\"ns_per_task\":$(( ($3 - $2) / COUNT ))}"
+}
+
+TRUE_PROGRAM=$(find_program true)
+
+# a fresh shell per task, started by tinysh itself
+repeat_line "$COUNT" "$TINYSH -c $TRUE_PROGRAM" > "$WORK_DIR/spawn.sh"
+start=$(now_ns)
+"$TINYSH" "$WORK_DIR/spawn.sh" > /dev/null
+end=$(now_ns)
+report spawn_c "$start" "$end"
+
+"$TINYSH" --serve "$SOCKET" &
+SERVER_PID=$!
+while [ ! -S "$SOCKET" ]; do sleep 0.01; done
+
+repeat_line "$COUNT" "$TRUE_PROGRAM" > "$WORK_DIR/tasks"
+for window in 1 64; do
+	start=$(now_ns)
+	"$TINYSH" --client "$SOCKET" -j $window < "$WORK_DIR/tasks" > /dev/null
+	end=$(now_ns)
+	report "serve_j$window" "$start" "$end"
+done
@@ -0,0 +1,113 @@
+#!/bin/sh
+# Shell-level checks: each case runs a command line through tinysh -c, or a session fed on
+# stdin, in a scratch directory and compares its output (stdout and stderr) and exit status.
+# Prints the cases that fail and exits 1 if there are any.
+# usage: tests/check.sh [tinysh binary]
+TINYSH=$(cd "$(dirname "${1:-./tinysh}")" && pwd)/$(basename "${1:-./tinysh}")
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+num_cases=0
+num_failed=0
+
+# report name expected_output expected_status output status
+report() {
+	num_cases=$((num_cases + 1))
+	if [ "$4" != "$2" ] || [ "$5" != "$3" ]; then
+		num_failed=$((num_failed + 1))
+		printf 'FAIL %s\n  expected status %s, output:\n%s\n  got status %s, output:\n%s\n' "$1" "$3" "$2" "$5" "$4"
+	fi
+}
+
+# check name expected_output expected_status command_line: background job notices are left
+# out of the output
+check() {
+	output=$(cd "$WORK_DIR" && "$TINYSH" -c "$4" 2>&1)
+	status=$?
+	output=$(printf '%s\n' "$output" | sed '/Background process/d')
+	report "$1" "$2" "$3" "$output" $status
+}
+
+# check_session name expected_output input_commands: the output of input_commands is typed
+# into tinysh, prompts and background job notices are left out of what it printed
+check_session() {
+	output=$(cd "$WORK_DIR" && eval "$3" | TINYSH_HISTFILE= "$TINYSH" 2>&1)
+	status=$?
+	output=$(printf '%s\n' "$output" | sed -e 's/^\(: \)*//' -e '/Background process/d' -e '/^$/d')
+	report "$1" "$2" 0 "$output" $status
+}
+
+new_line='
+'
+
+# pipelines
+check pipe 'HELLO' 0 'echo hello | tr a-z A-Z'
+check pipe_three '2' 0 'printf "a\nb\nc\n" | grep -v b | wc -l'
+check pipe_last_status '' 1 'echo x | false'
+
+# redirections
+check redirect_out_in "hi${new_line}more${new_line}2" 0 'echo hi > f; echo more >> f; cat < f; wc -l < f; rm f'
+check redirect_stderr 'gone' 0 'ls /no/such/path 2> err; test -s err && echo gone; rm err'
+check redirect_missing_input 'missing: No such file or directory' 1 'cat < missing'
+check redirect_ambiguous '$(echo f g): ambiguous redirect' 1 'echo x > f; cat < $(echo f g)'
+check redirect_ambiguous_empty '$x: ambiguous redirect' 1 'x=; echo x > $x'
+check redirect_quoted "x" 0 'x="f g"; echo x > "$x"; cat "f g"; rm "f g"'
+
+# && and ||
+check and_or "yes${new_line}yes2" 0 'false && echo no || echo yes; true || echo no && echo yes2'
+check and_status '' 1 'true && false'
+
+# loops
+check for_loop "1${new_line}2${new_line}3" 0 'for i in 1 2 3; do echo $i; done'
+check while_loop "once${new_line}after" 0 'touch f; while test -f f; do rm f; echo once; done; echo after'
+check loop_lines "1${new_line}doc 1${new_line}2${new_line}doc 2${new_line}group" 0 'for i in 1 2; do
+	echo $i
+	cat <<END
+doc $i
+END
+done
+{ echo group
+}'
+
+# substitution
+check substitution 'sub xnested' 0 'echo $(echo sub) x$(echo $(echo nested))'
+check variable 'a-b' 0 'x=a; y=b; echo $x-$y'
+
+# globbing
+check glob "a.txt b.txt${new_line}c.log${new_line}a.txt b.txt${new_line}*.none" 0 \
+	'touch b.txt a.txt c.log; echo *.txt; echo ?.log; echo [ab].*; echo *.none; rm a.txt b.txt c.log'
+
+# exit statuses
+check exit_code '' 7 'exit 7'
+check false_status '' 1 'false'
+check last_status "1${new_line}0" 0 'false; echo $?; true; echo $?'
+output=$(cd "$WORK_DIR" && "$TINYSH" -c 'sh -c "kill -9 \$\$"; echo $?' 2>&1 | sed 's/([0-9]*)/(PID)/')
+report signaled_status "CHILD(PID) was terminated by signal 9${new_line}137" 0 "$output" 0
+
+# wait reports the exit code of the job it waited for
+check wait_job_status '7' 0 'false; sh -c "exit 7" & wait %1; echo $?'
+check wait_next_status "5${new_line}4" 0 \
+	'sh -c "sleep 0.2; exit 4" & sh -c "exit 5" & wait -n; echo $?; wait -n; echo $?'
+
+# a background job finishing while the shell waits for input leaves $? alone
+check_session background_keeps_status '1' "echo 'sleep 0.1 &'; echo false; sleep 0.5; echo 'echo \$?'"
+
+# a hashed program that went away is looked up again, and the stale path is forgotten
+mkdir "$WORK_DIR/bin1" "$WORK_DIR/bin2"
+printf '#!/bin/sh\necho first\n' > "$WORK_DIR/bin1/prog"
+printf '#!/bin/sh\necho second\n' > "$WORK_DIR/bin2/prog"
+chmod +x "$WORK_DIR/bin1/prog" "$WORK_DIR/bin2/prog"
+for backend in fork posix_spawn; do
+	cp "$WORK_DIR/bin1/prog" "$WORK_DIR/bin1/prog.keep"
+	output=$(cd "$WORK_DIR" && PATH="$WORK_DIR/bin1:$WORK_DIR/bin2:$PATH" TINYSH_SPAWN=$backend \
+		"$TINYSH" -c 'prog; rm bin1/prog; prog; hash > hashed; grep bin1 hashed || echo forgotten' 2>&1)
+	report "hash_evicted_$backend" "first${new_line}second${new_line}forgotten" 0 "$output" $?
+	mv "$WORK_DIR/bin1/prog.keep" "$WORK_DIR/bin1/prog"
+done
+
+# options that need a value
+check nice_value 'niced' 0 'nice -n 5 echo niced'
+check nice_missing_value 'usage: nice [-n N] command' 125 'nice -n'
+check limit_missing_value 'usage: limit [-v KB] [-n FILES] [-t SECONDS] command' 125 'limit -t 5 -n'
+
+echo "$((num_cases - num_failed)) of $num_cases checks passed"
+[ "$num_failed" -eq 0 ]
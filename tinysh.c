@@ -1,5 +1,6 @@
 // Author: Khuong Luu
 
+#define _GNU_SOURCE // pipe2, F_SETPIPE_SZ
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -11,136 +12,593 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sched.h>
+#include <time.h>
 typedef enum {false, true} bool;
 
+// How ExecuteCommand launches a child.
+// posix_spawn is the default since it avoids copying the shell's page tables,
+// fork is kept as a fallback and for comparison (TINYSH_SPAWN=fork)
+typedef enum {SPAWN_BACKEND_POSIX_SPAWN, SPAWN_BACKEND_FORK} SpawnBackend;
+
+// One resolved command in the PATH hash: name -> absolute path
+struct PathHashEntry {
+	char* name;
+	char* path;
+	int hits;
+	struct PathHashEntry* next;
+};
+
+// A shell variable. Its NAME=value line is what the environment snapshot points to once it is
+// exported, name and value point into it
+struct Variable {
+	char* entry; // malloc'd, capacity bytes
+	size_t capacity;
+	char* name; // not NUL terminated, name_length long
+	size_t name_length;
+	char* value;
+	bool is_exported;
+	struct Variable* next; // in the same bucket
+};
+
+// A line of history, where it is in the mapped history file. Not NUL terminated
+struct HistoryEntry {
+	size_t offset;
+	size_t length;
+};
+
+// Chunk of a bump allocator, see ArenaAlloc
+struct ArenaChunk {
+	struct ArenaChunk* next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+// Memory that lives exactly as long as one command line
+struct Arena {
+	struct ArenaChunk* chunks; // newest first
+	size_t total_size;
+};
+
+// How full an arena was, ArenaRelease goes back to it
+struct ArenaMark {
+	struct ArenaChunk* chunk;
+	size_t used;
+};
+
+typedef enum {GLOB_TEXT, GLOB_ANY, GLOB_STAR, GLOB_CLASS} GlobOpType;
+
+// One step of a compiled pattern piece: a run of literal text, ?, * or a [...] class
+struct GlobOp {
+	GlobOpType type;
+	const char* text; // GLOB_TEXT, length bytes
+	size_t length;
+	const uint32_t* class; // GLOB_CLASS, bit c set when the class takes c, negation applied
+};
+
+// What a pattern has between two '/'. A piece with no *, ? or [...] is only text,
+// which is looked up instead of matched against a listing
+struct GlobPiece {
+	struct GlobOp* ops;
+	int num_ops;
+	const char* text; // with the escapes removed, for a literal piece
+	size_t min_length; // names shorter than it cannot match
+	bool is_literal;
+	bool is_globstar; // exactly **: any number of directories
+	bool matches_hidden; // starts with a '.', names that do are not skipped
+};
+
+// A directory as read once by one command's pattern matching
+struct GlobEntry {
+	const char* name;
+	size_t length;
+	unsigned char type; // d_type, DT_UNKNOWN replaced once something had to lstat it
+};
+
+struct GlobDirectory {
+	const char* path; // as the pattern spelled it, "" for the working directory
+	size_t path_length;
+	struct GlobEntry* entries; // none when it could not be read
+	int num_entries;
+	struct GlobDirectory* next; // in the same bucket
+};
+
+// Directories read while expanding one command, in the command arena.
+// A directory many patterns or a ** walk go through is read only once
+struct GlobCache {
+	struct GlobDirectory* buckets[64];
+};
+
+// One pattern being matched: the path built so far and the matches found
+struct GlobWalk {
+	struct GlobCache* cache;
+	struct GlobPiece* pieces;
+	int num_pieces;
+	bool is_directory_only; // the pattern ends in '/', so does every match
+	char path[PATH_MAX];
+	char** matches;
+	int num_matches;
+	int capacity;
+};
+
+typedef enum {
+	TOKEN_WORD, TOKEN_PIPE, TOKEN_REDIRECT, TOKEN_BACKGROUND,
+	TOKEN_SEMICOLON, TOKEN_AND, TOKEN_OR, TOKEN_LPAREN, TOKEN_RPAREN, TOKEN_NEWLINE,
+} TokenType;
+
+// What a redirection operator does, the fd it applies to defaults to 0 or 1
+typedef enum {
+	REDIRECT_READ, // <
+	REDIRECT_WRITE, // >
+	REDIRECT_APPEND, // >>
+	REDIRECT_WRITE_ALL, // &> stdout and stderr
+	REDIRECT_APPEND_ALL, // &>>
+	REDIRECT_DUP_OUT, // N>&M, N>&-
+	REDIRECT_DUP_IN, // N<&M
+	REDIRECT_HEREDOC, // <<WORD
+	REDIRECT_HEREDOC_STRIP, // <<-WORD, leading tabs are removed
+	REDIRECT_HERESTRING, // <<<WORD
+} RedirectionType;
+
+// A word (quotes already removed) or an operator, text points into the command arena
+struct Token {
+	char* text;
+	TokenType type;
+	RedirectionType redirection; // TOKEN_REDIRECT only
+	int io_number; // the N of "N>", -1 for the operator's default
+	const char* source; // the token as typed, quotes included, in the input line
+	int source_length;
+	bool has_expansion; // a $ or ` outside single quotes, ExpandVariables rebuilds it from source
+	bool has_glob; // an unquoted *, ? or [...], ExpandVariables matches it against pathnames
+};
+
+// A string built up in an arena, moved to a twice bigger allocation when it is full
+struct ArenaString {
+	char* data;
+	size_t length;
+	size_t capacity;
+};
+
+// One redirection of a command, as written
+struct Redirection {
+	RedirectionType type;
+	int fd;
+	char* word; // path, source fd, here-doc delimiter or here-string
+	char* body; // here-docs and here-strings
+	size_t body_length;
+	bool is_body_expanded; // here-doc with an unquoted delimiter
+};
+
+// The redirections turned into dup2(from_fd, to_fd) calls, in order. from_fd -1 closes to_fd.
+// Files and here-doc bodies are opened by the shell, is_owned fds are closed after the launch
+struct FdAction {
+	int from_fd;
+	int to_fd;
+	bool is_owned;
+};
+
+// One stage of a pipeline: argv plus its own redirections
+struct Command {
+	char** argv; // NULL terminated
+	int num_tokens;
+	struct Redirection* redirections;
+	int num_redirections;
+	struct FdAction* fd_actions; // filled by OpenRedirections
+	int num_fd_actions;
+	char** assignments; // NAME=value words in front of argv, see CommandEnvironment
+	int num_assignments;
+};
+
+// "a | b | c", a single command is a one stage pipeline
+struct Pipeline {
+	struct Command* stages;
+	int num_stages;
+};
+
+// What a plan node does, see CompileList for the grammar
+typedef enum {
+	NODE_PIPELINE, // a | b
+	NODE_SEQUENCE, // left; right
+	NODE_AND, // left && right
+	NODE_OR, // left || right
+	NODE_BACKGROUND, // left &
+	NODE_GROUP, // { left; } runs in the shell
+	NODE_SUBSHELL, // ( left ) runs in a forked copy of the shell
+	NODE_FOR, // for name in words; do left; done
+	NODE_WHILE, // while left; do right; done
+	NODE_UNTIL, // until left; do right; done
+} NodeType;
+
+// One node of a compiled command line. Plans are cached and run again and again, so running
+// one changes nothing in it: a pipeline's tokens are copied to the command arena to be expanded
+struct PlanNode {
+	NodeType type;
+	struct PlanNode* left;
+	struct PlanNode* right;
+	struct Token* tokens; // pipelines: their words and operators; groups and loops: the redirections after them
+	int num_tokens;
+	int first_heredoc; // index of the first here-doc in tokens among the line's here-docs
+	char* name; // for: the loop variable
+	struct Token* words; // for: the words after "in", expanded each time the loop starts
+	int num_words;
+	char* text; // as typed, for job listings and the trace
+};
+
+// A command line compiled once, kept in the plan cache under the line itself
+struct Plan {
+	char* line;
+	struct PlanNode* root; // NULL for a blank line or a comment
+	struct Token** heredocs; // the << and <<- operators in line order, the delimiter follows each
+	int num_heredocs;
+	struct Plan* next; // in the same bucket
+};
+
+// What a ready epoll event refers to, stored in the top byte of epoll_event.data.u64
+typedef enum {EVENT_INPUT = 1, EVENT_SIGNAL, EVENT_JOB_PROCESS, EVENT_JOB_TIMER, EVENT_PARALLEL_TASK,
+	EVENT_SERVE_LISTEN, EVENT_SERVE_CLIENT, EVENT_SERVE_OUTPUT, EVENT_SERVE_REQUEST} EventKind;
+
+typedef enum {JOB_RUNNING, JOB_STOPPED} JobState;
+
+// How far a job's timeout has gone: the timer fires once for the signal, once more for SIGKILL
+typedef enum {TIMEOUT_NOT_FIRED, TIMEOUT_SIGNALED, TIMEOUT_KILLED} TimeoutStage;
+
+// timeout [-s SIG] [-k KILL_AFTER] DURATION, a duration of 0 means none
+struct JobTimeout {
+	uint64_t duration_ns;
+	uint64_t kill_after_ns; // 0: the signal is not followed by SIGKILL
+	int signal;
+};
+
+// A resource limit set by limit, soft and hard alike
+struct JobLimit {
+	int resource; // RLIMIT_AS, RLIMIT_NOFILE or RLIMIT_CPU
+	rlim_t value;
+};
+
+// pin, nice and limit in front of a pipeline: applied by each of the job's processes before the exec
+struct JobSettings {
+	bool has_affinity;
+	cpu_set_t affinity;
+	int nice; // added to the shell's niceness, 0 leaves it
+	struct JobLimit limits[3];
+	int num_limits;
+};
+
+// One process of a job
+struct JobProcess {
+	pid_t pid; // -1 if it could not be launched
+	int pidfd; // -1 unless the event loop watches it through a pidfd
+	bool is_watched; // reaped in the background, by pidfd event or by polling
+	bool is_done;
+	int wait_status;
+	struct rusage usage; // from wait4 once it is done
+};
+
+// A pipeline launched by ExecuteCommand.
+// Jobs live in a growable slot array whose unused slots form a free list, %n is slot n-1
+struct Job {
+	bool is_used;
+	int next_free_slot;
+	pid_t pgid; // 0 while the job shares the shell's process group, see NewJobProcessGroup
+	JobState state;
+	bool is_background;
+	struct JobProcess* processes;
+	int num_processes;
+	int num_live_processes;
+	char* command_line;
+	uint64_t start_ns; // CLOCK_MONOTONIC at launch
+	struct JobTimeout timeout;
+	int timer_fd; // -1 unless the job runs under timeout
+	TimeoutStage timeout_stage;
+	int exit_code; // of its last process, set by FinishJob and kept in the freed slot for wait
+};
+
+// What a finished job cost, summed over its processes
+struct JobUsage {
+	uint64_t wall_ns;
+	uint64_t user_ns;
+	uint64_t sys_ns;
+	long max_rss_kb; // of the largest process
+	long voluntary_switches;
+	long involuntary_switches;
+};
+
+// One command run by the parallel builtin, its output is held until the task is printed
+struct ParallelTask {
+	pid_t pid; // -1 if it could not be launched
+	int pidfd;
+	int stdout_fd; // memfds, -1 if output goes straight through
+	int stderr_fd;
+	bool is_done;
+	int wait_status;
+	struct rusage usage;
+};
+
+// A frame of the --serve protocol: this header in host byte order, then length bytes of payload.
+// The client sends SERVE_RUN with a command line, the server answers with any number of
+// SERVE_STDOUT and SERVE_STDERR frames and then one SERVE_EXIT holding the status as an int32_t
+typedef enum {SERVE_RUN = 1, SERVE_STDOUT, SERVE_STDERR, SERVE_EXIT} ServeFrameType;
+
+struct ServeFrame {
+	uint32_t request_id; // chosen by the client, every answer carries it
+	uint32_t type;
+	uint32_t length;
+};
+
+// A connection to the --serve shell. Frames both ways are buffered, the output goes out
+// as fast as the socket takes it
+struct ServeClient {
+	int fd; // -1 once hung up, the slot is free when none of its requests is left either
+	char* input;
+	size_t input_length;
+	size_t input_capacity;
+	char* output;
+	size_t output_length;
+	size_t output_sent;
+	size_t output_capacity;
+	bool is_waiting_writable; // EPOLLOUT is on
+	int num_requests;
+};
+
+// One command line run for a client by a forked copy of the --serve shell.
+// Free entries form a list like the job table's, see AllocateServeRequest
+struct ServeRequest {
+	int client; // slot, -1 for a free entry
+	int next_free;
+	uint32_t id;
+	pid_t pid; // leads a group of its own, -1 if nothing was forked
+	int pidfd; // -1 if there is none, polled on SIGCHLD instead
+	int output_fds[2]; // read ends of its stdout and stderr pipes, -1 once at end of file
+	bool is_paused; // not read while its client has too much output pending
+	bool is_exited;
+	int wait_status;
+};
+
+// Where one command line's time went, in nanoseconds, for the trace record
+struct CommandTrace {
+	uint64_t start; // CLOCK_MONOTONIC when reading the line began
+	uint64_t read_ns;
+	uint64_t parse_ns;
+	uint64_t expand_ns;
+	uint64_t redirect_ns; // pipeline split and "<" ">" extraction
+	uint64_t spawn_ns; // fork or posix_spawn calls, all stages
+	uint64_t exec_ns; // fork backend only: fork return until exec, posix_spawn returns after exec
+	uint64_t builtin_ns;
+	uint64_t wait_ns;
+	int num_stages;
+	bool is_builtin;
+};
+
+extern char** environ;
+
 // global vairiables
 int g_last_exit_code;
 int g_last_terminate_signal_code;
 int g_was_terminated;
 char g_working_directory[100];
 bool g_is_bg_command = false;
-pid_t g_background_pids[200];
-int g_num_background_pids = 0;
-bool g_is_child_proc = false;
-bool g_is_bg_proc = false;
+struct Job* g_jobs = NULL;
+int g_job_capacity = 0;
+int g_num_jobs = 0;
+int g_num_stopped_jobs = 0;
+int g_first_free_job_slot = -1;
+int g_job_high_water = 0; // slots at and above it have never been used since the table was last empty
+int g_current_job_slot = -1; // what fg and bg use without an argument
+int g_num_finished_jobs = 0; // bumped whenever a job completes, wait -n watches it
+int g_last_finished_job_slot = -1; // the slot of the job that completed last, for wait -n
+int g_num_unwatched_processes = 0; // background processes without a pidfd, polled instead
+pid_t g_foreground_pgid = 0; // SIGINT is forwarded to this group when set
+int g_terminal_fd = -1; // the controlling terminal of an interactive shell, see SetupTerminal
+pid_t g_shell_pgid = 0; // the group the terminal goes back to after a foreground job
+struct ParallelTask* g_parallel_tasks = NULL; // tasks of the running parallel builtin
+int g_num_parallel_tasks = 0; // entries of g_parallel_tasks, launched or not
+int g_num_running_parallel_tasks = 0;
+int* g_parallel_completion_order = NULL; // task indexes in the order they were reaped
+int g_num_completed_parallel_tasks = 0;
+int g_last_parallel_num_tasks = 0; // summary for status, 0 once another command finished
+int g_last_parallel_num_failed = 0;
+struct ServeClient* g_serve_clients = NULL; // --serve connections, a growable slot array
+int g_num_serve_client_slots = 0;
+struct ServeRequest* g_serve_requests = NULL; // running requests of all connections
+int g_num_serve_request_slots = 0;
+int g_num_serve_requests = 0;
+int g_first_free_serve_request = -1;
+int g_serve_request_high_water = 0; // entries at and above it have not been used since none ran
+int g_serve_listen_fd = -1;
+int g_serve_null_fd = -1; // stdin of every request
+int g_serve_stderr_fd = -1; // the server's own stderr while fd 2 is lent to a request
+struct Variable* g_variables[512];
+int g_num_exported_variables = 0;
+char** g_environment = NULL; // see ShellEnvironment
+int g_history_fd = -1; // lines typed at the prompt are appended to it, -1 when no history is kept
+char* g_history_mapping = NULL; // the history file, see SetupHistory and IndexHistory
+size_t g_history_mapping_length = 0;
+struct HistoryEntry* g_history_entries = NULL; // oldest first, filled by IndexHistory
+int g_num_history_entries = 0;
+int g_history_capacity = 0;
+uint64_t* g_history_filters = NULL; // HISTORY_FILTER_WORDS for every HISTORY_BLOCK_ENTRIES entries
+size_t g_history_indexed_length = 0; // bytes of the history file cut into entries
+bool g_is_history_indexed = false; // all of it was, as of the last line typed
+char* g_dirent_buffer = NULL; // GLOB_DIRENT_BUFFER_SIZE, allocated by the first pattern that reads a directory
+bool g_is_environment_stale = true;
+struct Plan* g_plan_cache[256];
+int g_num_compiled_plans = 0; // since the cache was last cleared
+struct Arena g_plan_arena = {0}; // plans and their lines and tokens, freed only with the whole cache
+char** g_heredoc_bodies = NULL; // the current line's here-doc bodies as read, in the command arena
+size_t* g_heredoc_body_lengths = NULL;
+int g_num_heredoc_bodies = 0; // read so far, a line continued over several lines reads them as it goes
+int g_num_substitutions = 0; // $(...) and `...` run so far, NAME=value alone takes their status
+bool g_is_subshell = false; // a forked copy of the shell running ( ... ) or a background list
+struct JobTimeout g_last_timeout = {0}; // of the last finished job, for status
+TimeoutStage g_last_timeout_stage = TIMEOUT_NOT_FIRED; // reset once another command finished
+struct JobUsage g_last_job_usage = {0}; // last foreground job or parallel run, for status -v and time
+bool g_has_last_job_usage = false;
+struct JobUsage g_substitution_usage = {0}; // $(...) children reaped for the pipeline being run, go to its job
 bool g_bg_command_enable = true;
 bool g_signal_caught = false;
-int g_file_src;
-int g_file_dest;
-char* g_file_src_path = NULL;
-char* g_file_dest_path = NULL;
+SpawnBackend g_spawn_backend = SPAWN_BACKEND_POSIX_SPAWN;
+struct PathHashEntry* g_path_hash[64];
+int g_num_path_hash_entries = 0;
+char* g_path_hash_path_env = NULL; // $PATH the hash was filled against
+int g_stale_path_fds[2] = {-1, -1}; // fork children name a hashed path that failed, see ForgetStalePaths
+int g_epoll_fd = -1;
+int g_signal_fd = -1; // the blocked signals, read by the event loop
+int g_input_fd = STDIN_FILENO; // where command lines are read from, unless g_input_data is set
+bool g_input_is_pollable = true; // false for regular files, which epoll refuses
+bool g_is_interactive = true; // prompt for input
+bool g_is_command_string = false; // -c: the last command may replace the shell
+const char* g_input_data = NULL; // whole input at once: a mapped script or the -c string
+size_t g_input_data_length = 0;
+size_t g_input_data_position = 0;
+char* g_input_buffer = NULL;
+size_t g_input_buffer_size = 0;
+size_t g_input_buffer_length = 0; // bytes read from g_input_fd so far
+size_t g_input_buffer_consumed = 0; // bytes already handed out as lines
+struct Arena g_command_arena = {0}; // reset at the start of every command line
+char g_shell_pid_string[16]; // $$, formatted once at startup
+pid_t g_last_background_pid = 0; // $!, 0 before the first background job
+int g_trace_fd = -1; // JSON-lines trace of every command, -1 when tracing is off
+struct CommandTrace g_trace = {0};
 
 // structs
-struct sigaction g_sigint_action = {0};
-struct sigaction g_sigterm_action = {0};
-struct sigaction g_sigtstp_action = {0};
 sigset_t g_blocked_signal_set;
 
 // constants
 const int MAX_INPUT_LENGTH = 2049;
-const int MAX_ARG_LENGTH = 50;
 const int MAX_NUM_ARG = 512;
-const int MAX_NUM_TOKENS = 50;
 const int MAX_PATH_LENGTH = 100;
-const int MAX_TOKEN_LENGTH = 50;
-const int MAX_BG_PID = 200;
 const int FORK_FAILED_ERROR_CODE = 1;
 const int EXECUTE_FAILED_ERROR_CODE = 1;
 const int WAIT_FAILED_ERROR_CODE = 1;
-const int DEFAULT_BG_PID = -3;
 const int DEFAULT_NEG_INT = -5;
 const int NO_REDIRECTION = -1;
 const int NOT_FOUND = -1;
+const int PATH_HASH_BUCKETS = 64;
+const int PIPE_BUFFER_SIZE = 256 * 1024;
+const size_t STALE_PATH_RECORD_SIZE = 256; // a name on g_stale_path_fds, one atomic pipe write
+const int EVENT_KIND_SHIFT = 56;
+const int MAX_EPOLL_EVENTS = 16;
+const int INPUT_READ_SIZE = 64 * 1024;
+const int INITIAL_JOB_CAPACITY = 16;
+const int JOB_PROCESS_INDEX_BITS = 24;
+const pid_t KEEP_SHELL_PGROUP = -1;
+const size_t ARENA_CHUNK_SIZE = 64 * 1024;
+const int INITIAL_TOKEN_CAPACITY = 64;
+const int VARIABLE_BUCKETS = 512;
+const int GLOB_CACHE_BUCKETS = 64;
+const int HISTORY_BLOCK_ENTRIES = 128; // entries that share one trigram filter
+const unsigned int HISTORY_FILTER_BITS = 8192;
+const int HISTORY_FILTER_WORDS = 8192 / 64;
+const size_t HISTORY_INDEX_STEP = 256 * 1024; // history indexed at a time while waiting for input
+const size_t GLOB_DIRENT_BUFFER_SIZE = 128 * 1024; // getdents64 batch, a few thousand entries
+const int PLAN_CACHE_BUCKETS = 256;
+const int PLAN_CACHE_MAX = 1024; // plans compiled before the cache starts over
+const int SUBSTITUTION_READ_MIN = 4096; // spare room for each read of a substitution's output
+const int HEREDOC_PIPE_MAX = 4096; // bodies up to this size always fit in a pipe, bigger ones go to a memfd
+const int FIRST_PRIVATE_FD = 10; // fds the user can redirect are below it
+const int PARALLEL_MAX_HELD_TASKS = 256; // -k: finished tasks waiting for an earlier one to print
+const int PARALLEL_MAX_EXIT_CODE = 101; // status of parallel is the number of failed tasks, capped
+const int TIMEOUT_EXIT_CODE = 124; // a job that timed out, unless SIGKILL ended it
+const int TIMEOUT_FAILED_EXIT_CODE = 125; // timeout itself could not run the job
+const int SETTINGS_FAILED_EXIT_CODE = 125; // pin, nice or limit could not be applied
+const int DEFAULT_NICE_ADJUSTMENT = 10; // nice without -n
+const int MAX_JOB_LIMITS = 3;
+const int LOOP_EVENT_INTERVAL = 64; // loop iterations between looks at signals and finished jobs
+const int SYNTAX_ERROR_EXIT_CODE = 2;
+const size_t SERVE_READ_SIZE = 64 * 1024; // the most one read puts into a frame
+const size_t SERVE_OUTPUT_MAX = 1024 * 1024; // output a client has pending before its requests are paused
+const uint32_t SERVE_COMMAND_MAX = 1024 * 1024; // longest command line a client may send
+const int SERVE_CLIENT_WINDOW = 64; // --client: requests in flight when -j is not given
 
 
 // Signal //
 
-// NOTE: strcpy and strcat is async-safe 
-void PrintMessage(const char* message) {
-	char buffer[50];
-	memset(buffer, '\0', sizeof(buffer));
-	strcpy(buffer, message);
-	strcat(buffer, "\n\0");
-	write(STDOUT_FILENO, buffer, 50);
+// SIGINT, SIGTERM, SIGTSTP and SIGCHLD stay blocked in the shell for its whole life and
+// arrive through g_signal_fd instead, so they are handled between events, never in the
+// middle of printf or malloc. Children start with an empty mask
+void SetupBlockSignals() {
+	sigemptyset(&g_blocked_signal_set);
+	sigaddset(&g_blocked_signal_set, SIGINT);
+	sigaddset(&g_blocked_signal_set, SIGTERM);
+	sigaddset(&g_blocked_signal_set, SIGTSTP);
+	sigaddset(&g_blocked_signal_set, SIGCHLD);
+	sigaddset(&g_blocked_signal_set, SIGTTOU); // blocked, tcsetpgrp works from outside the foreground
+	sigprocmask(SIG_BLOCK, &g_blocked_signal_set, NULL);
 }
 
-// Child
-void child_catch_sigint(int signo) {
-	PrintMessage("CHILD caught SIGINT");
-	if (g_is_bg_proc) {
-		// do nothing
-		PrintMessage("bg CHILD caught SIGINT");
-		return;	
-	}
-	exit(SIGINT);
-}
+// Interactive on a terminal: the shell leads a process group of its own and the terminal is
+// handed to each foreground job's group while it runs, so ^C and ^Z reach the job alone
+void SetupTerminal(void) {
+	pid_t pgid;
 
-void child_catch_sigterm(int signo) {
-	PrintMessage("CHILD caught SIGNTERM");
-	if (g_is_bg_proc) {
-		// do nothing
-		PrintMessage("bg CHILD caught SIGINT");
-		return;	
+	if (!g_is_interactive || !isatty(STDIN_FILENO)) return;
+	// started in the background: wait to be brought to the foreground, as other shells do
+	while (tcgetpgrp(STDIN_FILENO) != (pgid = getpgrp())) {
+		kill(-pgid, SIGTTIN);
 	}
-	exit(SIGTERM);
+	if (pgid != getpid()) setpgid(0, 0);
+	g_shell_pgid = getpgrp();
+	g_terminal_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, FIRST_PRIVATE_FD);
+	if (g_terminal_fd != -1) tcsetpgrp(g_terminal_fd, g_shell_pgid);
 }
 
-// Parent
-void parent_catch_sigint(int signo) {
-	PrintMessage("PARENT caught SIGINT");
-	g_signal_caught = true;	
-	//kill(-1, SIGINT); // set SIGNINT to all childs
-}
+void GiveTerminal(pid_t pgid) {
+	if (g_terminal_fd != -1) tcsetpgrp(g_terminal_fd, pgid);
+} 
 
-void parent_catch_sigterm(int signo) {
-	PrintMessage("PARENT caught SIGTERM");
-	g_signal_caught = true;	
-	kill(-1, SIGTERM); // set SIGTERM to all childs
-	PrintMessage("PARENT sent SIGTERM");
-}
+struct SignalName {
+	const char* name;
+	int number;
+};
 
-void parent_catch_sigtstp(int signo) {
-	PrintMessage("PARENT caught SIGTSTP");
-	g_signal_caught = true;	
-	if (g_bg_command_enable == false) {
-		g_bg_command_enable = true;
-		PrintMessage("Exiting fore-ground only mode");
-	} else {
-		g_bg_command_enable = false;
-		PrintMessage("Entering fore-ground only mode");
-	}
-}
+struct SignalName g_signal_names[] = {
+	{"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1},
+	{"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CONT", SIGCONT},
+	{"STOP", SIGSTOP}, {"TSTP", SIGTSTP},
+};
 
-// Signal Handlers
+// TERM, SIGTERM or 15. Returns -1 if it names no signal
+int ParseSignal(const char* text) {
+	char* end;
+	long number;
+	size_t i;
 
-void SetupSignalHandlers() {
-	// SIGINT
-	g_sigint_action.sa_flags = 0;
-	g_sigint_action.sa_handler = parent_catch_sigint;
-	sigfillset(&g_sigint_action.sa_mask);
-	sigaction(SIGINT, &g_sigint_action, NULL);
+	if (strncmp(text, "SIG", 3) == 0) text += 3;
+	for (i = 0; i < sizeof(g_signal_names) / sizeof(g_signal_names[0]); i++) {
+		if (strcmp(text, g_signal_names[i].name) == 0) return g_signal_names[i].number;
+	}
+	number = strtol(text, &end, 10);
+	if (end == text || *end != '\0' || number <= 0 || number >= NSIG) return -1;
+	return (int)number;
+}
 
-	// SIGTERM
-	g_sigterm_action.sa_flags = 0;
-	g_sigterm_action.sa_handler = parent_catch_sigterm;
-	sigfillset(&g_sigterm_action.sa_mask); 
-	sigaction(SIGTERM, &g_sigterm_action, NULL);
+// "TERM", or the number for one without a name here
+const char* SignalName(int number) {
+	static char buffer[16];
+	size_t i;
 
-	// SIGTSTP
-	g_sigtstp_action.sa_flags = 0;
-	g_sigtstp_action.sa_handler = parent_catch_sigtstp;
-	sigfillset(&g_sigtstp_action.sa_mask); 
-	sigaction(SIGTSTP, &g_sigtstp_action, NULL);
+	for (i = 0; i < sizeof(g_signal_names) / sizeof(g_signal_names[0]); i++) {
+		if (g_signal_names[i].number == number) return g_signal_names[i].name;
+	}
+	snprintf(buffer, sizeof(buffer), "%d", number);
+	return buffer;
 }
 
-// For critical code segment where we don't want to be interrupted by blockable signals
-void SetupBlockSignals() {
-	sigemptyset(&g_blocked_signal_set);
-	sigaddset(&g_blocked_signal_set, SIGINT);
-	sigaddset(&g_blocked_signal_set, SIGTERM);
-	sigaddset(&g_blocked_signal_set, SIGTSTP);
-} 
-
 // Debug purpose
 void PrintTokens(FILE* out_file, char* tokens[], int num_tokens) {
 	fprintf(out_file, "Tokens: ");
@@ -151,608 +609,6354 @@ void PrintTokens(FILE* out_file, char* tokens[], int num_tokens) {
 	printf("\n");
 }
 
-char* GetUserCommand(char* input_string) {
-	input_string = NULL;
-	size_t len = 0;
-	// internally, getline here then use rellocate to alloc memory
-	getline(&input_string, &len, stdin);
-	// getline does read the '\n', so pick it off
-	input_string[strlen(input_string)-1] = '\0';	
-	return input_string;
-}	
-
-// look for old_substring in buffer and replace it with new_substring 
-void ReplaceString(char* original_string, char* search_substring, char* replace_substring) {
-	char buffer[MAX_ARG_LENGTH];
-	char* found_pos = NULL;
-
-	found_pos = strstr(original_string, search_substring);
-	if (!found_pos) {
-		return;
-	}
-
-	int prefix_length;
-	prefix_length = found_pos - original_string;
-	strncpy(buffer, original_string, prefix_length);
-	buffer[prefix_length] = '\0';
-	
-	int suffix_length;
-	suffix_length = strlen(search_substring);
-	sprintf(buffer+prefix_length, "%s%s", replace_substring, found_pos+suffix_length);
+// Arena //
 
-	strcpy(original_string, buffer);
-	
-}
+// Bump allocation out of the newest chunk, a bigger chunk is added when it is full
+void* ArenaAlloc(struct Arena* arena, size_t size) {
+	struct ArenaChunk* chunk = arena->chunks;
+	void* memory;
 
-// replace substring "$$" by getid()
-void ExpandDollaSign(char* command_tokens[], int num_tokens) {
-	int i;
-	for (i = 1; i < num_tokens; i++) {
-		char pid[20];
-		//char* buffer;
-		memset(pid, '\0', sizeof(pid));
-		sprintf(pid, "%d\0", (int)getpid());
-		ReplaceString(command_tokens[i], "$$", pid);
+	size = (size + 15) & ~(size_t)15;
+	if (chunk == NULL || chunk->used + size > chunk->size) {
+		size_t chunk_size = ARENA_CHUNK_SIZE;
+		if (chunk_size < arena->total_size) chunk_size = arena->total_size; // grow geometrically
+		if (chunk_size < size) chunk_size = size;
+		chunk = (struct ArenaChunk*)malloc(sizeof(struct ArenaChunk) + chunk_size);
+		if (chunk == NULL) {
+			perror("malloc()");
+			exit(1);
+		}
+		chunk->next = arena->chunks;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		arena->chunks = chunk;
+		arena->total_size += chunk_size;
 	}
+	memory = chunk->data + chunk->used;
+	chunk->used += size;
+	return memory;
 }
 
-int ParseCommand(char input_string[], char* input_tokens[]) {
-	const char delim[2] = " ";
-	char input_string_cpy[50];
-	int num_tokens = 0;
-
-	// copy actual input string to a cpy version to use in strtok
-	// because strtok modifies the source string
-	memset(input_string_cpy, '\0', sizeof(input_string_cpy));
-	strcpy(input_string_cpy, input_string);
-
-	// Painful, annoying part - use strtok!
-	char *token = NULL;
-	token = strtok(input_string_cpy, delim); // result: token = command name
-	int i = 0;
-	while (token != NULL) {
-		input_tokens[i] = (char*)calloc(MAX_TOKEN_LENGTH, sizeof(char));
-		memset(input_tokens[i], '\0', MAX_TOKEN_LENGTH);
-		strcpy(input_tokens[i], token);	
-		i++;
-		token = strtok(NULL, delim);
-	}
-	num_tokens = i;
+char* ArenaStrndup(struct Arena* arena, const char* string, size_t length) {
+	char* copy = (char*)ArenaAlloc(arena, length + 1);
+	memcpy(copy, string, length);
+	copy[length] = '\0';
+	return copy;
+}
 
-	if (token != NULL) {
-		//free(token);
-		token = NULL;
-	}
-	return num_tokens;
+void ArenaStringInit(struct Arena* arena, struct ArenaString* string, size_t capacity) {
+	string->data = (char*)ArenaAlloc(arena, capacity + 1);
+	string->length = 0;
+	string->capacity = capacity;
 }
 
-void InitBackgroundPidArray() {
-	int i;
-	for (i = 0; i < MAX_BG_PID; i++) {
-		g_background_pids[i] = DEFAULT_BG_PID;
+// Room for length more bytes after the data, which may move
+void ArenaStringReserve(struct Arena* arena, struct ArenaString* string, size_t length) {
+	if (string->length + length > string->capacity) {
+		size_t capacity = string->capacity * 2;
+		char* data;
+		if (capacity < string->length + length) capacity = string->length + length;
+		data = (char*)ArenaAlloc(arena, capacity + 1);
+		memcpy(data, string->data, string->length);
+		string->data = data;
+		string->capacity = capacity;
 	}
-	g_num_background_pids = 0;
 }
 
-// Prepare for the first reading
-void InitTokenBuffer(char* token_buffer[]) {
-	int i;
-	for (i = 0; i < MAX_NUM_TOKENS; ++i) {
-		token_buffer[i] = NULL;
-	}
+void ArenaStringAppend(struct Arena* arena, struct ArenaString* string, const char* text, size_t length) {
+	ArenaStringReserve(arena, string, length);
+	memcpy(string->data + string->length, text, length);
+	string->length += length;
 }
 
-// Clean up buffer for the next reading 
-int ResetTokenBuffer(char* token_buffer[], int num_tokens) {
-	int i;
-	for (i = 0; i < num_tokens; ++i) {
-		if (token_buffer[i] != NULL) {
-			//free(token_buffer[i]);
-			token_buffer[i] = NULL;
-		}
-	}
-	num_tokens = 0;
-	return num_tokens;	
+// the data, NUL terminated
+char* ArenaStringFinish(struct ArenaString* string) {
+	string->data[string->length] = '\0';
+	return string->data;
 }
 
-void PrintChildExitStatus(pid_t actual_pid, int child_exit_status) {
-	/*
- 	* WIFEXITED return non-zero if the process terminates normally 
- 	* WEXITSTATUS return actual exit status
- 	*
- 	* WIFSIGNALED return non-zero if the process was terminated by a signal
- 	* WTERMISG return the terminating signal
- 	* 
- 	* Only ONE of the WIFEXITED() and WIFSIGNALED() will be non-zero
- 	* => Use both to know how a child process died
- 	*
- 	* 
- 	* */
-	if (actual_pid == -1) {
-		perror("Wait failed\n");
-		exit(WAIT_FAILED_ERROR_CODE);	
-	}
-	if (WIFEXITED(child_exit_status) != 0) {
-		g_last_exit_code = WEXITSTATUS(child_exit_status);
-		g_was_terminated = false;
+// Forget every allocation but keep the memory. Several chunks are merged into one
+// big enough for all of them, so a repeated command of the same size fits without malloc
+void ArenaReset(struct Arena* arena) {
+	struct ArenaChunk* chunk = arena->chunks;
+	size_t total_size = arena->total_size;
+
+	if (chunk == NULL) return;
+	if (chunk->next == NULL) {
+		chunk->used = 0;
+		return;
 	}
-	else if (WIFSIGNALED(child_exit_status != 0)) {
-		printf("CHILD(%d) was terminated by signal ", actual_pid);
-		printf("%d\n", WTERMSIG(child_exit_status));	
-		g_last_terminate_signal_code = WTERMSIG(child_exit_status);
-		g_was_terminated = true;
+	while (chunk != NULL) {
+		struct ArenaChunk* next = chunk->next;
+		free(chunk);
+		chunk = next;
 	}
+	arena->chunks = NULL;
+	arena->total_size = 0;
+	ArenaAlloc(arena, total_size);
+	arena->chunks->used = 0;
 }
 
+struct ArenaMark ArenaGetMark(struct Arena* arena) {
+	struct ArenaMark mark;
 
-// Block parent process until this child finish
-void WaitChildBlock(pid_t child_pid) {
-	int child_exit_status = DEFAULT_NEG_INT;
-	pid_t actual_pid = DEFAULT_NEG_INT;
-
-	//printf("Parent(%d) is waiting for child(%d) to terminate\n", getpid(), child_pid); // debug
+	mark.chunk = arena->chunks;
+	mark.used = mark.chunk != NULL ? mark.chunk->used : 0;
+	return mark;
+}
 
-	// block parent until the child process with 
-	actual_pid = waitpid(child_pid, &child_exit_status, 0); 
+// Forget what was allocated since mark was taken. Loops release after each iteration so the
+// command arena does not grow with them. Of the chunks added since, the first one is kept empty,
+// an iteration that does not fit the rest of the marked chunk would malloc and free it every time
+void ArenaRelease(struct Arena* arena, struct ArenaMark mark) {
+	struct ArenaChunk* chunk = arena->chunks;
 
-	PrintChildExitStatus(actual_pid, child_exit_status);
+	if (mark.chunk != NULL) mark.chunk->used = mark.used;
+	if (chunk == mark.chunk) return;
+	while (chunk->next != mark.chunk) {
+		struct ArenaChunk* next = chunk->next;
+		arena->total_size -= chunk->size;
+		free(chunk);
+		chunk = next;
+	}
+	chunk->used = 0;
+	arena->chunks = chunk;
 }
 
-// put a pid to the global array to interact later
-void KeepTrackPid(pid_t child_pid) {
-	g_background_pids[g_num_background_pids] = child_pid;
-	g_num_background_pids++;
-}
+// Variables //
 
+// FNV-1a like HashString, over a name that is not NUL terminated
+unsigned int HashName(const char* name, size_t length) {
+	unsigned int hash = 2166136261u;
+	size_t i;
 
-void PrintBackgroundPidBegins(pid_t child_pid) {
-	fprintf(stdout, "Background process %d has begun\n", (int)child_pid);
+	for (i = 0; i < length; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
 }
 
-// 
-void CheckAndPrintCompletedProcs() {
-	int child_exit_status = DEFAULT_NEG_INT;
-	pid_t actual_pid = DEFAULT_NEG_INT;
+struct Variable* FindVariable(const char* name, size_t length) {
+	struct Variable* variable = g_variables[HashName(name, length) % VARIABLE_BUCKETS];
 
-	int i;
-	for (i = 0; i < g_num_background_pids; i++) {
-		// NOHANG: non-block waiting
-		actual_pid = waitpid(g_background_pids[i], &child_exit_status, WNOHANG);
-		if (actual_pid == g_background_pids[i]) {
-			fprintf(stdout, "Background process %d has completed\n", (int)actual_pid);
-			g_num_background_pids--;
-			PrintChildExitStatus(actual_pid, child_exit_status);
-		}
+	while (variable != NULL && !(variable->name_length == length && memcmp(variable->name, name, length) == 0)) {
+		variable = variable->next;
 	}
-
-	
+	return variable;
 }
 
-void PrintReceivedCommand(int num_token, char* command_tokens[]) {
-	int i;
-	for (i = 0; i < num_token; ++i) {
-		printf("%s ", command_tokens[i]);
-	}
-	printf("\n");
+// The value of a set variable, NULL otherwise
+char* LookupVariable(const char* name) {
+	struct Variable* variable = FindVariable(name, strlen(name));
+	return variable != NULL ? variable->value : NULL;
 }
 
-// delete character at the <pos>th  position
-void ShiftLeftArrayFromPos(char* command_tokens[], int num_tokens, int pos) {
-	int i;
-	for (i = pos; i < num_tokens-1; i++) {
-		memset(command_tokens[i], '\0', sizeof(command_tokens[i]));
-		strcpy(command_tokens[i], command_tokens[i+1]);
+// Set or create a variable, exported or not as it was. The NAME=value line is rewritten in
+// place when it fits, so a loop variable costs no allocation and the environment snapshot
+// stays valid; one that moves makes the snapshot stale if the variable is exported
+struct Variable* SetVariable(const char* name, size_t name_length, const char* value, size_t value_length) {
+	unsigned int bucket = HashName(name, name_length) % VARIABLE_BUCKETS;
+	struct Variable* variable = FindVariable(name, name_length);
+	size_t size = name_length + value_length + 2;
+	char* entry;
+
+	if (variable == NULL) {
+		variable = (struct Variable*)calloc(1, sizeof(struct Variable));
+		if (variable == NULL) {
+			perror("calloc()");
+			exit(1);
+		}
+		variable->name_length = name_length;
+		variable->next = g_variables[bucket];
+		g_variables[bucket] = variable;
 	}
-}
-int RemoveElementByPosition(char* command_tokens[], int num_tokens, int pos) {
-	ShiftLeftArrayFromPos(command_tokens, num_tokens, pos);
-	if (command_tokens[num_tokens-1] != NULL) {
-		//free(command_tokens[num_tokens-1]);
-		command_tokens[num_tokens-1] = NULL;
+	if (size > variable->capacity) {
+		variable->capacity = variable->capacity == 0 ? size : size * 2;
+		entry = (char*)malloc(variable->capacity);
+		if (entry == NULL) {
+			perror("malloc()");
+			exit(1);
+		}
+		memcpy(entry, name, name_length);
+		entry[name_length] = '=';
+		free(variable->entry);
+		variable->entry = entry;
+		variable->name = variable->entry;
+		variable->value = variable->entry + name_length + 1;
+		if (variable->is_exported) g_is_environment_stale = true;
 	}
-	num_tokens--;
-	return num_tokens;
+	memcpy(variable->value, value, value_length);
+	variable->value[value_length] = '\0';
+	return variable;
 }
 
-int RemoveRedirectionTokens(char* command_tokens[], int num_tokens, int pos) {
-	num_tokens = RemoveElementByPosition(command_tokens, num_tokens, pos); // remove "<"
-	num_tokens = RemoveElementByPosition(command_tokens, num_tokens, pos); // remove "path"
-	return num_tokens;	
+void ExportVariable(struct Variable* variable, bool is_exported) {
+	if (variable->is_exported == is_exported) return;
+	variable->is_exported = is_exported;
+	g_num_exported_variables += is_exported ? 1 : -1;
+	g_is_environment_stale = true;
 }
 
-// find the "<" or the ">" symbol and return its position in tokens array
-int FindRedirectionSymbol(char* command_tokens[], int num_tokens, const char* symbol) { 
-	int i;
-	int symbol_pos = NOT_FOUND;
-	for (i = 0; i < num_tokens; i++) {
-		if (!strcmp(command_tokens[i], symbol)) {
-			symbol_pos = i;
-			return symbol_pos;
+void UnsetVariable(const char* name, size_t name_length) {
+	struct Variable** link = &g_variables[HashName(name, name_length) % VARIABLE_BUCKETS];
+	struct Variable* variable;
+
+	while ((variable = *link) != NULL) {
+		if (variable->name_length == name_length && memcmp(variable->name, name, name_length) == 0) {
+			ExportVariable(variable, false);
+			*link = variable->next;
+			free(variable->entry);
+			free(variable);
+			return;
 		}
+		link = &variable->next;
 	}
-	return symbol_pos;
 }
 
-// Pick off "<" and the pathname right next to it
-// and set corresponding flags
-int ProcessInputRedirection(char* command_tokens[], int num_tokens) {
+// The NAME=value lines of every exported variable, NULL terminated: what programs are started
+// with. Rebuilt only after a variable was exported, unexported or unset, or outgrew its line,
+// never for a launch
+char** ShellEnvironment(void) {
+	struct Variable* variable;
+	int num_entries = 0;
 	int i;
-	int symbol_pos;
-
-	symbol_pos = FindRedirectionSymbol(command_tokens, num_tokens, "<");
-	if (symbol_pos == NOT_FOUND) { 
-		g_file_src_path = NULL;
-		return num_tokens;
-	}
 
-	g_file_src = open(command_tokens[symbol_pos+1], O_RDONLY);
-	if (g_file_src == -1) {
-		perror("error: source open()");
+	if (!g_is_environment_stale) return g_environment;
+	g_environment = (char**)realloc(g_environment, (g_num_exported_variables + 1) * sizeof(char*));
+	if (g_environment == NULL) {
+		perror("realloc()");
 		exit(1);
 	}
-
-	g_file_src_path = (char*)calloc(MAX_TOKEN_LENGTH, sizeof(char));
-	memset(g_file_src_path, '\0', sizeof(g_file_src_path));
-	strcpy(g_file_src_path, command_tokens[symbol_pos+1]);
-	
-	num_tokens = RemoveRedirectionTokens(command_tokens, num_tokens, symbol_pos);
-	return num_tokens;
+	for (i = 0; i < VARIABLE_BUCKETS; i++) {
+		for (variable = g_variables[i]; variable != NULL; variable = variable->next) {
+			if (variable->is_exported) g_environment[num_entries++] = variable->entry;
+		}
+	}
+	g_environment[num_entries] = NULL;
+	g_is_environment_stale = false;
+	return g_environment;
 }
 
-// Pick off ">" and the pathname right next to it
-// and set corresponding flags
-int ProcessOutputRedirection(char* command_tokens[], int num_tokens) {
-	int i;
-	int symbol_pos;
+// The environment tinysh was started with becomes its exported variables
+void ImportEnvironment(void) {
+	char** entry;
+	char* equals;
 
-	symbol_pos = FindRedirectionSymbol(command_tokens, num_tokens, ">");
-	if (symbol_pos == NOT_FOUND) { 
-		g_file_dest_path = NULL;
-		return num_tokens;
+	for (entry = environ; *entry != NULL; entry++) {
+		equals = strchr(*entry, '=');
+		if (equals == NULL || equals == *entry) continue;
+		ExportVariable(SetVariable(*entry, equals - *entry, equals + 1, strlen(equals + 1)), true);
 	}
+}
 
-	g_file_dest = open(command_tokens[symbol_pos+1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (g_file_dest == -1) {
-		perror("error: source open()");
-		exit(1);
-	}
+// Trace //
 
-	g_file_dest_path = (char*)calloc(MAX_TOKEN_LENGTH, sizeof(char));
-	memset(g_file_dest_path, '\0', sizeof(g_file_dest_path));
-	strcpy(g_file_dest_path, command_tokens[symbol_pos+1]);
-	
-	num_tokens = RemoveRedirectionTokens(command_tokens, num_tokens, symbol_pos);
-	return num_tokens;
+// TINYSH_TRACE=file, TINYSH_TRACE_FD=n or --trace file: one JSON record per command line
+void SetupTrace(const char* trace_path) {
+	char* trace_fd_string = getenv("TINYSH_TRACE_FD");
+
+	if (trace_path == NULL) trace_path = getenv("TINYSH_TRACE");
+	if (trace_path != NULL && trace_path[0] != '\0') {
+		g_trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (g_trace_fd == -1) {
+			fprintf(stderr, "tinysh: trace %s: %s\n", trace_path, strerror(errno));
+		}
+	} else if (trace_fd_string != NULL && trace_fd_string[0] != '\0') {
+		// the fd must not leak into the commands being traced
+		g_trace_fd = fcntl(atoi(trace_fd_string), F_DUPFD_CLOEXEC, 10);
+		if (g_trace_fd == -1) {
+			fprintf(stderr, "tinysh: TINYSH_TRACE_FD=%s: %s\n", trace_fd_string, strerror(errno));
+		}
+	}
 }
 
-// NOTE: This also takes out "<" and ">" and pathname(s), if any, out of command_tokens
-int ProcessIORedirection(char* command_tokens[], int num_tokens) {
-	num_tokens = ProcessInputRedirection(command_tokens, num_tokens); 
-	num_tokens = ProcessOutputRedirection(command_tokens, num_tokens); 
-	return num_tokens;
+uint64_t MonotonicNs(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
 }
 
-void ResetInputRedirect(void) {
-	g_file_src = 0;
-	if (g_file_src_path != NULL) {
-		//free(g_file_src_path);
-		g_file_src_path = NULL;
-	}
+// CLOCK_MONOTONIC in ns, 0 without a clock read when tracing is off
+uint64_t TraceClock(void) {
+	if (g_trace_fd == -1) return 0;
+	return MonotonicNs();
 }
 
-void ResetOutputRedirect(void) {
-	g_file_dest = 1;
-	if (g_file_dest_path != NULL) {
-		//free(g_file_dest_path);
-		g_file_dest_path = NULL;
+// the command line as a JSON string body
+char* JsonEscape(const char* string) {
+	char* escaped = (char*)ArenaAlloc(&g_command_arena, strlen(string) * 6 + 1);
+	char* out = escaped;
+
+	for (; *string != '\0'; string++) {
+		unsigned char c = (unsigned char)*string;
+		if (c == '"' || c == '\\') {
+			*out++ = '\\';
+			*out++ = c;
+		} else if (c < 0x20) {
+			out += sprintf(out, "\\u%04x", c);
+		} else {
+			*out++ = c;
+		}
 	}
+	*out = '\0';
+	return escaped;
 }
 
-void ResetIORedirect(void) {
-	ResetInputRedirect();
-	ResetOutputRedirect();
+// one line per command, written with a single write() so concurrent shells can share a file
+void WriteTraceRecord(const char* command_line) {
+	char* escaped_command = JsonEscape(command_line);
+	size_t record_size = strlen(escaped_command) + 512;
+	char* record = (char*)ArenaAlloc(&g_command_arena, record_size);
+	int record_length;
+
+	record_length = snprintf(record, record_size,
+		"{\"ts_ns\":%llu,\"pid\":%d,\"command\":\"%s\",\"stages\":%d,\"builtin\":%s,"
+		"\"read_ns\":%llu,\"parse_ns\":%llu,\"expand_ns\":%llu,\"redirect_ns\":%llu,"
+		"\"spawn_ns\":%llu,\"exec_ns\":%llu,\"builtin_ns\":%llu,\"wait_ns\":%llu,"
+		"\"status\":%d,\"signal\":%d}\n",
+		(unsigned long long)g_trace.start, (int)getpid(), escaped_command, g_trace.num_stages,
+		g_trace.is_builtin ? "true" : "false",
+		(unsigned long long)g_trace.read_ns, (unsigned long long)g_trace.parse_ns,
+		(unsigned long long)g_trace.expand_ns, (unsigned long long)g_trace.redirect_ns,
+		(unsigned long long)g_trace.spawn_ns, (unsigned long long)g_trace.exec_ns,
+		(unsigned long long)g_trace.builtin_ns, (unsigned long long)g_trace.wait_ns,
+		g_was_terminated ? -1 : g_last_exit_code, g_was_terminated ? g_last_terminate_signal_code : 0);
+	write(g_trace_fd, record, record_length);
 }
 
-void RedirectInput(void) {
-	int redirect_result = -1; 
-	redirect_result = dup2(g_file_src, 0);
-	if (redirect_result == -1) {
-		perror("source dup2()");
-		exit(1);
+// Glob //
+
+// Character class names [:name:] may use inside [...]
+int (*GlobClassFunction(const char* name, size_t length))(int) {
+	static const struct {
+		const char* name;
+		int (*function)(int);
+	} classes[] = {
+		{"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+		{"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+		{"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+		if (strlen(classes[i].name) == length && memcmp(classes[i].name, name, length) == 0) {
+			return classes[i].function;
+		}
 	}
-	
+	return NULL;
 }
 
-void RedirectOutput(void) {
-	int redirect_result = -1;
-	redirect_result = dup2(g_file_dest, 1);
-	if (redirect_result == -1) {
-		perror("dest dup2()");
-		exit(1);
+// The [...] starting at pattern[0] as a 256 bit set in *class. Returns the characters it takes,
+// 0 when it is not closed, then the '[' is only a character
+size_t CompileGlobClass(const char* pattern, size_t length, uint32_t** class) {
+	uint32_t* set = (uint32_t*)ArenaAlloc(&g_command_arena, 8 * sizeof(uint32_t));
+	bool is_negated = false;
+	size_t i = 1;
+	int first;
+	int last;
+	int c;
+
+	memset(set, 0, 8 * sizeof(uint32_t));
+	if (i < length && (pattern[i] == '!' || pattern[i] == '^')) {
+		is_negated = true;
+		i++;
+	}
+	// a ']' right after the '[' is one of the characters
+	for (first = i; i < length && (pattern[i] != ']' || i == (size_t)first); ) {
+		if (pattern[i] == '[' && i + 1 < length && pattern[i+1] == ':') {
+			const char* close = memchr(pattern + i + 2, ':', length - i - 2);
+			int (*function)(int) = NULL;
+			if (close != NULL && close + 1 < pattern + length && close[1] == ']') {
+				function = GlobClassFunction(pattern + i + 2, close - (pattern + i + 2));
+			}
+			if (function != NULL) {
+				for (c = 1; c < 256; c++) {
+					if (function(c)) set[c / 32] |= 1u << (c % 32);
+				}
+				i = close + 2 - pattern;
+				continue;
+			}
+		}
+		if (pattern[i] == '\\' && i + 1 < length) i++;
+		last = (unsigned char)pattern[i++];
+		c = last;
+		if (i + 1 < length && pattern[i] == '-' && pattern[i+1] != ']') {
+			i++;
+			if (pattern[i] == '\\' && i + 1 < length) i++;
+			last = (unsigned char)pattern[i++];
+		}
+		for (; c <= last; c++) set[c / 32] |= 1u << (c % 32);
+	}
+	if (i >= length) return 0;
+	if (is_negated) {
+		for (c = 0; c < 8; c++) set[c] = ~set[c];
 	}
+	*class = set;
+	return i + 1;
 }
 
-// if IO is not standard IO, then redirect correspondingly
-void RedirectIO(void) {
-	if (g_file_src != 0) {
-		RedirectInput();
-	} 
-	if (g_file_dest != 1) {
-		RedirectOutput();
+// Compile the piece of a pattern between two '/' into ops. Escaped characters are text
+void CompileGlobPiece(const char* pattern, size_t length, struct GlobPiece* piece) {
+	struct GlobOp* ops = (struct GlobOp*)ArenaAlloc(&g_command_arena, (length + 1) * sizeof(struct GlobOp));
+	char* text = (char*)ArenaAlloc(&g_command_arena, length + 1);
+	size_t text_length = 0;
+	size_t taken;
+	uint32_t* class;
+	int num_ops = 0;
+	size_t i = 0;
+
+	piece->min_length = 0;
+	piece->is_globstar = length == 2 && pattern[0] == '*' && pattern[1] == '*';
+	while (i < length) {
+		GlobOpType type = GLOB_TEXT;
+		taken = 1;
+		if (pattern[i] == '*') {
+			type = GLOB_STAR;
+		} else if (pattern[i] == '?') {
+			type = GLOB_ANY;
+		} else if (pattern[i] == '[' && (taken = CompileGlobClass(pattern + i, length - i, &class)) > 0) {
+			type = GLOB_CLASS;
+		} else {
+			taken = 1;
+			if (pattern[i] == '\\' && i + 1 < length) i++;
+			// literal text goes on the previous op when that is text too
+			if (num_ops == 0 || ops[num_ops-1].type != GLOB_TEXT) {
+				ops[num_ops].type = GLOB_TEXT;
+				ops[num_ops].text = text + text_length;
+				ops[num_ops++].length = 0;
+			}
+			text[text_length++] = pattern[i++];
+			ops[num_ops-1].length++;
+			piece->min_length++;
+			continue;
+		}
+		if (type == GLOB_STAR && num_ops > 0 && ops[num_ops-1].type == GLOB_STAR) {
+			i++;
+			continue;
+		}
+		ops[num_ops].type = type;
+		ops[num_ops++].class = type == GLOB_CLASS ? class : NULL;
+		if (type != GLOB_STAR) piece->min_length++;
+		i += taken;
 	}
+	text[text_length] = '\0';
+	piece->ops = ops;
+	piece->num_ops = num_ops;
+	piece->text = text;
+	piece->is_literal = num_ops == 0 || (num_ops == 1 && ops[0].type == GLOB_TEXT);
+	piece->matches_hidden = num_ops > 0 && ops[0].type == GLOB_TEXT && ops[0].text[0] == '.';
 }
 
-// close upon exec if not standard IO
-void CloseFilesOnExecute(void) {
-	if (g_file_src != 0) { 
-		fcntl(g_file_src, F_SETFD, FD_CLOEXEC);
+// Whether name matches the piece. A '*' that fails further on is retried one character
+// later, only the last one is ever retried, which is enough for patterns without '/'
+bool MatchGlobPiece(const struct GlobPiece* piece, const char* name, size_t length) {
+	const struct GlobOp* last = &piece->ops[piece->num_ops-1];
+	int star_op = -1;
+	size_t star_at = 0;
+	size_t at = 0;
+	int op = 0;
+
+	if (length < piece->min_length) return false;
+	// the usual *.suffix fails on its tail
+	if (last->type == GLOB_TEXT && memcmp(name + length - last->length, last->text, last->length) != 0) {
+		return false;
 	}
-	if (g_file_dest != 1) {
-		fcntl(g_file_dest, F_SETFD, FD_CLOEXEC);
+	while (op < piece->num_ops || at < length) {
+		if (op < piece->num_ops) {
+			const struct GlobOp* current = &piece->ops[op];
+			unsigned char c = at < length ? (unsigned char)name[at] : 0;
+			switch (current->type) {
+			case GLOB_STAR:
+				star_op = op++;
+				star_at = at;
+				continue;
+			case GLOB_TEXT:
+				if (length - at >= current->length && memcmp(name + at, current->text, current->length) == 0) {
+					at += current->length;
+					op++;
+					continue;
+				}
+				break;
+			case GLOB_ANY:
+				if (at < length) {
+					at++;
+					op++;
+					continue;
+				}
+				break;
+			case GLOB_CLASS:
+				if (at < length && (current->class[c / 32] & (1u << (c % 32))) != 0) {
+					at++;
+					op++;
+					continue;
+				}
+				break;
+			}
+		}
+		if (star_op < 0 || star_at >= length) return false;
+		op = star_op + 1;
+		at = ++star_at;
 	}
+	return true;
 }
 
-// set things up and fork a child to execute the non-built-in commands
-// redirect if any
-void ExecuteCommand(int num_tokens, char* command_tokens[]) {
-	pid_t spawn_pid = DEFAULT_NEG_INT;
-
-	sigprocmask(SIG_BLOCK, &g_blocked_signal_set, NULL);
-	g_sigint_action.sa_handler = child_catch_sigint;
-	g_sigterm_action.sa_handler = child_catch_sigterm;
-	sigprocmask(SIG_UNBLOCK, &g_blocked_signal_set, NULL);
-
-	spawn_pid = fork();
+// The entries of the directory walk->path names, path_length long, from the cache or read
+// with getdents64 in GLOB_DIRENT_BUFFER_SIZE batches. One that cannot be read has none
+struct GlobDirectory* ReadGlobDirectory(struct GlobWalk* walk, size_t path_length) {
+	struct GlobDirectory** bucket = &walk->cache->buckets[HashName(walk->path, path_length) % GLOB_CACHE_BUCKETS];
+	struct GlobDirectory* directory;
+	struct GlobEntry* grown;
+	int capacity = 0;
+	ssize_t num_read;
+	ssize_t offset;
+	int fd;
 
-	if (spawn_pid == -1) {
-		perror("Failed to fork new process");
-		exit(FORK_FAILED_ERROR_CODE);
+	for (directory = *bucket; directory != NULL; directory = directory->next) {
+		if (directory->path_length == path_length && memcmp(directory->path, walk->path, path_length) == 0) {
+			return directory;
+		}
 	}
-	else if (spawn_pid == 0) { // sucessfully forked a new child process
-		//
-		// CHILD's code
-		//
-		ResetIORedirect();
-		num_tokens = ProcessIORedirection(command_tokens, num_tokens);
-		RedirectIO();		
-		CloseFilesOnExecute();
-
-		execvp(command_tokens[0], command_tokens);
+	directory = (struct GlobDirectory*)ArenaAlloc(&g_command_arena, sizeof(struct GlobDirectory));
+	directory->path = ArenaStrndup(&g_command_arena, walk->path, path_length);
+	directory->path_length = path_length;
+	directory->entries = NULL;
+	directory->num_entries = 0;
+	directory->next = *bucket;
+	*bucket = directory;
 
-		// if execute command failed
-		perror("CHILD: exec failure!\n");
-		exit(1);
+	fd = open(path_length == 0 ? "." : directory->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) return directory;
+	if (g_dirent_buffer == NULL) {
+		g_dirent_buffer = (char*)malloc(GLOB_DIRENT_BUFFER_SIZE);
+		if (g_dirent_buffer == NULL) {
+			perror("malloc()");
+			exit(1);
+		}
 	}
-	//
-	// PARENT's code
-	//
-	sigprocmask(SIG_BLOCK, &g_blocked_signal_set, NULL);
-	g_sigint_action.sa_handler = parent_catch_sigint;
-	g_sigterm_action.sa_handler = parent_catch_sigterm;
-	sigprocmask(SIG_UNBLOCK, &g_blocked_signal_set, NULL);
-		
-	if (g_is_bg_command) {
-		// non-block waiting
-		PrintBackgroundPidBegins(spawn_pid);		
-		KeepTrackPid(spawn_pid);
-	} else {
-		// block waiting
-		sigprocmask(SIG_BLOCK, &g_blocked_signal_set, NULL);
-		WaitChildBlock(spawn_pid);
-		sigprocmask(SIG_UNBLOCK, &g_blocked_signal_set, NULL);
+	while ((num_read = getdents64(fd, g_dirent_buffer, GLOB_DIRENT_BUFFER_SIZE)) > 0) {
+		for (offset = 0; offset < num_read; ) {
+			struct dirent64* dirent = (struct dirent64*)(g_dirent_buffer + offset);
+			const char* name = dirent->d_name;
+			offset += dirent->d_reclen;
+			if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+			if (directory->num_entries == capacity) {
+				capacity = capacity == 0 ? 64 : capacity * 2;
+				grown = (struct GlobEntry*)ArenaAlloc(&g_command_arena, capacity * sizeof(struct GlobEntry));
+				if (directory->num_entries > 0) {
+					memcpy(grown, directory->entries, directory->num_entries * sizeof(struct GlobEntry));
+				}
+				directory->entries = grown;
+			}
+			directory->entries[directory->num_entries].length = strlen(name);
+			directory->entries[directory->num_entries].name
+				= ArenaStrndup(&g_command_arena, name, directory->entries[directory->num_entries].length);
+			directory->entries[directory->num_entries++].type = dirent->d_type;
+		}
 	}
-	
-	CheckAndPrintCompletedProcs();	
+	close(fd);
+	return directory;
 }
 
-void PrintLastStatus() {
-	if (g_was_terminated) {
-		printf("terminated by signal %d\n", g_last_terminate_signal_code);
+// Whether the entry just appended to walk->path, path_length long with it, is a directory.
+// d_type answers that without a stat, unless the file system left it unknown or it is a
+// symbolic link, which is followed only with follows_links
+bool IsGlobDirectory(struct GlobWalk* walk, size_t path_length, struct GlobEntry* entry, bool follows_links) {
+	struct stat status;
+
+	walk->path[path_length] = '\0';
+	if (entry->type == DT_UNKNOWN) {
+		if (lstat(walk->path, &status) != 0) return false;
+		entry->type = S_ISDIR(status.st_mode) ? DT_DIR : S_ISLNK(status.st_mode) ? DT_LNK : DT_REG;
 	}
-	else {
-		printf("exit value %d\n", g_last_exit_code);
+	if (entry->type == DT_LNK && follows_links) {
+		return stat(walk->path, &status) == 0 && S_ISDIR(status.st_mode);
 	}
+	return entry->type == DT_DIR;
 }
 
-bool HasCommentSyntax(char token[]) {
-	if (token[0] == '#') {
-		return true;
-	}
-	return false;
-}
+void AddGlobMatch(struct GlobWalk* walk, size_t path_length) {
+	char** grown;
 
-bool IsEmptyCommand(int num_tokens) {
-	if (num_tokens == 0) { // only has ':' in command
-		return true;
+	if (walk->num_matches == walk->capacity) {
+		walk->capacity = walk->capacity == 0 ? 16 : walk->capacity * 2;
+		grown = (char**)ArenaAlloc(&g_command_arena, walk->capacity * sizeof(char*));
+		if (walk->num_matches > 0) memcpy(grown, walk->matches, walk->num_matches * sizeof(char*));
+		walk->matches = grown;
 	}
-	return false;
+	if (walk->is_directory_only) walk->path[path_length++] = '/';
+	walk->matches[walk->num_matches++] = ArenaStrndup(&g_command_arena, walk->path, path_length);
 }
 
-void SetWorkingDirectory(char path[]) {
-	memset(g_working_directory, '\0', sizeof(g_working_directory));
-	strcpy(g_working_directory, path);
+// Append name to walk->path at path_length. Returns the new length, 0 when it would not fit
+size_t AppendGlobPath(struct GlobWalk* walk, size_t path_length, const char* name, size_t length) {
+	if (path_length + length + 2 >= PATH_MAX) return 0;
+	memcpy(walk->path + path_length, name, length);
+	walk->path[path_length + length] = '\0';
+	return path_length + length;
 }
 
-bool HasNoArgument(int num_tokens) {
-	if (num_tokens == 2) {
-		return true;	
+// Match pieces from piece_index on below walk->path, which is path_length long and empty
+// or ends in '/'
+void GlobDirectory(struct GlobWalk* walk, size_t path_length, int piece_index) {
+	struct GlobPiece* piece = &walk->pieces[piece_index];
+	bool is_last = piece_index == walk->num_pieces - 1;
+	struct GlobDirectory* directory;
+	struct GlobEntry* entry;
+	struct stat status;
+	size_t length;
+	int i;
+
+	if (piece->is_literal) {
+		// nothing to match, only to check once the whole path is built
+		length = AppendGlobPath(walk, path_length, piece->text, strlen(piece->text));
+		if (length == 0) return;
+		if (!is_last) {
+			walk->path[length] = '/';
+			GlobDirectory(walk, length + 1, piece_index + 1);
+		} else if (walk->is_directory_only ? stat(walk->path, &status) == 0 && S_ISDIR(status.st_mode)
+			: lstat(walk->path, &status) == 0) {
+			AddGlobMatch(walk, length);
+		}
+		return;
+	}
+	if (piece->is_globstar && !is_last) GlobDirectory(walk, path_length, piece_index + 1);
+	directory = ReadGlobDirectory(walk, path_length);
+	for (i = 0; i < directory->num_entries; i++) {
+		entry = &directory->entries[i];
+		if (entry->name[0] == '.' && !piece->matches_hidden) continue;
+		if (!piece->is_globstar && !MatchGlobPiece(piece, entry->name, entry->length)) continue;
+		length = AppendGlobPath(walk, path_length, entry->name, entry->length);
+		if (length == 0) continue;
+		if (piece->is_globstar) {
+			// every file below, through directories but not the links to them
+			if (is_last && (!walk->is_directory_only || IsGlobDirectory(walk, length, entry, false))) {
+				AddGlobMatch(walk, length);
+			}
+			if (IsGlobDirectory(walk, length, entry, false)) {
+				walk->path[length] = '/';
+				GlobDirectory(walk, length + 1, piece_index);
+			}
+		} else if (is_last) {
+			if (!walk->is_directory_only || IsGlobDirectory(walk, length, entry, true)) AddGlobMatch(walk, length);
+		} else if (IsGlobDirectory(walk, length, entry, true)) {
+			walk->path[length] = '/';
+			GlobDirectory(walk, length + 1, piece_index + 1);
+		}
 	}
-	return false;
 }
 
-bool IsValidCDCommand(char* command_tokens[], int num_tokens) {
-	if (num_tokens != 1 && num_tokens != 2) {
-		fprintf(stderr, "wrong number of arguments.\nCommand: ");
-		PrintTokens(stderr, command_tokens, num_tokens);
-		fprintf(stderr, "is not a valid CD command\n");
+int CompareGlobMatches(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// The pathnames pattern matches, sorted, in *matches. pattern is a field ExpandWord wrote with
+// is_glob: a '\' makes the character after it plain text. *cache starts out NULL and keeps the
+// directories read for the next patterns of the same command.
+// Returns the number of matches, 0 also when the pattern has nothing to match with
+int ExpandGlob(struct GlobCache** cache, const char* pattern, char*** matches) {
+	struct GlobWalk* walk;
+	bool has_glob = false;
+	size_t length = strlen(pattern);
+	size_t start = 0;
+	size_t end;
+	int i;
+
+	walk = (struct GlobWalk*)ArenaAlloc(&g_command_arena, sizeof(struct GlobWalk));
+	walk->pieces = (struct GlobPiece*)ArenaAlloc(&g_command_arena, (length / 2 + 1) * sizeof(struct GlobPiece));
+	walk->num_pieces = 0;
+	walk->is_directory_only = length > 0 && pattern[length-1] == '/';
+	walk->path[0] = '\0';
+	walk->matches = NULL;
+	walk->num_matches = 0;
+	walk->capacity = 0;
+	if (pattern[0] == '/') {
+		walk->path[0] = '/';
+		start = 1;
+	}
+	while (start < length) {
+		for (end = start; end < length && pattern[end] != '/'; end++) {}
+		if (end > start) {
+			CompileGlobPiece(pattern + start, end - start, &walk->pieces[walk->num_pieces]);
+			has_glob = has_glob || !walk->pieces[walk->num_pieces].is_literal;
+			walk->num_pieces++;
+		}
+		start = end + 1;
+	}
+	if (!has_glob) return 0;
+
+	if (*cache == NULL) {
+		*cache = (struct GlobCache*)ArenaAlloc(&g_command_arena, sizeof(struct GlobCache));
+		for (i = 0; i < GLOB_CACHE_BUCKETS; i++) (*cache)->buckets[i] = NULL;
+	}
+	walk->cache = *cache;
+	GlobDirectory(walk, pattern[0] == '/' ? 1 : 0, 0);
+	if (walk->num_matches > 1) qsort(walk->matches, walk->num_matches, sizeof(char*), CompareGlobMatches);
+	*matches = walk->matches;
+	return walk->num_matches;
+}
+
+// A field that matched nothing stays as it was typed, without the escapes ExpandWord added
+void RemoveGlobEscapes(char* field) {
+	char* write = field;
+
+	for (; *field != '\0'; field++) {
+		if (*field == '\\' && field[1] != '\0') field++;
+		*write++ = *field;
+	}
+	*write = '\0';
+}
+
+// Tokenizer //
+
+bool IsBlank(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+bool IsOperatorChar(char c) {
+	return c == '|' || c == '<' || c == '>' || c == '&' || c == ';' || c == '(' || c == ')' || c == '\n';
+}
+
+int SetOperator(struct Token* token, TokenType type, char* text) {
+	token->type = type;
+	token->text = text;
+	return (int)strlen(text);
+}
+
+int SetRedirectOperator(struct Token* token, RedirectionType redirection, char* text) {
+	token->type = TOKEN_REDIRECT;
+	token->redirection = redirection;
+	token->text = text;
+	return (int)strlen(text);
+}
+
+// Operator token at read. first is read[0], which terminating the previous word
+// may have overwritten. Returns the number of characters it takes
+int ReadOperator(char first, const char* read, struct Token* token) {
+	token->io_number = -1;
+	switch (first) {
+	case '|':
+		if (read[1] == '|') return SetOperator(token, TOKEN_OR, "||");
+		return SetOperator(token, TOKEN_PIPE, "|");
+	case ';':
+		return SetOperator(token, TOKEN_SEMICOLON, ";");
+	case '(':
+		return SetOperator(token, TOKEN_LPAREN, "(");
+	case ')':
+		return SetOperator(token, TOKEN_RPAREN, ")");
+	case '\n':
+		// only in a line continued by the next ones, see CompilePlan
+		token->type = TOKEN_NEWLINE;
+		token->text = "newline";
+		return 1;
+	case '<':
+		if (read[1] == '<' && read[2] == '<') return SetRedirectOperator(token, REDIRECT_HERESTRING, "<<<");
+		if (read[1] == '<' && read[2] == '-') return SetRedirectOperator(token, REDIRECT_HEREDOC_STRIP, "<<-");
+		if (read[1] == '<') return SetRedirectOperator(token, REDIRECT_HEREDOC, "<<");
+		if (read[1] == '&') return SetRedirectOperator(token, REDIRECT_DUP_IN, "<&");
+		return SetRedirectOperator(token, REDIRECT_READ, "<");
+	case '>':
+		if (read[1] == '>') return SetRedirectOperator(token, REDIRECT_APPEND, ">>");
+		if (read[1] == '&') return SetRedirectOperator(token, REDIRECT_DUP_OUT, ">&");
+		return SetRedirectOperator(token, REDIRECT_WRITE, ">");
+	default:
+		if (read[1] == '>' && read[2] == '>') return SetRedirectOperator(token, REDIRECT_APPEND_ALL, "&>>");
+		if (read[1] == '>') return SetRedirectOperator(token, REDIRECT_WRITE_ALL, "&>");
+		if (read[1] == '&') return SetOperator(token, TOKEN_AND, "&&");
+		return SetOperator(token, TOKEN_BACKGROUND, "&");
+	}
+}
+
+// "2" in "2>file": all digits and typed without quotes
+bool IsIoNumber(struct Token* word) {
+	int length = (int)strlen(word->text);
+	int i;
+
+	if (length == 0 || length > 4 || length != word->source_length) return false;
+	for (i = 0; i < length; i++) {
+		if (word->text[i] < '0' || word->text[i] > '9') return false;
+	}
+	return true;
+}
+
+// Length of the $(...) or `...` starting at text, -1 if it is not closed. Quotes and
+// parentheses inside $( ) are skipped over, nested ones included
+int SubstitutionLength(const char* text, size_t length) {
+	const char* close;
+	int depth = 1;
+	size_t i;
+
+	if (text[0] == '`') {
+		for (i = 1; i < length; i++) {
+			if (text[i] == '\\') {
+				i++;
+			} else if (text[i] == '`') {
+				return (int)i + 1;
+			}
+		}
+		return -1;
+	}
+	for (i = 2; i < length; i++) {
+		switch (text[i]) {
+		case '\\':
+			i++;
+			break;
+		case '\'':
+			close = memchr(text + i + 1, '\'', length - i - 1);
+			if (close == NULL) return -1;
+			i = close - text;
+			break;
+		case '"':
+			for (i++; i < length && text[i] != '"'; i++) {
+				if (text[i] == '\\') i++;
+			}
+			break;
+		case '(':
+			depth++;
+			break;
+		case ')':
+			if (--depth == 0) return (int)i + 1;
+			break;
+		}
+	}
+	return -1;
+}
+
+// Move a whole $(...) or `...` from *read to *write, as it is. Returns false after reporting
+// one that is not closed
+bool CopySubstitution(char** read, char** write, size_t remaining) {
+	int length = SubstitutionLength(*read, remaining);
+
+	if (length == -1) {
+		fprintf(stderr, "syntax error: unterminated %s\n", **read == '`' ? "`" : "$(");
+		return false;
+	}
+	memmove(*write, *read, length);
+	*read += length;
+	*write += length;
+	return true;
+}
+
+// Copy the line into arena and split the copy in place: quotes and backslashes
+// are removed while each word is compacted where it stands, so every word points into
+// that one buffer. Every token also keeps where it came from in input_string, which must
+// live as long as the tokens. '...' is literal, "..." honors \" \\ \$ \` escapes, an unquoted
+// '#' starting a word comments out the rest of the line. $(...) and `...` are kept as typed
+// for ExpandWord, inside double quotes too. input_string may hold several lines, each '\n'
+// is a TOKEN_NEWLINE.
+// Returns the number of tokens, -1 on a syntax error
+int ParseCommand(struct Arena* arena, char input_string[], struct Token** command_tokens) {
+	size_t length = strlen(input_string);
+	char* line = ArenaStrndup(arena, input_string, length);
+	char* read = line;
+	int capacity = INITIAL_TOKEN_CAPACITY;
+	struct Token* tokens = (struct Token*)ArenaAlloc(arena, capacity * sizeof(struct Token));
+	bool is_bracket_open;
+	int num_operator_chars;
+	int num_tokens = 0;
+
+	while (1) {
+		while (IsBlank(*read)) read++;
+		if (*read == '#') {
+			while (*read != '\0' && *read != '\n') read++;
+		}
+		if (*read == '\0') break;
+
+		if (num_tokens + 2 > capacity) {
+			// a word may be followed by an operator, keep room for both
+			struct Token* grown = (struct Token*)ArenaAlloc(arena, capacity * 2 * sizeof(struct Token));
+			memcpy(grown, tokens, num_tokens * sizeof(struct Token));
+			tokens = grown;
+			capacity *= 2;
+		}
+		if (IsOperatorChar(*read)) {
+			tokens[num_tokens].source = input_string + (read - line);
+			num_operator_chars = ReadOperator(*read, read, &tokens[num_tokens]);
+			tokens[num_tokens++].source_length = num_operator_chars;
+			read += num_operator_chars;
+			continue;
+		}
+
+		char* write = read;
+		struct Token* word = &tokens[num_tokens++];
+		word->type = TOKEN_WORD;
+		word->text = write;
+		word->source = input_string + (read - line);
+		word->has_expansion = false;
+		word->has_glob = false;
+		is_bracket_open = false;
+		while (*read != '\0' && !IsBlank(*read) && !IsOperatorChar(*read)) {
+			if ((read[0] == '$' && read[1] == '(') || read[0] == '`') {
+				word->has_expansion = true;
+				if (!CopySubstitution(&read, &write, length - (read - line))) return -1;
+			} else if (*read == '$') {
+				word->has_expansion = true;
+				*write++ = *read++;
+			} else if (*read == '\\') {
+				read++;
+				if (*read == '\0') break;
+				*write++ = *read++;
+			} else if (*read == '\'') {
+				read++;
+				while (*read != '\0' && *read != '\'') *write++ = *read++;
+				if (*read == '\0') {
+					fprintf(stderr, "syntax error: unterminated '\n");
+					return -1;
+				}
+				read++;
+			} else if (*read == '"') {
+				read++;
+				while (*read != '\0' && *read != '"') {
+					if ((read[0] == '$' && read[1] == '(') || read[0] == '`') {
+						word->has_expansion = true;
+						if (!CopySubstitution(&read, &write, length - (read - line))) return -1;
+						continue;
+					}
+					if (read[0] == '\\' && read[1] != '\0' && strchr("\"\\$`", read[1]) != NULL) {
+						read++;
+					} else if (*read == '$') {
+						word->has_expansion = true;
+					}
+					*write++ = *read++;
+				}
+				if (*read == '\0') {
+					fprintf(stderr, "syntax error: unterminated \"\n");
+					return -1;
+				}
+				read++;
+			} else {
+				if (*read == '*' || *read == '?' || (*read == ']' && is_bracket_open)) word->has_glob = true;
+				if (*read == '[') is_bracket_open = true;
+				*write++ = *read++;
+			}
+		}
+
+		// terminating the word may overwrite the operator right behind it, handle that one now
+		char delimiter = *read;
+		word->source_length = (int)(read - (word->source - input_string + line));
+		*write = '\0';
+		if (delimiter == '\0') break;
+		if (IsOperatorChar(delimiter)) {
+			struct Token* operator = &tokens[num_tokens++];
+			operator->source = input_string + (read - line);
+			num_operator_chars = ReadOperator(delimiter, read, operator);
+			operator->source_length = num_operator_chars;
+			read += num_operator_chars;
+			// a number right in front of a redirection is the fd it applies to
+			if (operator->type == TOKEN_REDIRECT && delimiter != '&' && IsIoNumber(word)) {
+				operator->io_number = atoi(word->text);
+				operator->source = word->source;
+				operator->source_length += word->source_length;
+				*word = *operator;
+				num_tokens--;
+			}
+		} else {
+			read++;
+		}
+	}
+	*command_tokens = tokens;
+	return num_tokens;
+}
+
+// look for search_substring in original_string and replace every occurrence,
+// the result lives in the command arena
+char* ReplaceString(const char* original_string, const char* search_substring, const char* replace_substring) {
+	size_t search_length = strlen(search_substring);
+	size_t replace_length = strlen(replace_substring);
+	size_t num_found = 0;
+	const char* found_pos;
+	char* buffer;
+	char* write;
+
+	for (found_pos = strstr(original_string, search_substring); found_pos != NULL;
+		found_pos = strstr(found_pos + search_length, search_substring)) {
+		num_found++;
+	}
+	if (num_found == 0) {
+		return (char*)original_string;
+	}
+
+	buffer = (char*)ArenaAlloc(&g_command_arena,
+		strlen(original_string) + num_found * replace_length - num_found * search_length + 1);
+	write = buffer;
+	while ((found_pos = strstr(original_string, search_substring)) != NULL) {
+		memcpy(write, original_string, found_pos - original_string);
+		write += found_pos - original_string;
+		memcpy(write, replace_substring, replace_length);
+		write += replace_length;
+		original_string = found_pos + search_length;
+	}
+	strcpy(write, original_string);
+	return buffer;
+}
+
+// exit status the shell itself ends with: the last command's, 128+n for signal n
+int LastStatusCode(void) {
+	if (g_was_terminated) {
+		return 128 + g_last_terminate_signal_code;
+	}
+	return g_last_exit_code;
+}
+
+bool IsNameStart(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+bool IsNameChar(char c) {
+	return IsNameStart(c) || (c >= '0' && c <= '9');
+}
+
+// NAME=value typed with an unquoted name
+bool IsAssignmentWord(const struct Token* word) {
+	int i;
+
+	if (word->type != TOKEN_WORD || word->source_length == 0 || !IsNameStart(word->source[0])) return false;
+	for (i = 1; i < word->source_length && IsNameChar(word->source[i]); i++) {}
+	return i < word->source_length && word->source[i] == '=';
+}
+
+void AppendVariable(struct ArenaString* out, const char* name, size_t name_length) {
+	struct Variable* variable = FindVariable(name, name_length);
+	if (variable != NULL) ArenaStringAppend(&g_command_arena, out, variable->value, strlen(variable->value));
+}
+
+size_t AppendSubstitution(struct ArenaString* out, const char* source, size_t length);
+
+// The expansion starting at source[0] == '$': $$ $? $! $NAME ${NAME} $(...), appended to out.
+// A $ that starts none of them is kept. Returns the number of characters consumed
+size_t AppendExpansion(struct ArenaString* out, const char* source, size_t length) {
+	char number[16];
+	const char* name_end;
+	size_t i;
+
+	if (length >= 2) {
+		switch (source[1]) {
+		case '$':
+			ArenaStringAppend(&g_command_arena, out, g_shell_pid_string, strlen(g_shell_pid_string));
+			return 2;
+		case '?':
+			ArenaStringAppend(&g_command_arena, out, number, sprintf(number, "%d", LastStatusCode()));
+			return 2;
+		case '(':
+			return AppendSubstitution(out, source, length);
+		case '!':
+			if (g_last_background_pid > 0) {
+				ArenaStringAppend(&g_command_arena, out, number,
+					sprintf(number, "%d", (int)g_last_background_pid));
+			}
+			return 2;
+		case '{':
+			name_end = memchr(source + 2, '}', length - 2);
+			if (name_end == NULL || name_end == source + 2 || !IsNameStart(source[2])) break;
+			for (i = 3; source + i < name_end && IsNameChar(source[i]); i++) {}
+			if (source + i != name_end) break;
+			AppendVariable(out, source + 2, i - 2);
+			return i + 1;
+		default:
+			if (!IsNameStart(source[1])) break;
+			for (i = 2; i < length && IsNameChar(source[i]); i++) {}
+			AppendVariable(out, source + 1, i - 1);
+			return i;
+		}
+	}
+	ArenaStringAppend(&g_command_arena, out, "$", 1);
+	return 1;
+}
+
+// Unquoted command substitution output, from start on in out: runs of blanks and newlines end
+// a field, written as a single '\0'. Nothing is written for them where a field is yet to start
+void SplitFields(struct ArenaString* out, size_t start) {
+	size_t write = start;
+	size_t read;
+	bool is_blank_run = false;
+
+	for (read = start; read < out->length; read++) {
+		char c = out->data[read];
+		if (c == ' ' || c == '\t' || c == '\n') {
+			is_blank_run = true;
+			continue;
+		}
+		if (is_blank_run && write > 0 && out->data[write-1] != '\0') out->data[write++] = '\0';
+		is_blank_run = false;
+		out->data[write++] = c;
+	}
+	if (is_blank_run && write > 0 && out->data[write-1] != '\0') out->data[write++] = '\0';
+	out->length = write;
+}
+
+// A '\' in front of every one of chars in out from start on, which ExpandGlob then takes as
+// plain characters
+void EscapeGlobChars(struct ArenaString* out, size_t start, const char* chars) {
+	size_t num_escapes = 0;
+	size_t read;
+	size_t write;
+
+	for (read = start; read < out->length; read++) {
+		if (strchr(chars, out->data[read]) != NULL && out->data[read] != '\0') num_escapes++;
+	}
+	if (num_escapes == 0) return;
+	ArenaStringReserve(&g_command_arena, out, num_escapes);
+	write = out->length + num_escapes;
+	for (read = out->length; read > start; ) {
+		out->data[--write] = out->data[--read];
+		if (strchr(chars, out->data[read]) != NULL && out->data[read] != '\0') out->data[--write] = '\\';
+	}
+	out->length += num_escapes;
+}
+
+// Rebuild one word from how it was typed: quote removal and expansion in the same pass,
+// straight into the command arena. *is_quoted tells whether any part of it was quoted.
+// With is_split, unquoted $(...) and `...` may split it: the fields are separated by '\0'
+// within *expanded_length. With is_glob, the fields are patterns for ExpandGlob: what was
+// quoted has its *, ?, [, ] and \ escaped, what expansions gave has its \ escaped
+char* ExpandWord(const char* source, size_t length, bool is_split, bool is_glob, bool* is_quoted,
+	size_t* expanded_length) {
+	struct ArenaString out;
+	bool in_double_quotes = false;
+	bool is_substitution;
+	const char* escaped;
+	size_t start;
+	size_t run;
+	size_t i = 0;
+
+	ArenaStringInit(&g_command_arena, &out, length + 32);
+	*is_quoted = false;
+	while (i < length) {
+		char c = source[i];
+		escaped = "*?[]\\";
+		start = out.length;
+		if (c == '$' || c == '`') {
+			is_substitution = c == '`' || (i + 1 < length && source[i+1] == '(');
+			i += c == '`' ? AppendSubstitution(&out, source + i, length - i)
+				: AppendExpansion(&out, source + i, length - i);
+			if (is_substitution && is_split && !in_double_quotes) SplitFields(&out, start);
+			if (!in_double_quotes) escaped = "\\";
+		} else if (c == '"') {
+			in_double_quotes = !in_double_quotes;
+			*is_quoted = true;
+			i++;
+		} else if (c == '\\' && i + 1 < length
+			&& (!in_double_quotes || strchr("\"\\$`", source[i+1]) != NULL)) {
+			ArenaStringAppend(&g_command_arena, &out, source + i + 1, 1);
+			*is_quoted = true;
+			i += 2;
+		} else if (c == '\'' && !in_double_quotes) {
+			const char* close = memchr(source + i + 1, '\'', length - i - 1);
+			run = close - (source + i + 1);
+			ArenaStringAppend(&g_command_arena, &out, source + i + 1, run);
+			*is_quoted = true;
+			i += run + 2;
+		} else {
+			// everything up to the next special character in one go
+			for (run = 1; i + run < length && strchr("$\"\\'`", source[i+run]) == NULL; run++) {}
+			ArenaStringAppend(&g_command_arena, &out, source + i, run);
+			i += run;
+			if (!in_double_quotes) continue;
+		}
+		if (is_glob) EscapeGlobChars(&out, start, escaped);
+	}
+	*expanded_length = out.length;
+	return ArenaStringFinish(&out);
+}
+
+// A copy of tokens in the command arena with $$ $? $! $NAME ${NAME} $(...) `...` expanded in
+// every word that has one, nothing outside single quotes, and without the newlines.
+// A word that was all unquoted expansion and came out empty is dropped, one with an unquoted
+// substitution becomes as many words as it has fields, unless it is a NAME=value in front of
+// a command. Then a field with an unquoted *, ? or [...] becomes the pathnames it matches,
+// if there are any, except after a redirection. A redirection's file has to stay one word.
+// Returns the new number of tokens, -1 after reporting an ambiguous redirect
+int ExpandVariables(const struct Token tokens[], int num_tokens, struct Token** expanded_tokens) {
+	int capacity = num_tokens + 1;
+	struct Token* expanded = (struct Token*)ArenaAlloc(&g_command_arena, capacity * sizeof(struct Token));
+	struct Token* grown;
+	struct GlobCache* glob_cache = NULL;
+	bool is_command_start = true;
+	bool is_assignment;
+	bool is_redirect_target;
+	bool is_glob;
+	bool is_quoted;
+	char* text;
+	char** fields;
+	char* single_field;
+	size_t length;
+	size_t field;
+	size_t next_field;
+	int num_fields;
+	int kept = 0;
+	int i;
+	int j;
+
+	for (i = 0; i < num_tokens; i++) {
+		if (tokens[i].type == TOKEN_NEWLINE) continue;
+		is_assignment = is_command_start && IsAssignmentWord(&tokens[i]);
+		is_redirect_target = i > 0 && tokens[i-1].type == TOKEN_REDIRECT;
+		if (tokens[i].type == TOKEN_PIPE) {
+			is_command_start = true;
+		} else if (tokens[i].type == TOKEN_WORD && !is_assignment && !is_redirect_target) {
+			is_command_start = false;
+		}
+		is_glob = tokens[i].has_glob && !is_assignment && !is_redirect_target;
+		if (tokens[i].type != TOKEN_WORD || !(tokens[i].has_expansion || is_glob)) {
+			expanded[kept++] = tokens[i];
+			continue;
+		}
+		text = ExpandWord(tokens[i].source, tokens[i].source_length, !is_assignment, is_glob, &is_quoted, &length);
+		if (is_redirect_target && (length == 0 ? !is_quoted : strlen(text) + 1 < length)) {
+			fprintf(stderr, "%.*s: ambiguous redirect\n", tokens[i].source_length, tokens[i].source);
+			return -1;
+		}
+		if (length == 0) {
+			if (!is_quoted) continue;
+			length = 1; // one empty word
+		}
+		for (field = 0; field < length; field = next_field) {
+			next_field = field + strlen(text + field) + 1;
+			num_fields = is_glob ? ExpandGlob(&glob_cache, text + field, &fields) : 0;
+			if (num_fields == 0) {
+				if (is_glob) RemoveGlobEscapes(text + field);
+				single_field = text + field;
+				fields = &single_field;
+				num_fields = 1;
+			}
+			for (j = 0; j < num_fields; j++) {
+				if (kept == capacity) {
+					capacity *= 2;
+					grown = (struct Token*)ArenaAlloc(&g_command_arena, capacity * sizeof(struct Token));
+					memcpy(grown, expanded, kept * sizeof(struct Token));
+					expanded = grown;
+				}
+				expanded[kept] = tokens[i];
+				expanded[kept++].text = fields[j];
+			}
+		}
+	}
+	*expanded_tokens = expanded;
+	return kept;
+}
+
+void PrintChildExitStatus(pid_t actual_pid, int child_exit_status) {
+	/*
+ 	* WIFEXITED return non-zero if the process terminates normally 
+ 	* WEXITSTATUS return actual exit status
+ 	*
+ 	* WIFSIGNALED return non-zero if the process was terminated by a signal
+ 	* WTERMISG return the terminating signal
+ 	* 
+ 	* Only ONE of the WIFEXITED() and WIFSIGNALED() will be non-zero
+ 	* => Use both to know how a child process died
+ 	*
+ 	* 
+ 	* */
+	g_last_parallel_num_tasks = 0;
+	g_last_timeout_stage = TIMEOUT_NOT_FIRED;
+	if (WIFEXITED(child_exit_status) != 0) {
+		g_last_exit_code = WEXITSTATUS(child_exit_status);
+		g_was_terminated = false;
+	}
+	else if (WIFSIGNALED(child_exit_status != 0)) {
+		printf("CHILD(%d) was terminated by signal ", actual_pid);
+		printf("%d\n", WTERMSIG(child_exit_status));	
+		g_last_terminate_signal_code = WTERMSIG(child_exit_status);
+		g_was_terminated = true;
+	}
+}
+
+// A background process finished: only reported, $? and status stay the foreground's
+void PrintBackgroundExitStatus(pid_t actual_pid, int child_exit_status) {
+	if (WIFSIGNALED(child_exit_status)) {
+		printf("CHILD(%d) was terminated by signal %d\n", actual_pid, WTERMSIG(child_exit_status));
+	}
+}
+
+
+// Event loop //
+
+uint64_t MakeEventData(EventKind kind, uint64_t payload) {
+	return ((uint64_t)kind << EVENT_KIND_SHIFT) | payload;
+}
+
+void SetupEventLoop(void) {
+	struct epoll_event event = {0};
+
+	g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (g_epoll_fd == -1) {
+		perror("epoll_create1()");
+		exit(1);
+	}
+	g_signal_fd = signalfd(-1, &g_blocked_signal_set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (g_signal_fd == -1) {
+		perror("signalfd()");
+		exit(1);
+	}
+	event.events = EPOLLIN;
+	event.data.u64 = MakeEventData(EVENT_SIGNAL, 0);
+	epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, g_signal_fd, &event);
+
+	if (g_input_data != NULL || g_is_subshell) {
+		// lines come out of memory, or a subshell that reads none: there is nothing to wait for
+		g_input_is_pollable = false;
+		return;
+	}
+	event.events = EPOLLIN;
+	event.data.u64 = MakeEventData(EVENT_INPUT, 0);
+	if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, g_input_fd, &event) == -1) {
+		// EPERM: the input is a regular file, it is always readable
+		g_input_is_pollable = false;
+	}
+}
+
+// readable once the process has exited, closes on exec
+int OpenPidfd(pid_t pid) {
+	return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+// Jobs //
+
+int JobId(int slot) {
+	return slot + 1;
+}
+
+// Pop a slot off the free list, or take the next never used one,
+// doubling the table when it is full
+int AllocateJob(const char* command_line, int max_processes) {
+	struct Job* job;
+	int slot;
+
+	if (g_first_free_job_slot != -1) {
+		slot = g_first_free_job_slot;
+		g_first_free_job_slot = g_jobs[slot].next_free_slot;
+	} else {
+		if (g_job_high_water == g_job_capacity) {
+			int old_capacity = g_job_capacity;
+			g_job_capacity = old_capacity == 0 ? INITIAL_JOB_CAPACITY : old_capacity * 2;
+			g_jobs = (struct Job*)realloc(g_jobs, g_job_capacity * sizeof(struct Job));
+			memset(&g_jobs[old_capacity], 0, (g_job_capacity - old_capacity) * sizeof(struct Job));
+		}
+		slot = g_job_high_water++;
+	}
+	job = &g_jobs[slot];
+
+	job->is_used = true;
+	job->pgid = 0;
+	job->state = JOB_RUNNING;
+	job->is_background = false;
+	job->processes = (struct JobProcess*)calloc(max_processes, sizeof(struct JobProcess));
+	job->num_processes = 0;
+	job->num_live_processes = 0;
+	job->command_line = strdup(command_line);
+	job->start_ns = MonotonicNs();
+	job->timer_fd = -1;
+	job->timeout_stage = TIMEOUT_NOT_FIRED;
+	g_num_jobs++;
+	return slot;
+}
+
+void FreeJob(int slot) {
+	struct Job* job = &g_jobs[slot];
+
+	if (job->state == JOB_STOPPED) g_num_stopped_jobs--;
+	if (job->timer_fd != -1) {
+		close(job->timer_fd); // also drops it from the epoll set
+		job->timer_fd = -1;
+	}
+	free(job->processes);
+	free(job->command_line);
+	job->processes = NULL;
+	job->command_line = NULL;
+	job->is_used = false;
+	job->next_free_slot = g_first_free_job_slot;
+	g_first_free_job_slot = slot;
+	if (g_current_job_slot == slot) g_current_job_slot = -1;
+	g_num_jobs--;
+	if (g_num_jobs == 0) {
+		// empty table: start handing out low job ids again
+		g_first_free_job_slot = -1;
+		g_job_high_water = 0;
+	}
+}
+
+void AddJobProcess(int slot, pid_t pid) {
+	struct Job* job = &g_jobs[slot];
+	struct JobProcess* process = &job->processes[job->num_processes++];
+
+	process->pid = pid;
+	process->pidfd = -1;
+	process->is_watched = false;
+	if (pid == -1) {
+		// same outcome as a forked child whose exec failed
+		process->is_done = true;
+		process->wait_status = EXECUTE_FAILED_ERROR_CODE << 8;
+	} else {
+		process->is_done = false;
+		job->num_live_processes++;
+	}
+}
+
+// a job's status is its last stage's
+int JobWaitStatus(int slot) {
+	struct Job* job = &g_jobs[slot];
+	return job->processes[job->num_processes-1].wait_status;
+}
+
+void PrintJob(int slot) {
+	struct Job* job = &g_jobs[slot];
+	printf("[%d]  %-8s %s\n", JobId(slot), job->state == JOB_STOPPED ? "Stopped" : "Running",
+		job->command_line);
+}
+
+void PrintBackgroundPidBegins(int slot, pid_t child_pid) {
+	fprintf(stdout, "[%d] Background process %d has begun\n", JobId(slot), (int)child_pid);
+	fflush(stdout);
+}
+
+// 0, a group of its own, for every job of the top level shell. A subshell keeps its foreground
+// jobs in its own group instead, so what is sent to the subshell's group reaches them too
+pid_t NewJobProcessGroup(void) {
+	return g_is_subshell && !g_is_bg_command ? KEEP_SHELL_PGROUP : 0;
+}
+
+// A foreground job with a group of its own is given the terminal, by the child and the shell both
+bool TakesTerminal(pid_t pgid) {
+	return g_terminal_fd != -1 && pgid != KEEP_SHELL_PGROUP && !g_is_bg_command;
+}
+
+void SignalJob(int slot, int signo) {
+	struct Job* job = &g_jobs[slot];
+	int i;
+
+	if (job->pgid > 0) {
+		killpg(job->pgid, signo);
+		return;
+	}
+	for (i = 0; i < job->num_processes; i++) {
+		if (!job->processes[i].is_done) kill(job->processes[i].pid, signo);
+	}
+}
+
+// (Re)start the job's timer to fire once after ns, the event loop then calls FireJobTimer.
+// Returns false if no timerfd could be set up
+bool ArmJobTimer(int slot, uint64_t ns) {
+	struct Job* job = &g_jobs[slot];
+	struct itimerspec timer = {{0, 0}, {0, 0}};
+	struct epoll_event event = {0};
+
+	if (job->timer_fd == -1) {
+		job->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (job->timer_fd == -1) return false;
+		event.events = EPOLLIN;
+		event.data.u64 = MakeEventData(EVENT_JOB_TIMER, (uint64_t)slot);
+		epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, job->timer_fd, &event);
+	}
+	timer.it_value.tv_sec = ns / 1000000000ull;
+	timer.it_value.tv_nsec = ns % 1000000000ull;
+	return timerfd_settime(job->timer_fd, 0, &timer, NULL) == 0;
+}
+
+// The job ran out of time: send its signal, then SIGKILL once kill_after has passed too.
+// A stopped job is continued so it can act on the signal
+void FireJobTimer(int slot) {
+	struct Job* job = &g_jobs[slot];
+	uint64_t num_expirations;
+
+	if (read(job->timer_fd, &num_expirations, sizeof(num_expirations)) != sizeof(num_expirations)) return;
+	if (job->timeout_stage == TIMEOUT_NOT_FIRED) {
+		job->timeout_stage = TIMEOUT_SIGNALED;
+		SignalJob(slot, job->timeout.signal);
+		if (job->timeout.kill_after_ns > 0) ArmJobTimer(slot, job->timeout.kill_after_ns);
+	} else {
+		job->timeout_stage = TIMEOUT_KILLED;
+		SignalJob(slot, SIGKILL);
+	}
+	if (job->state == JOB_STOPPED) SignalJob(slot, SIGCONT);
+}
+
+// put a process of a background job under watch,
+// its pidfd wakes the event loop when it exits
+void KeepTrackPid(int slot, int index) {
+	struct JobProcess* process = &g_jobs[slot].processes[index];
+
+	if (process->is_done || process->is_watched) return;
+	process->is_watched = true;
+	process->pidfd = OpenPidfd(process->pid);
+	if (process->pidfd == -1) {
+		g_num_unwatched_processes++;
+		return;
+	}
+	struct epoll_event event = {0};
+	event.events = EPOLLIN;
+	event.data.u64 = MakeEventData(EVENT_JOB_PROCESS,
+		((uint64_t)slot << JOB_PROCESS_INDEX_BITS) | (uint64_t)index);
+	epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, process->pidfd, &event);
+}
+
+void WatchJobProcesses(int slot) {
+	int i;
+	for (i = 0; i < g_jobs[slot].num_processes; i++) {
+		KeepTrackPid(slot, i);
+	}
+}
+
+uint64_t TimevalNs(struct timeval time) {
+	return (uint64_t)time.tv_sec * 1000000000ull + (uint64_t)time.tv_usec * 1000ull;
+}
+
+void AddUsage(struct JobUsage* total, const struct rusage* usage) {
+	total->user_ns += TimevalNs(usage->ru_utime);
+	total->sys_ns += TimevalNs(usage->ru_stime);
+	if (usage->ru_maxrss > total->max_rss_kb) total->max_rss_kb = usage->ru_maxrss;
+	total->voluntary_switches += usage->ru_nvcsw;
+	total->involuntary_switches += usage->ru_nivcsw;
+}
+
+// Adds what the pipeline's $(...) children used to total, and starts that over
+void AddSubstitutionUsage(struct JobUsage* total) {
+	total->user_ns += g_substitution_usage.user_ns;
+	total->sys_ns += g_substitution_usage.sys_ns;
+	if (g_substitution_usage.max_rss_kb > total->max_rss_kb) total->max_rss_kb = g_substitution_usage.max_rss_kb;
+	total->voluntary_switches += g_substitution_usage.voluntary_switches;
+	total->involuntary_switches += g_substitution_usage.involuntary_switches;
+	memset(&g_substitution_usage, 0, sizeof(g_substitution_usage));
+}
+
+void RecordJobUsage(int slot) {
+	struct Job* job = &g_jobs[slot];
+	int i;
+
+	memset(&g_last_job_usage, 0, sizeof(g_last_job_usage));
+	g_last_job_usage.wall_ns = MonotonicNs() - job->start_ns;
+	for (i = 0; i < job->num_processes; i++) {
+		AddUsage(&g_last_job_usage, &job->processes[i].usage);
+	}
+	AddSubstitutionUsage(&g_last_job_usage);
+	g_has_last_job_usage = true;
+}
+
+void MarkProcessDone(int slot, int index, int wait_status) {
+	struct JobProcess* process = &g_jobs[slot].processes[index];
+
+	if (process->pidfd != -1) {
+		close(process->pidfd); // also drops it from the epoll set
+		process->pidfd = -1;
+	} else if (process->is_watched) {
+		g_num_unwatched_processes--;
+	}
+	process->is_done = true;
+	process->wait_status = wait_status;
+	g_jobs[slot].num_live_processes--;
+}
+
+// The job's exit code is its last process's, 128 + the signal that ended it, or 124 like
+// timeout(1) if it timed out and SIGKILL did not end it. A foreground job's becomes the last status
+void FinishJob(int slot) {
+	struct Job* job = &g_jobs[slot];
+	struct JobProcess* last_process = &job->processes[job->num_processes - 1];
+
+	if (last_process->pid == -1) {
+		job->exit_code = EXECUTE_FAILED_ERROR_CODE;
+	} else if (WIFSIGNALED(last_process->wait_status)) {
+		job->exit_code = 128 + WTERMSIG(last_process->wait_status);
+	} else {
+		job->exit_code = WEXITSTATUS(last_process->wait_status);
+	}
+	if (job->timeout_stage != TIMEOUT_NOT_FIRED && job->exit_code != 128 + SIGKILL) {
+		job->exit_code = TIMEOUT_EXIT_CODE;
+	}
+	if (!job->is_background && job->timeout_stage != TIMEOUT_NOT_FIRED) {
+		g_last_timeout = job->timeout;
+		g_last_timeout_stage = job->timeout_stage;
+		if (!(g_was_terminated && g_last_terminate_signal_code == SIGKILL)) {
+			g_last_exit_code = TIMEOUT_EXIT_CODE;
+			g_was_terminated = false;
+		}
+	}
+	g_num_finished_jobs++;
+	g_last_finished_job_slot = slot;
+	FreeJob(slot);
+}
+
+// Reap one process of a background job if it has exited. Returns true if it was reaped
+bool ReapJobProcess(int slot, int index) {
+	struct JobProcess* process = &g_jobs[slot].processes[index];
+	int child_exit_status = DEFAULT_NEG_INT;
+	pid_t actual_pid = DEFAULT_NEG_INT;
+
+	// NOHANG: non-block waiting
+	actual_pid = wait4(process->pid, &child_exit_status, WNOHANG, &process->usage);
+	if (actual_pid != process->pid) {
+		return false;
+	}
+	fprintf(stdout, "[%d] Background process %d has completed\n", JobId(slot), (int)actual_pid);
+	MarkProcessDone(slot, index, child_exit_status);
+	PrintBackgroundExitStatus(actual_pid, child_exit_status);
+	if (g_jobs[slot].num_live_processes == 0) {
+		FinishJob(slot);
+	}
+	fflush(stdout);
+	return true;
+}
+
+// Background processes with a pidfd are reaped by the event loop,
+// only those without one (pidfd_open unavailable) are polled here
+void CheckAndPrintCompletedProcs() {
+	int slot;
+	int i;
+
+	for (slot = 0; g_num_unwatched_processes > 0 && slot < g_job_high_water; slot++) {
+		if (!g_jobs[slot].is_background) continue;
+		for (i = 0; g_jobs[slot].is_used && i < g_jobs[slot].num_processes; i++) {
+			struct JobProcess* process = &g_jobs[slot].processes[i];
+			if (process->is_watched && process->pidfd == -1 && !process->is_done) {
+				ReapJobProcess(slot, i);
+			}
+		}
+	}
+}
+
+void FinishParallelTask(int index, int wait_status) {
+	struct ParallelTask* task = &g_parallel_tasks[index];
+
+	if (task->pidfd != -1) {
+		close(task->pidfd);
+		task->pidfd = -1;
+	}
+	task->is_done = true;
+	task->wait_status = wait_status;
+	g_parallel_completion_order[g_num_completed_parallel_tasks++] = index;
+	g_num_running_parallel_tasks--;
+}
+
+// Reap a task of the parallel builtin if it has exited. Returns true if it was reaped
+bool ReapParallelTask(int index) {
+	struct ParallelTask* task = &g_parallel_tasks[index];
+	int child_exit_status = DEFAULT_NEG_INT;
+
+	if (task->is_done || wait4(task->pid, &child_exit_status, WNOHANG, &task->usage) != task->pid) {
+		return false;
+	}
+	FinishParallelTask(index, child_exit_status);
+	return true;
+}
+
+// Tasks of a running parallel builtin share the shell's group, they are signaled one by one
+void SignalParallelTasks(int signo) {
+	int i;
+
+	for (i = 0; g_parallel_tasks != NULL && i < g_num_parallel_tasks; i++) {
+		if (g_parallel_tasks[i].pid > 0 && !g_parallel_tasks[i].is_done) kill(g_parallel_tasks[i].pid, signo);
+	}
+}
+
+// SIGTERM for the shell goes on to its own work only: every job through its group, stopped
+// ones are continued to see it, and the parallel tasks
+void TerminateJobs(void) {
+	int slot;
+
+	for (slot = 0; slot < g_job_high_water; slot++) {
+		if (!g_jobs[slot].is_used) continue;
+		SignalJob(slot, SIGTERM);
+		if (g_jobs[slot].state == JOB_STOPPED) SignalJob(slot, SIGCONT);
+	}
+	SignalParallelTasks(SIGTERM);
+}
+
+void ForgetStalePaths(void);
+
+// Drain the signalfd. Returns true if SIGINT, SIGTERM or SIGTSTP was among the signals,
+// which interrupts whatever the shell was waiting for (g_signal_caught is set)
+bool HandleSignals(void) {
+	struct signalfd_siginfo info;
+	bool is_interrupted = false;
+	bool is_child_changed = false;
+
+	while (read(g_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		switch (info.ssi_signo) {
+		case SIGCHLD:
+			is_child_changed = true;
+			break;
+		case SIGINT:
+			if (g_foreground_pgid > 0) {
+				killpg(g_foreground_pgid, SIGINT);
+			}
+			SignalParallelTasks(SIGINT);
+			if (g_is_interactive) printf("\n");
+			is_interrupted = true;
+			break;
+		case SIGTERM:
+			TerminateJobs();
+			is_interrupted = true;
+			break;
+		case SIGTSTP:
+			g_bg_command_enable = !g_bg_command_enable;
+			printf(g_bg_command_enable ? "\nExiting fore-ground only mode\n"
+				: "\nEntering fore-ground only mode\n");
+			is_interrupted = true;
+			break;
+		}
+	}
+	fflush(stdout);
+	// coalesced, one SIGCHLD may stand for many children; pidfd ones have events of their own
+	if (is_child_changed) {
+		CheckAndPrintCompletedProcs();
+		ForgetStalePaths();
+	}
+	if (is_interrupted) g_signal_caught = true;
+	return is_interrupted;
+}
+
+// Wait once for events and handle them.
+// Returns 1 if stdin is readable, 0 if not, -1 if a signal interrupted the wait
+int HandleEvents(int timeout_ms) {
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	int num_events;
+	int stdin_ready = 0;
+	bool is_interrupted = false;
+	int i;
+
+	num_events = epoll_wait(g_epoll_fd, events, MAX_EPOLL_EVENTS, timeout_ms);
+	if (num_events == -1) {
+		if (errno == EINTR) return 0; // SIGCONT after the shell itself was stopped
+		perror("epoll_wait()");
+		exit(1);
+	}
+	for (i = 0; i < num_events; i++) {
+		uint64_t payload = events[i].data.u64 & (((uint64_t)1 << EVENT_KIND_SHIFT) - 1);
+		switch ((EventKind)(events[i].data.u64 >> EVENT_KIND_SHIFT)) {
+		case EVENT_INPUT:
+			stdin_ready = 1;
+			break;
+		case EVENT_SIGNAL:
+			if (HandleSignals()) is_interrupted = true;
+			break;
+		case EVENT_JOB_PROCESS: {
+			// the job may have been freed earlier in this batch, ReapJobProcess tolerates a reused slot.
+			// One brought back by fg is WaitJobBlock's to reap
+			int slot = (int)(payload >> JOB_PROCESS_INDEX_BITS);
+			int index = (int)(payload & (((uint64_t)1 << JOB_PROCESS_INDEX_BITS) - 1));
+			if (slot < g_job_capacity && g_jobs[slot].is_used && g_jobs[slot].is_background
+				&& index < g_jobs[slot].num_processes && !g_jobs[slot].processes[index].is_done) {
+				ReapJobProcess(slot, index);
+			}
+			break;
+		}
+		case EVENT_JOB_TIMER:
+			// freed earlier in this batch: its timer went with it
+			if (payload < (uint64_t)g_job_capacity && g_jobs[payload].is_used && g_jobs[payload].timer_fd != -1) {
+				FireJobTimer((int)payload);
+			}
+			break;
+		case EVENT_PARALLEL_TASK:
+			if (g_parallel_tasks != NULL) ReapParallelTask((int)payload);
+			break;
+		case EVENT_SERVE_LISTEN:
+		case EVENT_SERVE_CLIENT:
+		case EVENT_SERVE_OUTPUT:
+		case EVENT_SERVE_REQUEST:
+			break; // RunServer waits on those itself
+		}
+	}
+	return is_interrupted ? -1 : stdin_ready;
+}
+
+bool IndexHistory(size_t max_bytes);
+
+// Wait for events, reaping background children as soon as they exit.
+// Returns true once the input is readable, false if a signal interrupted the wait
+bool WaitForInput(void) {
+	int result;
+
+	if (!g_input_is_pollable) {
+		return HandleEvents(0) != -1;
+	}
+	// the history is indexed a step at a time while nothing comes, so looking at it is quick
+	while (!g_is_history_indexed) {
+		result = HandleEvents(0);
+		if (result != 0) return result == 1;
+		g_is_history_indexed = IndexHistory(HISTORY_INDEX_STEP);
+	}
+	do {
+		result = HandleEvents(-1);
+	} while (result == 0);
+	return result == 1;
+}
+
+// Stop or resume waking up for input, builtins that wait on jobs do not want it
+void SetInputWatched(bool is_watched) {
+	struct epoll_event event = {0};
+
+	if (!g_input_is_pollable) return;
+	event.events = is_watched ? EPOLLIN : 0;
+	event.data.u64 = MakeEventData(EVENT_INPUT, 0);
+	epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, g_input_fd, &event);
+}
+
+// Look at every live process of a foreground job without blocking.
+// One that cannot be waited for (ECHILD) is done, with a failure status.
+// Returns true if one of them has stopped
+bool PollJobProcesses(int slot) {
+	struct Job* job = &g_jobs[slot];
+	int child_exit_status = DEFAULT_NEG_INT;
+	pid_t actual_pid;
+	int i;
+
+	for (i = 0; i < job->num_processes; i++) {
+		if (job->processes[i].is_done) continue;
+		do {
+			actual_pid = wait4(job->processes[i].pid, &child_exit_status, WNOHANG | WUNTRACED,
+				&job->processes[i].usage);
+		} while (actual_pid == -1 && errno == EINTR);
+		if (actual_pid == 0) continue;
+		if (actual_pid == -1) {
+			perror("wait4()");
+			child_exit_status = W_EXITCODE(WAIT_FAILED_ERROR_CODE, 0);
+		}
+		if (WIFSTOPPED(child_exit_status)) return true;
+		MarkProcessDone(slot, i, child_exit_status);
+	}
+	return false;
+}
+
+// Block until the job finishes or stops, the way a foreground command is waited for.
+// The wait is the event loop: SIGCHLD wakes it to poll the job again, SIGINT is forwarded
+// to a job with its own group, and background jobs keep being reaped meanwhile.
+// The job's group has the terminal meanwhile, if the shell has one
+void WaitJobBlock(int slot) {
+	struct Job* job = &g_jobs[slot];
+	bool is_stopped = false;
+	bool has_terminal = g_terminal_fd != -1 && job->pgid > 0;
+
+	if (job->pgid > 0) {
+		g_foreground_pgid = job->pgid;
+	}
+	if (has_terminal) GiveTerminal(job->pgid);
+	SetInputWatched(false);
+	while (1) {
+		is_stopped = PollJobProcesses(slot);
+		if (is_stopped || job->num_live_processes == 0) break;
+		HandleEvents(-1);
+	}
+	SetInputWatched(true);
+	g_foreground_pgid = 0;
+	if (has_terminal) GiveTerminal(g_shell_pgid);
+
+	if (is_stopped) {
+		job->state = JOB_STOPPED;
+		job->is_background = true;
+		g_num_stopped_jobs++;
+		g_current_job_slot = slot;
+		printf("\n");
+		PrintJob(slot);
+		WatchJobProcesses(slot);
+		return;
+	}
+
+	struct JobProcess* last_process = &job->processes[job->num_processes-1];
+	if (last_process->pid == -1) {
+		g_last_exit_code = EXECUTE_FAILED_ERROR_CODE;
+		g_was_terminated = false;
+	} else {
+		PrintChildExitStatus(last_process->pid, last_process->wait_status);
+		// ^C went to the job's group alone, the rest of the line stops as if the shell had it
+		if (has_terminal && WIFSIGNALED(last_process->wait_status) && WTERMSIG(last_process->wait_status) == SIGINT) {
+			g_signal_caught = true;
+		}
+	}
+	RecordJobUsage(slot);
+	FinishJob(slot);
+}
+
+// Input //
+
+// Script file as one read-only mapping, lines are then cut out of it one at a time.
+// Anything that cannot be mapped (a pipe, /dev/stdin) is read like stdin instead
+void OpenScript(const char* script_path) {
+	struct stat file_info;
+	void* mapping;
+
+	g_input_fd = open(script_path, O_RDONLY | O_CLOEXEC);
+	if (g_input_fd == -1) {
+		fprintf(stderr, "tinysh: %s: %s\n", script_path, strerror(errno));
+		exit(127);
+	}
+	if (fstat(g_input_fd, &file_info) == 0 && S_ISREG(file_info.st_mode)) {
+		if (file_info.st_size == 0) {
+			g_input_data = "";
+		} else {
+			mapping = mmap(NULL, file_info.st_size, PROT_READ, MAP_PRIVATE, g_input_fd, 0);
+			if (mapping != MAP_FAILED) {
+				madvise(mapping, file_info.st_size, MADV_SEQUENTIAL);
+				g_input_data = (const char*)mapping;
+				g_input_data_length = file_info.st_size;
+			}
+		}
+	}
+	g_is_interactive = false;
+}
+
+// -c: the command string is the whole input
+void UseCommandString(const char* command_string) {
+	g_input_data = command_string;
+	g_input_data_length = strlen(command_string);
+	g_is_interactive = false;
+	g_is_command_string = true;
+}
+
+// nothing left after the line GetUserCommand returned last
+bool IsInputExhausted(void) {
+	return g_input_data != NULL && g_input_data_position >= g_input_data_length;
+}
+
+// Next line of a mapped script or of the -c string, copied into the command arena
+char* GetInputDataLine(void) {
+	const char* line = g_input_data + g_input_data_position;
+	size_t remaining = g_input_data_length - g_input_data_position;
+	const char* line_end;
+	size_t line_length;
+
+	if (remaining == 0) return NULL;
+	line_end = (const char*)memchr(line, '\n', remaining);
+	line_length = line_end ? (size_t)(line_end - line) : remaining;
+	g_input_data_position += line_length + (line_end ? 1 : 0);
+
+	// between lines is where background jobs get reaped and signals are seen
+	HandleEvents(0);
+	return ArenaStrndup(&g_command_arena, line, line_length);
+}
+
+// Next line of input without its '\n', valid until the next call.
+// Returns NULL on EOF, or when a signal interrupted the wait (g_signal_caught is set)
+char* GetUserCommand(char* input_string) {
+	char* line_end;
+	ssize_t num_read;
+
+	if (g_input_data != NULL) {
+		return GetInputDataLine();
+	}
+	if (g_input_buffer == NULL) {
+		g_input_buffer_size = (INPUT_READ_SIZE + 1) * 2;
+		g_input_buffer = (char*)malloc(g_input_buffer_size);
+	}
+	while (1) {
+		line_end = memchr(g_input_buffer + g_input_buffer_consumed, '\n',
+			g_input_buffer_length - g_input_buffer_consumed);
+		if (line_end != NULL) {
+			input_string = g_input_buffer + g_input_buffer_consumed;
+			*line_end = '\0';
+			g_input_buffer_consumed = line_end + 1 - g_input_buffer;
+			return input_string;
+		}
+
+		// keep the partial line, make room for one more read
+		memmove(g_input_buffer, g_input_buffer + g_input_buffer_consumed,
+			g_input_buffer_length - g_input_buffer_consumed);
+		g_input_buffer_length -= g_input_buffer_consumed;
+		g_input_buffer_consumed = 0;
+		if (g_input_buffer_length + INPUT_READ_SIZE + 1 > g_input_buffer_size) {
+			g_input_buffer_size = (g_input_buffer_length + INPUT_READ_SIZE + 1) * 2;
+			g_input_buffer = (char*)realloc(g_input_buffer, g_input_buffer_size);
+		}
+
+		if (!WaitForInput()) return NULL;
+		num_read = read(g_input_fd, g_input_buffer + g_input_buffer_length, INPUT_READ_SIZE);
+		if (num_read == -1 && errno == EINTR) return NULL;
+		if (num_read <= 0) {
+			if (g_input_buffer_length == 0) return NULL;
+			// last line without '\n'
+			g_input_buffer[g_input_buffer_length] = '\0';
+			g_input_buffer_consumed = g_input_buffer_length;
+			return g_input_buffer;
+		}
+		g_input_buffer_length += num_read;
+	}
+}
+
+void PrintReceivedCommand(int num_token, char* command_tokens[]) {
+	int i;
+	for (i = 0; i < num_token; ++i) {
+		printf("%s ", command_tokens[i]);
+	}
+	printf("\n");
+}
+
+// Pipeline //
+
+int DefaultRedirectionFd(RedirectionType type) {
+	switch (type) {
+	case REDIRECT_READ:
+	case REDIRECT_DUP_IN:
+	case REDIRECT_HEREDOC:
+	case REDIRECT_HEREDOC_STRIP:
+	case REDIRECT_HERESTRING:
+		return STDIN_FILENO;
+	default:
+		return STDOUT_FILENO;
+	}
+}
+
+bool IsFdNumber(const char* text) {
+	if (*text == '\0') return false;
+	for (; *text != '\0'; text++) {
+		if (*text < '0' || *text > '9') return false;
+	}
+	return true;
+}
+
+// Pick off the redirections and the word right next to them, and the NAME=value words in
+// front of the command, everything else becomes argv.
+// Nothing is opened here, here-doc bodies come from AttachHereDocuments
+int ProcessIORedirection(struct Command* command, struct Token stage_tokens[], int num_stage_tokens) {
+	struct Redirection* redirection;
+	struct Token* word;
+	int i;
+
+	command->argv = (char**)ArenaAlloc(&g_command_arena, (num_stage_tokens + 1) * sizeof(char*));
+	command->num_tokens = 0;
+	command->redirections = (struct Redirection*)ArenaAlloc(&g_command_arena,
+		num_stage_tokens * sizeof(struct Redirection));
+	command->num_redirections = 0;
+	command->fd_actions = NULL;
+	command->num_fd_actions = 0;
+	command->assignments = NULL;
+	command->num_assignments = 0;
+	for (i = 0; i < num_stage_tokens; i++) {
+		switch (stage_tokens[i].type) {
+		case TOKEN_WORD:
+			if (command->num_tokens == 0 && IsAssignmentWord(&stage_tokens[i])) {
+				if (command->assignments == NULL) {
+					command->assignments = (char**)ArenaAlloc(&g_command_arena, num_stage_tokens * sizeof(char*));
+				}
+				command->assignments[command->num_assignments++] = stage_tokens[i].text;
+				break;
+			}
+			command->argv[command->num_tokens++] = stage_tokens[i].text;
+			break;
+		case TOKEN_REDIRECT:
+			if (i + 1 == num_stage_tokens || stage_tokens[i+1].type != TOKEN_WORD) {
+				fprintf(stderr, "syntax error: '%s' needs a file name\n", stage_tokens[i].text);
+				return -1;
+			}
+			word = &stage_tokens[i+1];
+			redirection = &command->redirections[command->num_redirections++];
+			redirection->type = stage_tokens[i].redirection;
+			redirection->fd = stage_tokens[i].io_number != -1 ? stage_tokens[i].io_number
+				: DefaultRedirectionFd(redirection->type);
+			redirection->word = word->text;
+			redirection->body = NULL;
+			redirection->body_length = 0;
+			redirection->is_body_expanded = false;
+			switch (redirection->type) {
+			case REDIRECT_DUP_OUT:
+				// >&file is &>file
+				if (!IsFdNumber(word->text) && strcmp(word->text, "-") != 0) {
+					if (stage_tokens[i].io_number != -1) {
+						fprintf(stderr, "%s: ambiguous redirect\n", word->text);
+						return -1;
+					}
+					redirection->type = REDIRECT_WRITE_ALL;
+				}
+				break;
+			case REDIRECT_DUP_IN:
+				if (!IsFdNumber(word->text) && strcmp(word->text, "-") != 0) {
+					fprintf(stderr, "%s: ambiguous redirect\n", word->text);
+					return -1;
+				}
+				break;
+			case REDIRECT_HEREDOC:
+			case REDIRECT_HEREDOC_STRIP:
+				// a quoted delimiter keeps the body literal
+				redirection->is_body_expanded = strpbrk(word->text, "'\"\\") == NULL
+					&& word->source_length == (int)strlen(word->text);
+				break;
+			case REDIRECT_HERESTRING:
+				redirection->body_length = strlen(word->text) + 1;
+				redirection->body = (char*)ArenaAlloc(&g_command_arena, redirection->body_length + 1);
+				memcpy(redirection->body, word->text, redirection->body_length - 1);
+				redirection->body[redirection->body_length - 1] = '\n';
+				redirection->body[redirection->body_length] = '\0';
+				break;
+			default:
+				break;
+			}
+			i++;
+			break;
+		default:
+			fprintf(stderr, "syntax error near '%s'\n", stage_tokens[i].text);
+			return -1;
+		}
+	}
+	command->argv[command->num_tokens] = NULL;
+	return command->num_tokens;
+}
+
+// Split tokens at every "|" into the stages of pipeline, all of it in the command arena.
+// Returns the number of stages, or -1 on a syntax error
+int ParsePipeline(struct Token command_tokens[], int num_tokens, struct Pipeline* pipeline) {
+	int stage_start = 0;
+	int num_stages = 1;
+	int i;
+
+	for (i = 0; i < num_tokens; i++) {
+		if (command_tokens[i].type == TOKEN_PIPE) num_stages++;
+	}
+	pipeline->stages = (struct Command*)ArenaAlloc(&g_command_arena, num_stages * sizeof(struct Command));
+
+	pipeline->num_stages = 0;
+	for (i = 0; i <= num_tokens; i++) {
+		if (i < num_tokens && command_tokens[i].type != TOKEN_PIPE) continue;
+
+		struct Command* command = &pipeline->stages[pipeline->num_stages];
+		if (ProcessIORedirection(command, &command_tokens[stage_start], i - stage_start) == -1) {
+			return -1;
+		}
+		// NAME=value alone sets shell variables, not in a pipeline
+		if (command->num_tokens == 0 && (command->num_assignments == 0 || num_stages > 1)) {
+			fprintf(stderr, "syntax error: empty command%s\n", num_tokens > 0 ? " near '|'" : "");
+			return -1;
+		}
+		pipeline->num_stages++;
+		stage_start = i + 1;
+	}
+	return pipeline->num_stages;
+}
+
+// The environment command's programs start with: the shell's snapshot, or a copy of it in the
+// command arena with its NAME=value words replacing or added to the lines
+char** CommandEnvironment(struct Command* command) {
+	char** environment = ShellEnvironment();
+	char** copy;
+	size_t name_length;
+	int num_entries;
+	int i;
+	int j;
+
+	if (command->num_assignments == 0) return environment;
+	for (num_entries = 0; environment[num_entries] != NULL; num_entries++) {}
+	copy = (char**)ArenaAlloc(&g_command_arena, (num_entries + command->num_assignments + 1) * sizeof(char*));
+	memcpy(copy, environment, num_entries * sizeof(char*));
+	for (i = 0; i < command->num_assignments; i++) {
+		name_length = strchr(command->assignments[i], '=') - command->assignments[i] + 1;
+		for (j = 0; j < num_entries && strncmp(copy[j], command->assignments[i], name_length) != 0; j++) {}
+		copy[j] = command->assignments[i];
+		if (j == num_entries) num_entries++;
+	}
+	copy[num_entries] = NULL;
+	return copy;
+}
+
+// NAME=value alone on a line: shell variables, exported only if they already were
+void AssignVariables(struct Command* command) {
+	char* equals;
+	int i;
+
+	for (i = 0; i < command->num_assignments; i++) {
+		equals = strchr(command->assignments[i], '=');
+		SetVariable(command->assignments[i], equals - command->assignments[i], equals + 1, strlen(equals + 1));
+	}
+}
+
+// $ and ` expansions in an unquoted here-doc body, never split; \$ \` \\ are the only escapes
+char* ExpandHereDocument(const char* body, size_t length, size_t* expanded_length) {
+	struct ArenaString out;
+	size_t run;
+	size_t i = 0;
+
+	ArenaStringInit(&g_command_arena, &out, length + 32);
+	while (i < length) {
+		if (body[i] == '$') {
+			i += AppendExpansion(&out, body + i, length - i);
+		} else if (body[i] == '`') {
+			i += AppendSubstitution(&out, body + i, length - i);
+		} else if (body[i] == '\\' && i + 1 < length && strchr("$`\\", body[i+1]) != NULL) {
+			ArenaStringAppend(&g_command_arena, &out, body + i + 1, 1);
+			i += 2;
+		} else {
+			for (run = 1; i + run < length && strchr("$`\\", body[i+run]) == NULL; run++) {}
+			ArenaStringAppend(&g_command_arena, &out, body + i, run);
+			i += run;
+		}
+	}
+	*expanded_length = out.length;
+	return ArenaStringFinish(&out);
+}
+
+// Read the body of every here-doc of the line not read yet from the lines that follow, in order,
+// into g_heredoc_bodies. That happens before any of it runs, so a here-doc of a command that
+// && skips is still consumed. Returns -1 if a signal interrupted the reading
+int ReadHereDocuments(struct Plan* plan) {
+	struct ArenaString body;
+	const char* delimiter;
+	bool is_strip;
+	char** bodies;
+	size_t* body_lengths;
+	char* line;
+	int i;
+
+	if (plan->num_heredocs == g_num_heredoc_bodies) return 0;
+	bodies = (char**)ArenaAlloc(&g_command_arena, plan->num_heredocs * sizeof(char*));
+	body_lengths = (size_t*)ArenaAlloc(&g_command_arena, plan->num_heredocs * sizeof(size_t));
+	if (g_num_heredoc_bodies > 0) {
+		memcpy(bodies, g_heredoc_bodies, g_num_heredoc_bodies * sizeof(char*));
+		memcpy(body_lengths, g_heredoc_body_lengths, g_num_heredoc_bodies * sizeof(size_t));
+	}
+	g_heredoc_bodies = bodies;
+	g_heredoc_body_lengths = body_lengths;
+	for (i = g_num_heredoc_bodies; i < plan->num_heredocs; i++) {
+		delimiter = plan->heredocs[i][1].text;
+		is_strip = plan->heredocs[i]->redirection == REDIRECT_HEREDOC_STRIP;
+		ArenaStringInit(&g_command_arena, &body, 256);
+		while (1) {
+			if (g_is_interactive) {
+				printf("> ");
+				fflush(stdout);
+			}
+			line = GetUserCommand(NULL);
+			if (line == NULL) {
+				if (g_signal_caught) return -1;
+				fprintf(stderr, "warning: here-document delimited by end of file (wanted '%s')\n",
+					delimiter);
+				break;
+			}
+			if (is_strip) {
+				while (*line == '\t') line++;
+			}
+			if (strcmp(line, delimiter) == 0) break;
+			ArenaStringAppend(&g_command_arena, &body, line, strlen(line));
+			ArenaStringAppend(&g_command_arena, &body, "\n", 1);
+		}
+		g_heredoc_body_lengths[i] = body.length;
+		g_heredoc_bodies[i] = ArenaStringFinish(&body);
+		g_num_heredoc_bodies = i + 1;
+	}
+	return 0;
+}
+
+// Hand the bodies read by ReadHereDocuments to the here-doc redirections of commands,
+// starting with body first. Unquoted ones are expanded now, when the command runs
+void AttachHereDocuments(struct Command* commands, int num_commands, int first) {
+	struct Redirection* redirection;
+	int index = first;
+	int stage;
+	int i;
+
+	for (stage = 0; stage < num_commands; stage++) {
+		for (i = 0; i < commands[stage].num_redirections; i++) {
+			redirection = &commands[stage].redirections[i];
+			if (redirection->type != REDIRECT_HEREDOC && redirection->type != REDIRECT_HEREDOC_STRIP) {
+				continue;
+			}
+			if (redirection->is_body_expanded) {
+				redirection->body = ExpandHereDocument(g_heredoc_bodies[index], g_heredoc_body_lengths[index],
+					&redirection->body_length);
+			} else {
+				redirection->body = g_heredoc_bodies[index];
+				redirection->body_length = g_heredoc_body_lengths[index];
+			}
+			index++;
+		}
+	}
+}
+
+bool WriteAll(int fd, const char* data, size_t length) {
+	ssize_t num_written;
+
+	while (length > 0) {
+		num_written = write(fd, data, length);
+		if (num_written == -1 && errno == EINTR) continue;
+		if (num_written <= 0) return false;
+		data += num_written;
+		length -= num_written;
+	}
+	return true;
+}
+
+bool ReadAll(int fd, char* data, size_t length) {
+	ssize_t num_read;
+
+	while (length > 0) {
+		num_read = read(fd, data, length);
+		if (num_read == -1 && errno == EINTR) continue;
+		if (num_read <= 0) return false;
+		data += num_read;
+		length -= num_read;
+	}
+	return true;
+}
+
+// A readable fd holding body, nothing touches the disk: a pipe if the body surely fits
+// in one, a memfd otherwise. Returns -1 on failure
+int OpenHereDocument(const char* body, size_t length) {
+	int pipe_fds[2];
+	int memfd;
+
+	if (length <= (size_t)HEREDOC_PIPE_MAX) {
+		if (pipe2(pipe_fds, O_CLOEXEC) == -1) return -1;
+		WriteAll(pipe_fds[1], body, length);
+		close(pipe_fds[1]);
+		return pipe_fds[0];
+	}
+	memfd = memfd_create("heredoc", MFD_CLOEXEC);
+	if (memfd == -1) return -1;
+	if (!WriteAll(memfd, body, length) || lseek(memfd, 0, SEEK_SET) == -1) {
+		close(memfd);
+		return -1;
+	}
+	return memfd;
+}
+
+// redirecting to fd would clobber it before a later action reads from it
+bool IsRedirectionTarget(struct Command* command, int fd) {
+	int i;
+
+	for (i = 0; i < command->num_redirections; i++) {
+		if (command->redirections[i].fd == fd) return true;
+		if ((command->redirections[i].type == REDIRECT_WRITE_ALL
+			|| command->redirections[i].type == REDIRECT_APPEND_ALL) && fd <= STDERR_FILENO) return true;
+	}
+	return false;
+}
+
+// fd as the source of N>&fd: set up by an earlier action, or one of the shell's own
+// that a child inherits; the shell's private fds are all close-on-exec
+bool IsFdAvailable(struct Command* command, int fd) {
+	int flags;
+	int i;
+
+	for (i = command->num_fd_actions - 1; i >= 0; i--) {
+		if (command->fd_actions[i].to_fd == fd) return command->fd_actions[i].from_fd != -1;
+	}
+	flags = fcntl(fd, F_GETFD);
+	return flags != -1 && (flags & FD_CLOEXEC) == 0;
+}
+
+void AddFdAction(struct Command* command, int from_fd, int to_fd, bool is_owned) {
+	struct FdAction* action = &command->fd_actions[command->num_fd_actions++];
+	action->from_fd = from_fd;
+	action->to_fd = to_fd;
+	action->is_owned = is_owned;
+}
+
+// close the fds OpenRedirections opened, the child has its own copies by now
+void CloseRedirections(struct Command* command) {
+	int i;
+
+	for (i = 0; i < command->num_fd_actions; i++) {
+		if (command->fd_actions[i].is_owned) {
+			close(command->fd_actions[i].from_fd);
+			command->fd_actions[i].is_owned = false;
+		}
+	}
+}
+
+// Open every file and here-doc of the command in the shell, close-on-exec, and turn the
+// redirections into fd_actions. Errors are reported here instead of from inside a child.
+// Returns false, with nothing left open, if one cannot be opened
+bool OpenRedirections(struct Command* command) {
+	struct Redirection* redirection;
+	int flags;
+	int fd;
+	int i;
+
+	command->num_fd_actions = 0;
+	if (command->num_redirections == 0) return true;
+	command->fd_actions = (struct FdAction*)ArenaAlloc(&g_command_arena,
+		2 * command->num_redirections * sizeof(struct FdAction));
+	for (i = 0; i < command->num_redirections; i++) {
+		redirection = &command->redirections[i];
+		flags = -1;
+		switch (redirection->type) {
+		case REDIRECT_READ: flags = O_RDONLY; break;
+		case REDIRECT_WRITE:
+		case REDIRECT_WRITE_ALL: flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+		case REDIRECT_APPEND:
+		case REDIRECT_APPEND_ALL: flags = O_WRONLY | O_CREAT | O_APPEND; break;
+		case REDIRECT_DUP_OUT:
+		case REDIRECT_DUP_IN:
+			if (strcmp(redirection->word, "-") == 0) {
+				AddFdAction(command, -1, redirection->fd, false);
+				continue;
+			}
+			fd = atoi(redirection->word);
+			if (!IsFdAvailable(command, fd)) {
+				fprintf(stderr, "%s: Bad file descriptor\n", redirection->word);
+				CloseRedirections(command);
+				return false;
+			}
+			AddFdAction(command, fd, redirection->fd, false);
+			continue;
+		default:
+			break;
+		}
+
+		if (flags != -1) {
+			fd = open(redirection->word, flags | O_CLOEXEC, 0644);
+		} else {
+			fd = OpenHereDocument(redirection->body, redirection->body_length);
+		}
+		if (fd == -1) {
+			fprintf(stderr, "%s: %s\n", flags != -1 ? redirection->word : "here-document", strerror(errno));
+			CloseRedirections(command);
+			return false;
+		}
+		if (fd < FIRST_PRIVATE_FD && IsRedirectionTarget(command, fd)) {
+			int moved_fd = fcntl(fd, F_DUPFD_CLOEXEC, FIRST_PRIVATE_FD);
+			close(fd);
+			fd = moved_fd;
+		}
+		if (redirection->type == REDIRECT_WRITE_ALL || redirection->type == REDIRECT_APPEND_ALL) {
+			AddFdAction(command, fd, STDOUT_FILENO, true);
+			AddFdAction(command, STDOUT_FILENO, STDERR_FILENO, false);
+		} else {
+			AddFdAction(command, fd, redirection->fd, true);
+		}
+	}
+	return true;
+}
+
+// Bigger pipe buffers mean fewer wakeups between stages; best effort only
+void SetPipeBufferSize(int pipe_fd) {
+	fcntl(pipe_fd, F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+}
+
+// Carry out the fd actions in the calling process, dup2 leaves the copies inheritable.
+// Returns false if one failed
+bool ApplyFdActions(struct Command* command) {
+	struct FdAction* action;
+	int i;
+
+	for (i = 0; i < command->num_fd_actions; i++) {
+		action = &command->fd_actions[i];
+		if (action->from_fd == -1) {
+			close(action->to_fd);
+		} else if (action->from_fd == action->to_fd) {
+			fcntl(action->to_fd, F_SETFD, 0);
+		} else if (dup2(action->from_fd, action->to_fd) == -1) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// fork backend only, in the child: pipe ends first, then the command's own redirections.
+// Only the dup'ed copies survive the exec, everything the shell opened is O_CLOEXEC
+bool RedirectIO(struct Command* command, int stdin_fd, int stdout_fd) {
+	if (stdin_fd != STDIN_FILENO && dup2(stdin_fd, STDIN_FILENO) == -1) return false;
+	if (stdout_fd != STDOUT_FILENO && dup2(stdout_fd, STDOUT_FILENO) == -1) return false;
+	return ApplyFdActions(command);
+}
+
+// Command hash //
+
+// FNV-1a
+unsigned int HashString(const char* string) {
+	unsigned int hash = 2166136261u;
+	while (*string != '\0') {
+		hash ^= (unsigned char)*string++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void ClearPathHash(void) {
+	int i;
+	for (i = 0; i < PATH_HASH_BUCKETS; i++) {
+		struct PathHashEntry* entry = g_path_hash[i];
+		while (entry != NULL) {
+			struct PathHashEntry* next = entry->next;
+			free(entry->name);
+			free(entry->path);
+			free(entry);
+			entry = next;
+		}
+		g_path_hash[i] = NULL;
+	}
+	g_num_path_hash_entries = 0;
+}
+
+// drop the whole table if $PATH is not what it was filled against
+void ValidatePathHash(void) {
+	char* path_env = LookupVariable("PATH");
+	if (path_env == NULL) path_env = "";
+	if (g_path_hash_path_env != NULL && strcmp(g_path_hash_path_env, path_env) == 0) {
+		return;
+	}
+	ClearPathHash();
+	free(g_path_hash_path_env);
+	g_path_hash_path_env = strdup(path_env);
+}
+
+struct PathHashEntry* FindPathHashEntry(const char* name) {
+	struct PathHashEntry* entry = g_path_hash[HashString(name) % PATH_HASH_BUCKETS];
+	while (entry != NULL && strcmp(entry->name, name) != 0) {
+		entry = entry->next;
+	}
+	return entry;
+}
+
+void ForgetCommandPath(const char* name) {
+	struct PathHashEntry** link = &g_path_hash[HashString(name) % PATH_HASH_BUCKETS];
+	while (*link != NULL) {
+		struct PathHashEntry* entry = *link;
+		if (strcmp(entry->name, name) == 0) {
+			*link = entry->next;
+			free(entry->name);
+			free(entry->path);
+			free(entry);
+			g_num_path_hash_entries--;
+			return;
+		}
+		link = &entry->next;
+	}
+}
+
+// Names fork children reported because their hashed path failed to exec. The ones whose path
+// really is gone are forgotten, so $PATH is searched again. Records are written whole, so a read
+// never ends inside one
+void ForgetStalePaths(void) {
+	char records[16 * STALE_PATH_RECORD_SIZE];
+	struct PathHashEntry* entry;
+	ssize_t num_read;
+	ssize_t i;
+
+	if (g_stale_path_fds[0] == -1) return;
+	while ((num_read = read(g_stale_path_fds[0], records, sizeof(records))) > 0) {
+		for (i = 0; i + (ssize_t)STALE_PATH_RECORD_SIZE <= num_read; i += STALE_PATH_RECORD_SIZE) {
+			records[i + STALE_PATH_RECORD_SIZE - 1] = '\0';
+			entry = FindPathHashEntry(records + i);
+			if (entry != NULL && access(entry->path, X_OK) != 0) ForgetCommandPath(records + i);
+		}
+	}
+}
+
+// walk $PATH the way execvp would, return a malloc'd path or NULL
+char* SearchPath(const char* name) {
+	char candidate[PATH_MAX];
+	struct stat file_info;
+	const char* dir = g_path_hash_path_env;
+	size_t name_length = strlen(name);
+
+	while (dir != NULL) {
+		const char* dir_end = strchr(dir, ':');
+		size_t dir_length = dir_end ? (size_t)(dir_end - dir) : strlen(dir);
+
+		if (dir_length + name_length + 2 <= sizeof(candidate)) {
+			if (dir_length == 0) { // empty entry means current directory
+				strcpy(candidate, name);
+			} else {
+				memcpy(candidate, dir, dir_length);
+				candidate[dir_length] = '/';
+				strcpy(candidate + dir_length + 1, name);
+			}
+			if (stat(candidate, &file_info) == 0 && S_ISREG(file_info.st_mode)
+				&& access(candidate, X_OK) == 0) {
+				return strdup(candidate);
+			}
+		}
+		dir = dir_end ? dir_end + 1 : NULL;
+	}
+	return NULL;
+}
+
+// Look a command name up in the hash, searching $PATH on a miss.
+// Names containing '/' are used as they are. Returns NULL if not found.
+char* ResolveCommandPath(const char* name) {
+	struct PathHashEntry* entry;
+	char* path;
+
+	if (strchr(name, '/') != NULL) {
+		return (char*)name;
+	}
+	ValidatePathHash();
+	entry = FindPathHashEntry(name);
+	if (entry == NULL) {
+		path = SearchPath(name);
+		if (path == NULL) {
+			return NULL;
+		}
+		unsigned int bucket = HashString(name) % PATH_HASH_BUCKETS;
+		entry = (struct PathHashEntry*)calloc(1, sizeof(struct PathHashEntry));
+		entry->name = strdup(name);
+		entry->path = path;
+		entry->next = g_path_hash[bucket];
+		g_path_hash[bucket] = entry;
+		g_num_path_hash_entries++;
+	}
+	entry->hits++;
+	return entry->path;
+}
+
+// hash: list the table
+// hash -r: empty it
+// hash name...: (re)resolve the names and remember them
+int RunHashBuiltin(char* command_tokens[], int num_tokens) {
+	int i;
+	int result = 0;
+
+	ValidatePathHash();
+	ForgetStalePaths();
+	if (num_tokens == 1) {
+		if (g_num_path_hash_entries == 0) {
+			printf("hash: hash table empty\n");
+			return 0;
+		}
+		printf("hits\tcommand\n");
+		for (i = 0; i < PATH_HASH_BUCKETS; i++) {
+			struct PathHashEntry* entry;
+			for (entry = g_path_hash[i]; entry != NULL; entry = entry->next) {
+				printf("%4d\t%s\n", entry->hits, entry->path);
+			}
+		}
+		return 0;
+	}
+	if (strcmp(command_tokens[1], "-r") == 0) {
+		ClearPathHash();
+		return 0;
+	}
+	for (i = 1; i < num_tokens; i++) {
+		if (strchr(command_tokens[i], '/') != NULL) continue;
+		ForgetCommandPath(command_tokens[i]);
+		if (ResolveCommandPath(command_tokens[i]) == NULL) {
+			fprintf(stderr, "hash: %s: not found\n", command_tokens[i]);
+			result = 1;
+			continue;
+		}
+		FindPathHashEntry(command_tokens[i])->hits = 0;
+	}
+	return result;
+}
+
+// Job settings //
+
+// "0-3,8,10-11" into set. Returns false if text is no such list
+bool ParseCpuList(const char* text, cpu_set_t* set) {
+	char* end;
+	long first;
+	long last;
+
+	CPU_ZERO(set);
+	while (1) {
+		if (*text < '0' || *text > '9') return false;
+		first = last = strtol(text, &end, 10);
+		if (*end == '-') {
+			text = end + 1;
+			if (*text < '0' || *text > '9') return false;
+			last = strtol(text, &end, 10);
+		}
+		if (first > last || last >= CPU_SETSIZE) return false;
+		for (; first <= last; first++) CPU_SET(first, set);
+		if (*end == '\0') return true;
+		if (*end != ',') return false;
+		text = end + 1;
+	}
+}
+
+// set as a list ParseCpuList reads back, into out
+void FormatCpuList(const cpu_set_t* set, char* out, size_t out_size) {
+	size_t length = 0;
+	int cpu = 0;
+	int last;
+
+	out[0] = '\0';
+	while (cpu < CPU_SETSIZE && length < out_size) {
+		if (!CPU_ISSET(cpu, set)) {
+			cpu++;
+			continue;
+		}
+		for (last = cpu; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set); last++) {}
+		length += snprintf(out + length, out_size - length, last == cpu ? "%s%d" : "%s%d-%d",
+			length == 0 ? "" : ",", cpu, last);
+		cpu = last + 1;
+	}
+}
+
+// In the child, between fork and exec. Returns false after reporting what failed
+bool ApplyJobSettings(const struct JobSettings* settings) {
+	struct rlimit limit;
+	int niceness;
+	int i;
+
+	if (settings->has_affinity && sched_setaffinity(0, sizeof(settings->affinity), &settings->affinity) == -1) {
+		int error = errno;
+		char list[8192];
+		FormatCpuList(&settings->affinity, list, sizeof(list));
+		fprintf(stderr, "pin: %s: %s\n", list, strerror(error));
+		return false;
+	}
+	if (settings->nice != 0) {
+		// setpriority clamps to the valid range, like nice; lowering it needs privileges
+		errno = 0;
+		niceness = getpriority(PRIO_PROCESS, 0);
+		if (errno == 0 && setpriority(PRIO_PROCESS, 0, niceness + settings->nice) == -1) {
+			fprintf(stderr, "nice: %s\n", strerror(errno));
+		}
+	}
+	for (i = 0; i < settings->num_limits; i++) {
+		limit.rlim_cur = limit.rlim_max = settings->limits[i].value;
+		if (setrlimit(settings->limits[i].resource, &limit) == -1) {
+			fprintf(stderr, "limit: %s\n", strerror(errno));
+			return false;
+		}
+	}
+	return true;
+}
+
+// The shell's own affinity, every job inherits it unless pinned otherwise.
+// Returns false after reporting a bad list
+bool SetShellAffinity(const char* cpu_list) {
+	cpu_set_t set;
+
+	if (!ParseCpuList(cpu_list, &set)) {
+		fprintf(stderr, "pin: %s: invalid CPU list\n", cpu_list);
+		return false;
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+		fprintf(stderr, "pin: %s: %s\n", cpu_list, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+// Pick the launch backend from $TINYSH_SPAWN ("posix_spawn" or "fork")
+void InitSpawnBackend(void) {
+	char* backend_name = getenv("TINYSH_SPAWN");
+	if (backend_name == NULL || strcmp(backend_name, "posix_spawn") == 0) {
+		g_spawn_backend = SPAWN_BACKEND_POSIX_SPAWN;
+	} else if (strcmp(backend_name, "fork") == 0) {
+		g_spawn_backend = SPAWN_BACKEND_FORK;
+	} else {
+		fprintf(stderr, "TINYSH_SPAWN: unknown backend '%s', using posix_spawn\n", backend_name);
+		g_spawn_backend = SPAWN_BACKEND_POSIX_SPAWN;
+	}
+}
+
+// fork backend: full copy of the shell, redirection and exec happen in the child.
+// settings: NULL, or what the child applies to itself before the exec
+pid_t ForkAndExecute(struct Command* command, int stdin_fd, int stdout_fd, pid_t pgid,
+	const struct JobSettings* settings) {
+	pid_t spawn_pid = DEFAULT_NEG_INT;
+	char** command_tokens = command->argv;
+	char* command_path = ResolveCommandPath(command_tokens[0]);
+	char** environment = CommandEnvironment(command);
+	bool is_hashed = command_path != NULL && command_path != command_tokens[0];
+	char stale_path_record[STALE_PATH_RECORD_SIZE];
+	int exec_pipe_fds[2] = {-1, -1};
+	uint64_t fork_start;
+	uint64_t fork_done;
+	char byte;
+
+	// tracing: the child's copy of the write end closes on exec, EOF tells when it happened
+	if (g_trace_fd != -1 && pipe2(exec_pipe_fds, O_CLOEXEC) == -1) {
+		exec_pipe_fds[0] = exec_pipe_fds[1] = -1;
+	}
+	// a child whose hashed path is gone says so here, nothing waits for it
+	if (is_hashed && g_stale_path_fds[0] == -1 && pipe2(g_stale_path_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+		g_stale_path_fds[0] = g_stale_path_fds[1] = -1;
+	}
+	fork_start = TraceClock();
+	spawn_pid = fork();
+	fork_done = TraceClock();
+	if (spawn_pid != 0) g_trace.spawn_ns += fork_done - fork_start;
+
+	if (spawn_pid == -1) {
+		perror("Failed to fork new process");
+		exit(FORK_FAILED_ERROR_CODE);
+	}
+	else if (spawn_pid == 0) { // sucessfully forked a new child process
+		//
+		// CHILD's code
+		//
+		if (pgid != KEEP_SHELL_PGROUP) {
+			setpgid(0, pgid);
+		}
+		if (TakesTerminal(pgid)) {
+			tcsetpgrp(g_terminal_fd, getpgrp()); // SIGTTOU is still blocked
+		}
+		sigprocmask(SIG_UNBLOCK, &g_blocked_signal_set, NULL);
+		if (!RedirectIO(command, stdin_fd, stdout_fd)) {
+			perror("dup2()");
+			_exit(EXECUTE_FAILED_ERROR_CODE);
+		}
+		if (settings != NULL && !ApplyJobSettings(settings)) {
+			_exit(SETTINGS_FAILED_EXIT_CODE);
+		}
+
+		if (command_path != NULL) {
+			execve(command_path, command_tokens, environment);
+			if (errno == ENOENT && is_hashed && g_stale_path_fds[1] != -1
+				&& strlen(command_tokens[0]) < sizeof(stale_path_record)) {
+				memset(stale_path_record, 0, sizeof(stale_path_record));
+				strcpy(stale_path_record, command_tokens[0]);
+				while (write(g_stale_path_fds[1], stale_path_record, sizeof(stale_path_record)) == -1
+					&& errno == EINTR) {}
+			}
+		}
+		// stale hash entry or unknown command: let execvp search the shell's $PATH and report
+		environ = environment;
+		execvp(command_tokens[0], command_tokens);
+
+		// if execute command failed, _exit: the shell's stdio buffers are not the child's to flush
+		perror("CHILD: exec failure!\n");
+		_exit(EXECUTE_FAILED_ERROR_CODE);
+	}
+	// also from the parent, so the group exists before the next stage joins it
+	if (pgid != KEEP_SHELL_PGROUP) {
+		setpgid(spawn_pid, pgid == 0 ? spawn_pid : pgid);
+	}
+	if (TakesTerminal(pgid)) {
+		GiveTerminal(pgid == 0 ? spawn_pid : pgid);
+	}
+	if (exec_pipe_fds[0] != -1) {
+		close(exec_pipe_fds[1]);
+		while (read(exec_pipe_fds[0], &byte, 1) == -1 && errno == EINTR) {}
+		close(exec_pipe_fds[0]);
+		g_trace.exec_ns += TraceClock() - fork_done;
+	}
+	return spawn_pid;
+}
+
+// posix_spawn backend: glibc launches the child with clone(CLONE_VM|CLONE_VFORK),
+// so nothing of the shell is copied; pipe ends and fd_actions become file actions.
+// pgid: KEEP_SHELL_PGROUP, 0 for a new group, or the group to join. A foreground job's
+// group takes the terminal in the child, before the exec.
+// Returns -1 if the child could not be started (exec or open failure).
+pid_t SpawnAndExecute(struct Command* command, int stdin_fd, int stdout_fd, pid_t pgid) {
+	pid_t spawn_pid = DEFAULT_NEG_INT;
+	char** command_tokens = command->argv;
+	posix_spawn_file_actions_t file_actions;
+	posix_spawnattr_t spawn_attributes;
+	sigset_t child_signal_mask;
+	char* command_path = NULL;
+	char** environment = CommandEnvironment(command);
+	uint64_t trace_start;
+	int spawn_result;
+	int i;
+
+	posix_spawn_file_actions_init(&file_actions);
+	if (stdin_fd != STDIN_FILENO) {
+		posix_spawn_file_actions_adddup2(&file_actions, stdin_fd, STDIN_FILENO);
+	}
+	if (stdout_fd != STDOUT_FILENO) {
+		posix_spawn_file_actions_adddup2(&file_actions, stdout_fd, STDOUT_FILENO);
+	}
+	for (i = 0; i < command->num_fd_actions; i++) {
+		if (command->fd_actions[i].from_fd == -1) {
+			posix_spawn_file_actions_addclose(&file_actions, command->fd_actions[i].to_fd);
+		} else {
+			// from_fd == to_fd just clears close-on-exec
+			posix_spawn_file_actions_adddup2(&file_actions, command->fd_actions[i].from_fd,
+				command->fd_actions[i].to_fd);
+		}
+	}
+	if (TakesTerminal(pgid)) {
+		// runs after the setpgid of POSIX_SPAWN_SETPGROUP, all signals blocked
+		posix_spawn_file_actions_addtcsetpgrp_np(&file_actions, g_terminal_fd);
+	}
+
+	// the shell's signals are blocked for its signalfd, the child must not inherit that
+	posix_spawnattr_init(&spawn_attributes);
+	sigemptyset(&child_signal_mask);
+	posix_spawnattr_setsigmask(&spawn_attributes, &child_signal_mask);
+	if (pgid != KEEP_SHELL_PGROUP) {
+		posix_spawnattr_setpgroup(&spawn_attributes, pgid);
+		posix_spawnattr_setflags(&spawn_attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+	} else {
+		posix_spawnattr_setflags(&spawn_attributes, POSIX_SPAWN_SETSIGMASK);
+	}
+
+	command_path = ResolveCommandPath(command_tokens[0]);
+	trace_start = TraceClock();
+	if (command_path == NULL) {
+		spawn_result = ENOENT;
+	} else {
+		spawn_result = posix_spawn(&spawn_pid, command_path, &file_actions, &spawn_attributes,
+			command_tokens, environment);
+		// the hashed binary went away: search $PATH again once
+		if (spawn_result == ENOENT && command_path != command_tokens[0]
+			&& access(command_path, X_OK) != 0) {
+			ForgetCommandPath(command_tokens[0]);
+			command_path = ResolveCommandPath(command_tokens[0]);
+			if (command_path != NULL) {
+				spawn_result = posix_spawn(&spawn_pid, command_path, &file_actions, &spawn_attributes,
+					command_tokens, environment);
+			}
+		}
+	}
+
+	g_trace.spawn_ns += TraceClock() - trace_start;
+	posix_spawnattr_destroy(&spawn_attributes);
+	posix_spawn_file_actions_destroy(&file_actions);
+
+	if (spawn_result != 0) {
+		fprintf(stderr, "%s: %s\n", command_tokens[0], strerror(spawn_result));
+		return -1;
+	}
+	return spawn_pid;
+}
+
+// A job just launched: a background one is put under watch, a foreground one waited for
+void WaitOrWatchJob(int slot) {
+	uint64_t trace_start;
+	int i;
+
+	if (g_is_bg_command) {
+		// non-block waiting
+		g_jobs[slot].is_background = true;
+		g_current_job_slot = slot;
+		if (g_jobs[slot].processes[g_jobs[slot].num_processes-1].pid != -1) {
+			g_last_background_pid = g_jobs[slot].processes[g_jobs[slot].num_processes-1].pid;
+		}
+		for (i = 0; i < g_jobs[slot].num_processes; i++) {
+			if (g_jobs[slot].processes[i].pid == -1) continue;
+			PrintBackgroundPidBegins(slot, g_jobs[slot].processes[i].pid);		
+			KeepTrackPid(slot, i);
+		}
+		if (g_jobs[slot].num_live_processes == 0) {
+			FinishJob(slot);
+		}
+	} else {
+		// block waiting
+		trace_start = TraceClock();
+		WaitJobBlock(slot);
+		g_trace.wait_ns += TraceClock() - trace_start;
+	}
+	
+	CheckAndPrintCompletedProcs();	
+}
+
+// set things up and launch one child per stage to execute the non-built-in commands,
+// stage i's stdout feeds stage i+1's stdin through a pipe, redirect if any.
+// The stages form one job with a process group of its own, see NewJobProcessGroup.
+// timeout: NULL, or the limit for the whole job, foreground or background.
+// settings: NULL, or pin/nice/limit for every stage; posix_spawn has no way to apply them, such
+// a job is forked whatever the backend
+void ExecuteCommand(struct Pipeline* pipeline, char* command_line, const struct JobTimeout* timeout,
+	const struct JobSettings* settings) {
+	pid_t stage_pid;
+	pid_t pgid = NewJobProcessGroup();
+	int pipe_fds[2];
+	int stage_stdin = STDIN_FILENO;
+	int stage_stdout;
+	int slot;
+	int i;
+
+	// without a terminal stdout is fully buffered, flush before children write to it
+	fflush(stdout);
+	slot = AllocateJob(command_line, pipeline->num_stages);
+
+	// every stage is started before any is waited on
+	for (i = 0; i < pipeline->num_stages; i++) {
+		stage_stdout = STDOUT_FILENO;
+		if (i < pipeline->num_stages - 1) {
+			// O_CLOEXEC: only the dup'ed 0/1 copies reach the children
+			if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+				perror("pipe2()");
+				pipe_fds[0] = pipe_fds[1] = -1;
+			} else {
+				SetPipeBufferSize(pipe_fds[1]);
+				stage_stdout = pipe_fds[1];
+			}
+		}
+
+		if (!OpenRedirections(&pipeline->stages[i])) {
+			stage_pid = -1; // reported, counts as a failed launch
+		} else if (g_spawn_backend == SPAWN_BACKEND_FORK || settings != NULL) {
+			stage_pid = ForkAndExecute(&pipeline->stages[i], stage_stdin, stage_stdout, pgid, settings);
+		} else {
+			stage_pid = SpawnAndExecute(&pipeline->stages[i], stage_stdin, stage_stdout, pgid);
+		}
+		CloseRedirections(&pipeline->stages[i]);
+		if (stage_pid != -1 && pgid == 0) {
+			pgid = stage_pid; // first stage leads the group
+		}
+		AddJobProcess(slot, stage_pid);
+
+		if (stage_stdin != STDIN_FILENO) close(stage_stdin);
+		if (stage_stdout != STDOUT_FILENO) close(stage_stdout);
+		if (i < pipeline->num_stages - 1) {
+			stage_stdin = pipe_fds[0] == -1 ? STDIN_FILENO : pipe_fds[0];
+		}
+	}
+	g_jobs[slot].pgid = pgid > 0 ? pgid : 0;
+	if (timeout != NULL && timeout->duration_ns > 0 && g_jobs[slot].num_live_processes > 0) {
+		g_jobs[slot].timeout = *timeout;
+		if (!ArmJobTimer(slot, timeout->duration_ns)) perror("timeout: timerfd");
+	}
+
+	WaitOrWatchJob(slot);
+}
+
+// -c mode, last command: the shell becomes the command instead of waiting for it,
+// which saves one process per invocation
+void ExecuteInPlace(struct Command* command) {
+	char* command_path = ResolveCommandPath(command->argv[0]);
+
+	fflush(stdout);
+	if (!OpenRedirections(command) || !ApplyFdActions(command)) {
+		exit(EXECUTE_FAILED_ERROR_CODE);
+	}
+	sigprocmask(SIG_UNBLOCK, &g_blocked_signal_set, NULL);
+	environ = CommandEnvironment(command);
+	if (command_path != NULL) {
+		execv(command_path, command->argv);
+	}
+	execvp(command->argv[0], command->argv);
+	fprintf(stderr, "%s: %s\n", command->argv[0], strerror(errno));
+	exit(EXECUTE_FAILED_ERROR_CODE);
+}
+
+void PrintLastStatus() {
+	if (g_was_terminated) {
+		printf("terminated by signal %d\n", g_last_terminate_signal_code);
+	}
+	else {
+		printf("exit value %d\n", g_last_exit_code);
+	}
+	if (g_last_parallel_num_tasks > 0) {
+		printf("parallel: %d of %d tasks failed\n", g_last_parallel_num_failed, g_last_parallel_num_tasks);
+	}
+	if (g_last_timeout_stage != TIMEOUT_NOT_FIRED) {
+		printf("timed out after %.3fs: sent SIG%s", g_last_timeout.duration_ns / 1e9,
+			SignalName(g_last_timeout.signal));
+		if (g_last_timeout_stage == TIMEOUT_KILLED) {
+			printf(", then SIGKILL after %.3fs more", g_last_timeout.kill_after_ns / 1e9);
+		}
+		printf("\n");
+	}
+}
+
+// status -v: the exit status, then what the last foreground job cost
+void PrintLastJobUsage(void) {
+	if (!g_has_last_job_usage) return;
+	printf("wall %.3fs  user %.3fs  sys %.3fs  max rss %ld kB  context switches %ld voluntary, %ld involuntary\n",
+		g_last_job_usage.wall_ns / 1e9, g_last_job_usage.user_ns / 1e9, g_last_job_usage.sys_ns / 1e9,
+		g_last_job_usage.max_rss_kb, g_last_job_usage.voluntary_switches,
+		g_last_job_usage.involuntary_switches);
+}
+
+// "%n" or "n" -> job slot, no argument means the current job. -1 if there is no such job
+int ParseJobSpec(const char* builtin_name, char* job_spec) {
+	int slot = g_current_job_slot;
+
+	if (job_spec != NULL) {
+		char* end = NULL;
+		long job_id = strtol(job_spec[0] == '%' ? job_spec + 1 : job_spec, &end, 10);
+		slot = (*end == '\0' && job_id > 0 && job_id <= g_job_high_water) ? (int)job_id - 1 : -1;
+	} else if (slot == -1) {
+		// the current job finished, fall back to the newest remaining one
+		for (slot = g_job_high_water - 1; slot >= 0 && !g_jobs[slot].is_used; slot--);
+	}
+	if (slot == -1 || !g_jobs[slot].is_used || !g_jobs[slot].is_background) {
+		fprintf(stderr, "%s: %s: no such job\n", builtin_name, job_spec ? job_spec : "current");
+		return -1;
+	}
+	return slot;
+}
+
+int RunJobsBuiltin(void) {
+	int slot;
+	for (slot = 0; slot < g_job_high_water; slot++) {
+		if (g_jobs[slot].is_used && g_jobs[slot].is_background) {
+			PrintJob(slot);
+		}
+	}
+	return 0;
+}
+
+// resume a job if it is stopped and mark it as running
+void ContinueJob(int slot) {
+	if (g_jobs[slot].state == JOB_STOPPED) {
+		g_jobs[slot].state = JOB_RUNNING;
+		g_num_stopped_jobs--;
+		SignalJob(slot, SIGCONT);
+	}
+}
+
+// fg [%n]: bring a job to the foreground and wait for it
+int RunFgBuiltin(char* command_tokens[], int num_tokens) {
+	int slot = ParseJobSpec("fg", num_tokens > 1 ? command_tokens[1] : NULL);
+	if (slot == -1) return 1;
+
+	printf("%s\n", g_jobs[slot].command_line);
+	fflush(stdout);
+	g_jobs[slot].is_background = false;
+	ContinueJob(slot);
+	WaitJobBlock(slot);
+	return g_last_exit_code;
+}
+
+// bg [%n]: let a stopped job continue in the background
+int RunBgBuiltin(char* command_tokens[], int num_tokens) {
+	int slot = ParseJobSpec("bg", num_tokens > 1 ? command_tokens[1] : NULL);
+	if (slot == -1) return 1;
+
+	ContinueJob(slot);
+	g_current_job_slot = slot;
+	printf("[%d] %s\n", JobId(slot), g_jobs[slot].command_line);
+	return 0;
+}
+
+// wait: every running background job, wait %n: that job, wait -n: the next job to finish
+int RunWaitBuiltin(char* command_tokens[], int num_tokens) {
+	int target_finished_jobs = g_num_finished_jobs + 1;
+	bool wait_next = num_tokens > 1 && strcmp(command_tokens[1], "-n") == 0;
+	char* job_spec = num_tokens > (wait_next ? 2 : 1) ? command_tokens[wait_next ? 2 : 1] : NULL;
+	int slot = -1;
+	int result = 0;
+
+	if (job_spec != NULL) {
+		if (job_spec[0] != '%') {
+			fprintf(stderr, "wait: %s: job spec must start with %%\n", job_spec);
+			return 1;
+		}
+		slot = ParseJobSpec("wait", job_spec);
+		if (slot == -1) return 127;
+	}
+
+	SetInputWatched(false);
+	while (result != -1) {
+		if (slot != -1) {
+			if (!g_jobs[slot].is_used) break; // no job is started while waiting, the slot is not reused
+		} else if (wait_next) {
+			if (g_num_finished_jobs >= target_finished_jobs || g_num_jobs == 0) break;
+		} else if (g_num_jobs - g_num_stopped_jobs == 0) {
+			break;
+		}
+		result = HandleEvents(-1);
+	}
+	SetInputWatched(true);
+	if (result == -1) return 128 + SIGINT;
+	// the slots of finished jobs are not reused while waiting, their exit codes are still there
+	if (slot != -1) return g_jobs[slot].exit_code;
+	if (wait_next && g_num_finished_jobs >= target_finished_jobs) return g_jobs[g_last_finished_job_slot].exit_code;
+	return wait_next ? 127 : 0;
+}
+
+// Parallel //
+
+// Argument lines for parallel from stdin until EOF, split in place; *out_buffer must be freed.
+// When stdin is the shell's own input, lines already buffered by GetUserCommand come first
+int ReadParallelArguments(bool is_shell_input, char** out_buffer, char*** out_arguments) {
+	size_t buffer_size = INPUT_READ_SIZE;
+	size_t length = 0;
+	char* buffer;
+	char** arguments;
+	char* line;
+	char* line_end;
+	int num_arguments = 0;
+	ssize_t num_read;
+
+	if (is_shell_input && g_input_fd == STDIN_FILENO && g_input_data == NULL) {
+		length = g_input_buffer_length - g_input_buffer_consumed;
+		if (length + INPUT_READ_SIZE > buffer_size) buffer_size = length + INPUT_READ_SIZE;
+	}
+	buffer = (char*)malloc(buffer_size + 1);
+	if (length > 0) {
+		memcpy(buffer, g_input_buffer + g_input_buffer_consumed, length);
+		g_input_buffer_consumed = g_input_buffer_length;
+	}
+	while (1) {
+		if (buffer_size - length < (size_t)INPUT_READ_SIZE) {
+			buffer_size *= 2;
+			buffer = (char*)realloc(buffer, buffer_size + 1);
+		}
+		num_read = read(STDIN_FILENO, buffer + length, buffer_size - length);
+		if (num_read == -1 && errno == EINTR) {
+			if (g_signal_caught) break;
+			continue;
+		}
+		if (num_read <= 0) break;
+		length += num_read;
+	}
+	buffer[length] = '\0';
+
+	for (line = buffer; line < buffer + length; line = line_end + 1) {
+		line_end = memchr(line, '\n', buffer + length - line);
+		if (line_end == NULL) line_end = buffer + length;
+		if (line_end > line) num_arguments++;
+	}
+	arguments = (char**)ArenaAlloc(&g_command_arena, (num_arguments + 1) * sizeof(char*));
+	num_arguments = 0;
+	for (line = buffer; line < buffer + length; line = line_end + 1) {
+		line_end = memchr(line, '\n', buffer + length - line);
+		if (line_end == NULL) line_end = buffer + length;
+		if (line_end == line) continue; // blank line
+		*line_end = '\0';
+		arguments[num_arguments++] = line;
+	}
+	*out_buffer = buffer;
+	*out_arguments = arguments;
+	return num_arguments;
+}
+
+// the template's argv with every {} replaced by argument, or argument appended if there is no {}
+void BuildParallelCommand(char* template_tokens[], int num_template_tokens, char* argument,
+	struct Command* command) {
+	bool has_placeholder = false;
+	int i;
+
+	command->argv = (char**)ArenaAlloc(&g_command_arena, (num_template_tokens + 2) * sizeof(char*));
+	for (i = 0; i < num_template_tokens; i++) {
+		if (strstr(template_tokens[i], "{}") != NULL) {
+			command->argv[i] = ReplaceString(template_tokens[i], "{}", argument);
+			has_placeholder = true;
+		} else {
+			command->argv[i] = template_tokens[i];
+		}
+	}
+	command->num_tokens = num_template_tokens;
+	command->num_assignments = 0;
+	if (!has_placeholder) {
+		command->argv[command->num_tokens++] = argument;
+	}
+	command->argv[command->num_tokens] = NULL;
+	command->num_redirections = 0;
+	command->num_fd_actions = 0;
+}
+
+// Start one task with its stdout and stderr going to fresh memfds.
+// fd 2 is swapped only for the launch, saved_stderr_fd holds the shell's own
+void LaunchParallelTask(int index, struct Command* command, int saved_stderr_fd) {
+	struct ParallelTask* task = &g_parallel_tasks[index];
+	struct epoll_event event = {0};
+
+	task->stdout_fd = memfd_create("parallel-stdout", MFD_CLOEXEC);
+	task->stderr_fd = memfd_create("parallel-stderr", MFD_CLOEXEC);
+	if (task->stderr_fd != -1) dup2(task->stderr_fd, STDERR_FILENO);
+	if (g_spawn_backend == SPAWN_BACKEND_FORK) {
+		task->pid = ForkAndExecute(command, STDIN_FILENO,
+			task->stdout_fd == -1 ? STDOUT_FILENO : task->stdout_fd, KEEP_SHELL_PGROUP, NULL);
+	} else {
+		task->pid = SpawnAndExecute(command, STDIN_FILENO,
+			task->stdout_fd == -1 ? STDOUT_FILENO : task->stdout_fd, KEEP_SHELL_PGROUP);
+	}
+	if (task->stderr_fd != -1) dup2(saved_stderr_fd, STDERR_FILENO);
+
+	task->is_done = false;
+	task->pidfd = -1;
+	g_num_running_parallel_tasks++;
+	if (task->pid == -1) {
+		FinishParallelTask(index, EXECUTE_FAILED_ERROR_CODE << 8);
+		return;
+	}
+	task->pidfd = OpenPidfd(task->pid);
+	if (task->pidfd != -1) {
+		event.events = EPOLLIN;
+		event.data.u64 = MakeEventData(EVENT_PARALLEL_TASK, (uint64_t)index);
+		epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, task->pidfd, &event);
+	}
+}
+
+// Copy a task's held output to to_fd in one go and release the memfd
+void FlushParallelOutput(int* from_fd, int to_fd) {
+	char buffer[4096];
+	off_t offset = 0;
+	off_t size;
+	ssize_t num_copied;
+
+	if (*from_fd == -1) return;
+	size = lseek(*from_fd, 0, SEEK_END);
+	while (offset < size) {
+		num_copied = sendfile(to_fd, *from_fd, &offset, size - offset);
+		if (num_copied > 0) continue;
+		if (num_copied == -1 && errno == EINTR) continue;
+		if (num_copied == -1 && (errno == EINVAL || errno == ENOSYS)) {
+			// the destination does not take sendfile
+			num_copied = pread(*from_fd, buffer, sizeof(buffer), offset);
+			if (num_copied > 0 && write(to_fd, buffer, num_copied) == num_copied) {
+				offset += num_copied;
+				continue;
+			}
+		}
+		break;
+	}
+	close(*from_fd);
+	*from_fd = -1;
+}
+
+// parallel [-j N] [-k] command [args with {}] [::: arguments]
+// Runs command once per argument, at most N at a time (the number of CPUs by default).
+// Without ::: the arguments are the lines of stdin, which may be redirected. Each task's
+// stdout and stderr are printed as a whole when it finishes, in argument order with -k.
+// The status is the number of failed tasks
+int RunParallelBuiltin(struct Command* command) {
+	char** tokens = command->argv;
+	int num_tokens = command->num_tokens;
+	long max_running = sysconf(_SC_NPROCESSORS_ONLN);
+	bool keep_order = false;
+	int template_start;
+	int num_template_tokens;
+	char** arguments = NULL;
+	int num_arguments = 0;
+	char* argument_buffer = NULL;
+	int saved_stderr_fd;
+	struct Command task_command;
+	int num_launched = 0;
+	int num_printed = 0;
+	int num_failed = 0;
+	struct JobUsage usage = {0};
+	uint64_t start_ns = MonotonicNs();
+	int index;
+	int i;
+
+	for (i = 1; i < num_tokens && tokens[i][0] == '-'; i++) {
+		if (strcmp(tokens[i], "-k") == 0) {
+			keep_order = true;
+		} else if (strcmp(tokens[i], "-j") == 0 && i + 1 < num_tokens && atoi(tokens[i+1]) > 0) {
+			max_running = atoi(tokens[++i]);
+		} else {
+			fprintf(stderr, "usage: parallel [-j N] [-k] command [args] [::: arguments]\n");
+			return 2;
+		}
+	}
+	if (max_running < 1) max_running = 1;
+	template_start = i;
+	for (num_template_tokens = 0; template_start + num_template_tokens < num_tokens; num_template_tokens++) {
+		if (strcmp(tokens[template_start + num_template_tokens], ":::") == 0) break;
+	}
+	if (num_template_tokens == 0) {
+		fprintf(stderr, "parallel: no command\n");
+		return 2;
+	}
+
+	if (template_start + num_template_tokens < num_tokens) {
+		arguments = tokens + template_start + num_template_tokens + 1;
+		num_arguments = num_tokens - (template_start + num_template_tokens + 1);
+	} else {
+		// RunBuiltin has already pointed stdin at a "<" or here-doc
+		bool is_shell_input = true;
+		for (i = 0; i < command->num_fd_actions; i++) {
+			if (command->fd_actions[i].to_fd == STDIN_FILENO) is_shell_input = false;
+		}
+		num_arguments = ReadParallelArguments(is_shell_input, &argument_buffer, &arguments);
+	}
+
+	fflush(stdout);
+	g_parallel_tasks = (struct ParallelTask*)calloc(num_arguments, sizeof(struct ParallelTask));
+	g_num_parallel_tasks = num_arguments;
+	g_parallel_completion_order = (int*)calloc(num_arguments, sizeof(int));
+	g_num_running_parallel_tasks = 0;
+	g_num_completed_parallel_tasks = 0;
+	saved_stderr_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+	g_signal_caught = false;
+	SetInputWatched(false);
+
+	while (num_printed < num_launched || (num_launched < num_arguments && !g_signal_caught)) {
+		// refill free slots; -k also bounds how far ahead of the oldest unprinted task it runs
+		while (num_launched < num_arguments && !g_signal_caught
+			&& g_num_running_parallel_tasks < max_running
+			&& (!keep_order || num_launched - num_printed < max_running + PARALLEL_MAX_HELD_TASKS)) {
+			BuildParallelCommand(tokens + template_start, num_template_tokens, arguments[num_launched],
+				&task_command);
+			LaunchParallelTask(num_launched, &task_command, saved_stderr_fd);
+			num_launched++;
+		}
+
+		// print whatever may be printed
+		while (num_printed < g_num_completed_parallel_tasks) {
+			index = keep_order ? num_printed : g_parallel_completion_order[num_printed];
+			if (!g_parallel_tasks[index].is_done) break;
+			FlushParallelOutput(&g_parallel_tasks[index].stdout_fd, STDOUT_FILENO);
+			FlushParallelOutput(&g_parallel_tasks[index].stderr_fd, STDERR_FILENO);
+			if (!WIFEXITED(g_parallel_tasks[index].wait_status)
+				|| WEXITSTATUS(g_parallel_tasks[index].wait_status) != 0) {
+				num_failed++;
+			}
+			AddUsage(&usage, &g_parallel_tasks[index].usage);
+			num_printed++;
+		}
+		if (num_printed == num_launched && (num_launched == num_arguments || g_signal_caught)) break;
+		if (g_num_running_parallel_tasks == 0) continue;
+
+		// tasks without a pidfd are polled
+		for (i = num_printed; i < num_launched; i++) {
+			if (g_parallel_tasks[i].pidfd == -1 && !g_parallel_tasks[i].is_done) {
+				ReapParallelTask(i);
+			}
+		}
+		HandleEvents(-1); // SIGCHLD wakes it for those
+	}
+
+	SetInputWatched(true);
+	close(saved_stderr_fd);
+	free(g_parallel_tasks);
+	free(g_parallel_completion_order);
+	free(argument_buffer);
+	g_parallel_tasks = NULL;
+	g_parallel_completion_order = NULL;
+
+	g_last_exit_code = num_failed < PARALLEL_MAX_EXIT_CODE ? num_failed : PARALLEL_MAX_EXIT_CODE;
+	g_was_terminated = false;
+	g_last_parallel_num_tasks = num_launched;
+	g_last_parallel_num_failed = num_failed;
+	usage.wall_ns = MonotonicNs() - start_ns;
+	AddSubstitutionUsage(&usage);
+	g_last_job_usage = usage;
+	g_has_last_job_usage = true;
+	return g_last_exit_code;
+}
+
+bool IsEmptyCommand(int num_tokens) {
+	if (num_tokens == 0) { // blank line or only a comment
+		return true;
+	}
+	return false;
+}
+
+void SetWorkingDirectory(char path[]) {
+	memset(g_working_directory, '\0', sizeof(g_working_directory));
+	strcpy(g_working_directory, path);
+}
+
+bool HasNoArgument(int num_tokens) {
+	if (num_tokens == 2) {
+		return true;	
+	}
+	return false;
+}
+
+bool IsValidCDCommand(char* command_tokens[], int num_tokens) {
+	if (num_tokens != 1 && num_tokens != 2) {
+		fprintf(stderr, "wrong number of arguments.\nCommand: ");
+		PrintTokens(stderr, command_tokens, num_tokens);
+		fprintf(stderr, "is not a valid CD command\n");
+		return false;
+	}
+	return true;
+}
+
+// side effect: this will change current_working_dir
+void GetCurrentWorkingDir(char current_working_dir[]) {
+	char* getcwd_result;
+	//getcwd_result = getcwd(current_working_dir, sizeof(current_working_dir));
+	getcwd_result = getcwd(current_working_dir, PATH_MAX-1);
+	if ( getcwd_result == NULL ) {
+		perror("getcwd() error\n");	
+		perror("Working Directory unchanged\n");
+		return;
+	} 
+}
+
+// using cwd()
+void PrintCurrentWorkingDir() {
+	char current_working_dir[PATH_MAX-1];
+	memset(current_working_dir, '\0', PATH_MAX-1);
+	GetCurrentWorkingDir(current_working_dir);
+	fprintf(stdout, "Current working directory: %s\n", current_working_dir);
+}
+
+// using chdir()
+void PrintChDirError() {
+	perror("chdir() error\n");
+	int error_code = errno; // errno is from <linux/limits.h>
+	if (error_code == EACCES) perror("Search permission was denied\n");
+	if (error_code == EFAULT) perror("new dir points outside your accessible address space\n");
+	if (error_code == EIO) perror("An I/O error occurred\n");
+	if (error_code == ELOOP) perror("Too many symbolic links were encountered in resolving new dir\n");
+	if (error_code == ENOENT) perror("The new dir does not exist\n");
+	if (error_code == ENOMEM) perror ("In sufficient kernel memory\n");
+	if (error_code == ENOTDIR) perror("A component of new dir is not a directory\n");		
+}
+
+void ChangeDirToHome(char new_working_dir[]) {
+	char* home_dir = NULL;
+	home_dir = LookupVariable("HOME");
+	if (home_dir == NULL || strlen(home_dir) >= PATH_MAX - 1) {
+		fprintf(stderr, "cd: %s\n", home_dir == NULL ? "HOME not set" : "HOME too long");
+		return;
+	}
+	strcpy(new_working_dir, home_dir);
+	int change_result;	
+	change_result = chdir(new_working_dir);
+	if (change_result != 0) {
+		PrintChDirError();	
+	}	
+}
+
+
+void SetCurrentWorkingDir(char* command_tokens[], int num_tokens) {
+	char current_working_dir[PATH_MAX-1];
+	memset(current_working_dir, '\0', PATH_MAX-1);
+	char new_working_dir[PATH_MAX-1];
+	memset(new_working_dir, '\0', PATH_MAX-1);
+	char targeted_dir[PATH_MAX-1];
+	memset(targeted_dir, '\0', PATH_MAX-1);
+
+	// if no arg supplied, change dir to $HOME
+	if (num_tokens == 1) {
+		ChangeDirToHome(new_working_dir);
+		return;
+	}
+	strcpy(targeted_dir, command_tokens[1]);
+
+	// if it's absolute path, put it right on
+	if (targeted_dir[0] == '/') {
+		strcpy(new_working_dir, targeted_dir);
+	// if it's relative path, concat it with current dir
+	} else {
+		GetCurrentWorkingDir(current_working_dir);	
+		sprintf(new_working_dir, "%s/%s", current_working_dir, targeted_dir);
+	}
+	
+	int change_dir_result;	
+	change_dir_result = chdir(new_working_dir);
+	if (change_dir_result != 0) {
+		PrintChDirError();
+	}
+}
+
+
+// History //
+
+// Bit of a block's filter for a trigram, the low 24 bits of trigram with the characters
+// read so far shifted in
+unsigned int HistoryFilterBit(uint32_t trigram) {
+	return (((trigram & 0xffffff) * 2654435761u) >> 16) % HISTORY_FILTER_BITS;
+}
+
+void SetHistoryFilterBit(uint64_t* filter, uint32_t trigram) {
+	unsigned int bit = HistoryFilterBit(trigram);
+	filter[bit / 64] |= 1ull << (bit % 64);
+}
+
+// The line at offset of the history file gets the next entry. Its trigrams go into the filter
+// of its block, the one it starts with also as "\n" and its first two characters so prefixes
+// have one to look for. Text too short for a trigram has its first character as "\n" and it,
+// and every character on its own
+void AddHistoryEntry(size_t offset, size_t length) {
+	const char* text = g_history_mapping + offset;
+	uint64_t* filter;
+	uint32_t trigram;
+	size_t i;
+
+	if (g_num_history_entries == g_history_capacity) {
+		g_history_capacity = g_history_capacity == 0 ? 1024 : g_history_capacity * 2;
+		g_history_entries = (struct HistoryEntry*)realloc(g_history_entries,
+			g_history_capacity * sizeof(struct HistoryEntry));
+		g_history_filters = (uint64_t*)realloc(g_history_filters,
+			g_history_capacity / HISTORY_BLOCK_ENTRIES * HISTORY_FILTER_WORDS * sizeof(uint64_t));
+		if (g_history_entries == NULL || g_history_filters == NULL) {
+			perror("realloc()");
+			exit(1);
+		}
+	}
+	filter = g_history_filters + g_num_history_entries / HISTORY_BLOCK_ENTRIES * HISTORY_FILTER_WORDS;
+	if (g_num_history_entries % HISTORY_BLOCK_ENTRIES == 0) {
+		memset(filter, 0, HISTORY_FILTER_WORDS * sizeof(uint64_t));
+	}
+	g_history_entries[g_num_history_entries].offset = offset;
+	g_history_entries[g_num_history_entries++].length = length;
+	trigram = '\n' << 8 | (unsigned char)text[0];
+	SetHistoryFilterBit(filter, trigram);
+	SetHistoryFilterBit(filter, (unsigned char)text[0]);
+	for (i = 1; i < length; i++) {
+		trigram = trigram << 8 | (unsigned char)text[i];
+		SetHistoryFilterBit(filter, trigram);
+		SetHistoryFilterBit(filter, (unsigned char)text[i]);
+	}
+}
+
+// Map the first length bytes of the history file, moving the mapping there is already
+void MapHistory(size_t length) {
+	void* mapping;
+
+	if (length == g_history_mapping_length) return;
+	if (length == 0) {
+		munmap(g_history_mapping, g_history_mapping_length);
+		g_history_mapping = NULL;
+		g_history_mapping_length = 0;
+		return;
+	}
+	if (g_history_mapping == NULL) {
+		mapping = mmap(NULL, length, PROT_READ, MAP_SHARED, g_history_fd, 0);
+	} else {
+		mapping = mremap(g_history_mapping, g_history_mapping_length, length, MREMAP_MAYMOVE);
+	}
+	if (mapping == MAP_FAILED) return;
+	g_history_mapping = (char*)mapping;
+	g_history_mapping_length = length;
+}
+
+// TINYSH_HISTFILE, ~/.tinysh_history by default, mapped as it is. Nothing is read at startup,
+// the entries are cut out of it while the shell waits for the first line, see WaitForInput,
+// so a long one costs nothing there.
+// Only an interactive shell keeps history, without a terminal only when TINYSH_HISTFILE says
+// where; TINYSH_HISTFILE= turns it off
+void SetupHistory(void) {
+	const char* path = getenv("TINYSH_HISTFILE");
+	const char* home = LookupVariable("HOME");
+	char default_path[PATH_MAX];
+	struct stat file_info;
+	char last;
+
+	if (!g_is_interactive) return;
+	if (path == NULL) {
+		if (g_terminal_fd == -1 || home == NULL) return;
+		snprintf(default_path, sizeof(default_path), "%s/.tinysh_history", home);
+		path = default_path;
+	}
+	if (path[0] == '\0') return;
+	g_history_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (g_history_fd == -1) {
+		fprintf(stderr, "tinysh: history %s: %s\n", path, strerror(errno));
+		return;
+	}
+	if (fstat(g_history_fd, &file_info) == 0 && file_info.st_size > 0) {
+		// a last line cut short must not run into the first one written now
+		if (pread(g_history_fd, &last, 1, file_info.st_size - 1) == 1 && last != '\n') {
+			WriteAll(g_history_fd, "\n", 1);
+			file_info.st_size++;
+		}
+		MapHistory(file_info.st_size);
+	}
+}
+
+// Cut about max_bytes more of the history file into entries, lines written since by this
+// shell or another one included. The file is looked at first: one that got shorter, or no
+// longer has a line end where the entries stop, was rewritten and is indexed over from the
+// start, an entry is never read past the end of the file. A line without its '\n' is still
+// being written and waits. Returns true once all of the file is in the entries
+bool IndexHistory(size_t max_bytes) {
+	struct stat file_info;
+	const char* line;
+	const char* line_end;
+	const char* end;
+	bool is_done = true;
+
+	if (g_history_fd == -1 || fstat(g_history_fd, &file_info) == -1) return true;
+	if ((size_t)file_info.st_size < g_history_indexed_length) {
+		g_num_history_entries = 0;
+		g_history_indexed_length = 0;
+	}
+	MapHistory(file_info.st_size);
+	if (g_history_indexed_length > g_history_mapping_length
+		|| (g_history_indexed_length > 0 && g_history_mapping[g_history_indexed_length - 1] != '\n')) {
+		g_num_history_entries = 0;
+		g_history_indexed_length = 0;
+	}
+	if (g_history_mapping == NULL) return true;
+	if (g_history_indexed_length == 0) madvise(g_history_mapping, g_history_mapping_length, MADV_WILLNEED);
+	end = g_history_mapping + g_history_mapping_length;
+	line = g_history_mapping + g_history_indexed_length;
+	while (line < end) {
+		if ((size_t)(line - g_history_mapping) - g_history_indexed_length >= max_bytes) {
+			is_done = false;
+			break;
+		}
+		line_end = (const char*)memchr(line, '\n', end - line);
+		if (line_end == NULL) break;
+		if (line_end > line) AddHistoryEntry(line - g_history_mapping, line_end - line);
+		line = line_end + 1;
+	}
+	g_history_indexed_length = line - g_history_mapping;
+	return is_done;
+}
+
+// The newest entry before the one numbered before that starts with text, with is_prefix,
+// or has it anywhere. A block whose filter lacks one of the text's trigrams is passed over
+// without looking at its entries; text too short for one is looked for by its characters.
+// Returns -1 when there is none
+int FindHistory(const char* text, size_t length, bool is_prefix, int before) {
+	const struct HistoryEntry* entry;
+	const uint64_t* filter;
+	unsigned int bits[16];
+	uint32_t trigram = is_prefix ? '\n' : 0;
+	int num_bits = 0;
+	int block;
+	int index;
+	size_t i;
+
+	if (before <= 0) return -1;
+	for (i = 0; i < length && num_bits < (int)(sizeof(bits) / sizeof(bits[0])); i++) {
+		trigram = trigram << 8 | (unsigned char)text[i];
+		if (!is_prefix && length < 3) {
+			bits[num_bits++] = HistoryFilterBit((unsigned char)text[i]);
+		} else if (i >= (is_prefix ? 0u : 2u)) {
+			bits[num_bits++] = HistoryFilterBit(trigram);
+		}
+	}
+	for (block = (before - 1) / HISTORY_BLOCK_ENTRIES; block >= 0; block--) {
+		filter = g_history_filters + block * HISTORY_FILTER_WORDS;
+		for (i = 0; i < (size_t)num_bits && (filter[bits[i] / 64] >> (bits[i] % 64) & 1) != 0; i++) {}
+		if (i < (size_t)num_bits) continue;
+		index = (block + 1) * HISTORY_BLOCK_ENTRIES < before ? (block + 1) * HISTORY_BLOCK_ENTRIES : before;
+		for (index--; index >= block * HISTORY_BLOCK_ENTRIES; index--) {
+			entry = &g_history_entries[index];
+			if (is_prefix ? entry->length >= length && memcmp(g_history_mapping + entry->offset, text, length) == 0
+				: memmem(g_history_mapping + entry->offset, entry->length, text, length) != NULL) {
+				return index;
+			}
+		}
+	}
+	return -1;
+}
+
+// A line typed at the prompt goes to the end of the history file right away, in one write
+// so it cannot be mixed up with another shell's. It becomes an entry the next time the
+// history is indexed. Blank lines are left out
+void AddHistory(const char* line) {
+	size_t length = strlen(line);
+	char* copy;
+
+	if (g_history_fd == -1 || line[strspn(line, " \t\r")] == '\0') return;
+	copy = (char*)malloc(length + 1);
+	if (copy == NULL) {
+		perror("malloc()");
+		exit(1);
+	}
+	memcpy(copy, line, length);
+	copy[length] = '\n';
+	WriteAll(g_history_fd, copy, length + 1);
+	free(copy);
+	g_is_history_indexed = false;
+}
+
+// !! or !prefix in front of a line typed at the prompt: the last entry, or the newest one
+// starting with prefix, takes its place. The line that runs is shown first, as other shells
+// do. Returns NULL when no entry matches
+char* ExpandHistory(char* line) {
+	const struct HistoryEntry* entry;
+	struct ArenaString expanded;
+	char* start = line;
+	char* end;
+	int index;
+
+	if (g_history_fd == -1) return line;
+	while (IsBlank(*start)) start++;
+	if (start[0] != '!' || start[1] == '\0' || IsBlank(start[1]) || start[1] == '=' || start[1] == '(') {
+		return line;
+	}
+	for (end = start + 1; *end != '\0' && !IsBlank(*end) && !IsOperatorChar(*end); end++) {}
+	g_is_history_indexed = IndexHistory(SIZE_MAX);
+	if (start[1] == '!' && end == start + 2) {
+		index = g_num_history_entries - 1;
+	} else {
+		index = FindHistory(start + 1, end - start - 1, true, g_num_history_entries);
+	}
+	if (index < 0) {
+		fprintf(stderr, "tinysh: %.*s: event not found\n", (int)(end - start), start);
+		return NULL;
+	}
+	entry = &g_history_entries[index];
+	ArenaStringInit(&g_command_arena, &expanded, strlen(line) + entry->length);
+	ArenaStringAppend(&g_command_arena, &expanded, line, start - line);
+	ArenaStringAppend(&g_command_arena, &expanded, g_history_mapping + entry->offset, entry->length);
+	ArenaStringAppend(&g_command_arena, &expanded, end, strlen(end));
+	puts(ArenaStringFinish(&expanded));
+	return expanded.data;
+}
+
+// Builtins //
+
+// Builtins run inside the shell, no fork. The utilities among them (echo, test...)
+// also exist as programs, that is what a background or pipeline stage still runs
+struct Builtin {
+	const char* name;
+	int (*run)(struct Command* command);
+	bool sets_status; // its result becomes the last status like a program's exit code
+	bool has_program; // "&" runs the program instead, it cannot run in the background in-process
+};
+
+int RunExitBuiltin(struct Command* command) {
+	// exit [n], without n the shell passes on the last status
+	exit(command->num_tokens > 1 ? atoi(command->argv[1]) & 0xff : LastStatusCode());
+}
+
+int RunCdBuiltin(struct Command* command) {
+	PrintCurrentWorkingDir();
+	if (!IsValidCDCommand(command->argv, command->num_tokens)) return 1;
+	SetCurrentWorkingDir(command->argv, command->num_tokens);
+	PrintCurrentWorkingDir();
+	return 0;
+}
+
+// status [-v]
+int RunStatusBuiltin(struct Command* command) {
+	PrintLastStatus();
+	if (command->num_tokens > 1 && strcmp(command->argv[1], "-v") == 0) {
+		PrintLastJobUsage();
+	}
+	return 0;
+}
+
+int RunHashCommand(struct Command* command) {
+	return RunHashBuiltin(command->argv, command->num_tokens);
+}
+
+int RunJobsCommand(struct Command* command) {
+	return RunJobsBuiltin();
+}
+
+int RunFgCommand(struct Command* command) {
+	return RunFgBuiltin(command->argv, command->num_tokens);
+}
+
+int RunBgCommand(struct Command* command) {
+	return RunBgBuiltin(command->argv, command->num_tokens);
+}
+
+int RunWaitCommand(struct Command* command) {
+	return RunWaitBuiltin(command->argv, command->num_tokens);
+}
+
+int RunTrueBuiltin(struct Command* command) {
+	return 0;
+}
+
+int RunFalseBuiltin(struct Command* command) {
+	return 1;
+}
+
+// echo [-n] args
+int RunEchoBuiltin(struct Command* command) {
+	bool print_newline = true;
+	int i = 1;
+
+	while (i < command->num_tokens && strcmp(command->argv[i], "-n") == 0) {
+		print_newline = false;
+		i++;
+	}
+	for (; i < command->num_tokens; i++) {
+		fputs(command->argv[i], stdout);
+		if (i < command->num_tokens - 1) putchar(' ');
+	}
+	if (print_newline) putchar('\n');
+	return 0;
+}
+
+// pin CPUS: the affinity of the shell and so of every job it launches from then on.
+// pin alone prints it. With a command after the list, pin is a prefix, see ParseJobSettings
+int RunPinBuiltin(struct Command* command) {
+	cpu_set_t set;
+	char list[8192];
+
+	if (command->num_tokens > 1) {
+		return SetShellAffinity(command->argv[1]) ? 0 : 1;
+	}
+	if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+		perror("pin");
+		return 1;
+	}
+	FormatCpuList(&set, list, sizeof(list));
+	puts(list);
+	return 0;
+}
+
+int RunPwdBuiltin(struct Command* command) {
+	char current_working_dir[PATH_MAX];
+
+	if (getcwd(current_working_dir, sizeof(current_working_dir)) == NULL) {
+		perror("pwd");
+		return 1;
+	}
+	puts(current_working_dir);
+	return 0;
+}
+
+int CompareVariableNames(const void* a, const void* b) {
+	const struct Variable* left = *(const struct Variable* const*)a;
+	const struct Variable* right = *(const struct Variable* const*)b;
+	size_t length = left->name_length < right->name_length ? left->name_length : right->name_length;
+	int result = memcmp(left->name, right->name, length);
+
+	if (result != 0) return result;
+	return left->name_length < right->name_length ? -1 : left->name_length > right->name_length;
+}
+
+// export lists the exported variables, sorted, in a form that can be read back
+void PrintExportedVariables(void) {
+	struct Variable** sorted = (struct Variable**)ArenaAlloc(&g_command_arena,
+		(g_num_exported_variables + 1) * sizeof(struct Variable*));
+	struct Variable* variable;
+	const char* p;
+	int num_sorted = 0;
+	int i;
+
+	for (i = 0; i < VARIABLE_BUCKETS; i++) {
+		for (variable = g_variables[i]; variable != NULL; variable = variable->next) {
+			if (variable->is_exported) sorted[num_sorted++] = variable;
+		}
+	}
+	qsort(sorted, num_sorted, sizeof(struct Variable*), CompareVariableNames);
+	for (i = 0; i < num_sorted; i++) {
+		printf("export %.*s='", (int)sorted[i]->name_length, sorted[i]->name);
+		for (p = sorted[i]->value; *p != '\0'; p++) {
+			if (*p == '\'') {
+				fputs("'\\''", stdout);
+			} else {
+				putchar(*p);
+			}
+		}
+		puts("'");
+	}
+}
+
+// The length of the NAME in argument, which export may follow with =value.
+// Returns false after reporting an argument that is no NAME
+bool ParseVariableName(const char* builtin_name, const char* argument, bool allows_value, size_t* name_length) {
+	size_t i = 0;
+
+	if (IsNameStart(argument[0])) {
+		for (i = 1; IsNameChar(argument[i]); i++) {}
+	}
+	if (i == 0 || !(argument[i] == '\0' || (allows_value && argument[i] == '='))) {
+		fprintf(stderr, "%s: '%s': not a valid identifier\n", builtin_name, argument);
+		return false;
+	}
+	*name_length = i;
+	return true;
+}
+
+// export NAME[=value]...: programs get the variables from now on, an unset NAME is exported empty.
+// export alone lists them
+int RunExportBuiltin(struct Command* command) {
+	struct Variable* variable;
+	size_t name_length;
+	const char* argument;
+	int result = 0;
+	int i;
+
+	if (command->num_tokens == 1) {
+		PrintExportedVariables();
+		return 0;
+	}
+	for (i = 1; i < command->num_tokens; i++) {
+		argument = command->argv[i];
+		if (!ParseVariableName("export", argument, true, &name_length)) {
+			result = 1;
+			continue;
+		}
+		if (argument[name_length] == '=') {
+			variable = SetVariable(argument, name_length, argument + name_length + 1,
+				strlen(argument + name_length + 1));
+		} else {
+			variable = FindVariable(argument, name_length);
+			if (variable == NULL) variable = SetVariable(argument, name_length, "", 0);
+		}
+		ExportVariable(variable, true);
+	}
+	return result;
+}
+
+// unset NAME...
+int RunUnsetBuiltin(struct Command* command) {
+	size_t name_length;
+	int result = 0;
+	int i;
+
+	for (i = 1; i < command->num_tokens; i++) {
+		if (!ParseVariableName("unset", command->argv[i], false, &name_length)) {
+			result = 1;
+			continue;
+		}
+		UnsetVariable(command->argv[i], name_length);
+	}
+	return result;
+}
+
+void PrintHistoryEntry(int index) {
+	printf("%5d  %.*s\n", index + 1, (int)g_history_entries[index].length,
+		g_history_mapping + g_history_entries[index].offset);
+}
+
+// history [N]: the last N entries, all of them without N, numbered from 1 for the oldest.
+// history -s TEXT [N]: the last N that have TEXT in them, newest first.
+// history -p PREFIX [N]: the same for the ones starting with PREFIX, what !PREFIX would run
+int RunHistoryBuiltin(struct Command* command) {
+	bool is_search = command->num_tokens >= 2
+		&& (strcmp(command->argv[1], "-s") == 0 || strcmp(command->argv[1], "-p") == 0);
+	int count_index = is_search ? 3 : 1;
+	bool is_valid = command->num_tokens <= count_index + 1 && !(is_search && command->num_tokens < 3);
+	long long count = -1; // all
+	char* end;
+	int index;
+
+	if (is_valid && command->num_tokens == count_index + 1) {
+		count = strtoll(command->argv[count_index], &end, 10);
+		is_valid = end != command->argv[count_index] && *end == '\0' && count >= 0;
+	}
+	if (!is_valid) {
+		fprintf(stderr, "usage: history [N] | history -s text [N] | history -p prefix [N]\n");
+		return 2;
+	}
+	if (g_history_fd == -1) {
+		fprintf(stderr, "history: not kept, see TINYSH_HISTFILE\n");
+		return 1;
+	}
+	g_is_history_indexed = IndexHistory(SIZE_MAX);
+	if (!is_search) {
+		index = count >= 0 && count < g_num_history_entries ? g_num_history_entries - (int)count : 0;
+		for (; index < g_num_history_entries; index++) PrintHistoryEntry(index);
+		return 0;
+	}
+	index = g_num_history_entries;
+	while (count != 0 && (index = FindHistory(command->argv[2], strlen(command->argv[2]),
+		command->argv[1][1] == 'p', index)) >= 0) {
+		PrintHistoryEntry(index);
+		count--;
+	}
+	return 0;
+}
+
+// test //
+
+bool ParseTestInteger(const char* string, long long* value) {
+	char* end;
+
+	errno = 0;
+	*value = strtoll(string, &end, 10);
+	if (errno != 0 || end == string || *end != '\0') {
+		fprintf(stderr, "test: %s: integer expression expected\n", string);
+		return false;
+	}
+	return true;
+}
+
+// 1 true, 0 false, -1 not a unary operator
+int TestUnary(const char* op, const char* operand) {
+	struct stat file_info;
+
+	if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') return -1;
+	switch (op[1]) {
+	case 'n': return operand[0] != '\0';
+	case 'z': return operand[0] == '\0';
+	case 't': return isatty(atoi(operand));
+	case 'r': return access(operand, R_OK) == 0;
+	case 'w': return access(operand, W_OK) == 0;
+	case 'x': return access(operand, X_OK) == 0;
+	case 'h':
+	case 'L': return lstat(operand, &file_info) == 0 && S_ISLNK(file_info.st_mode);
+	case 'e': case 'f': case 'd': case 's': case 'p': case 'S': case 'b': case 'c':
+	case 'u': case 'g': case 'k':
+		break;
+	default:
+		return -1;
+	}
+	if (stat(operand, &file_info) != 0) return 0;
+	switch (op[1]) {
+	case 'e': return 1;
+	case 'f': return S_ISREG(file_info.st_mode);
+	case 'd': return S_ISDIR(file_info.st_mode);
+	case 's': return file_info.st_size > 0;
+	case 'p': return S_ISFIFO(file_info.st_mode);
+	case 'S': return S_ISSOCK(file_info.st_mode);
+	case 'b': return S_ISBLK(file_info.st_mode);
+	case 'c': return S_ISCHR(file_info.st_mode);
+	case 'u': return (file_info.st_mode & S_ISUID) != 0;
+	case 'g': return (file_info.st_mode & S_ISGID) != 0;
+	default: return (file_info.st_mode & S_ISVTX) != 0;
+	}
+}
+
+// 1 true, 0 false, -1 not a binary operator, -2 bad operand
+int TestBinary(const char* left, const char* op, const char* right) {
+	static const char* integer_ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+	long long left_value;
+	long long right_value;
+	int i;
+
+	if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(left, right) == 0;
+	if (strcmp(op, "!=") == 0) return strcmp(left, right) != 0;
+	for (i = 0; i < 6; i++) {
+		if (strcmp(op, integer_ops[i]) == 0) break;
+	}
+	if (i == 6) return -1;
+	if (!ParseTestInteger(left, &left_value) || !ParseTestInteger(right, &right_value)) return -2;
+	switch (i) {
+	case 0: return left_value == right_value;
+	case 1: return left_value != right_value;
+	case 2: return left_value < right_value;
+	case 3: return left_value <= right_value;
+	case 4: return left_value > right_value;
+	default: return left_value >= right_value;
+	}
+}
+
+// POSIX test on args: 0 true, 1 false, 2 error. Decided by the number of arguments,
+// longer expressions are split at -o, then at -a
+int EvaluateTest(char* args[], int num_args) {
+	int result;
+	int i;
+
+	switch (num_args) {
+	case 0:
+		return 1;
+	case 1:
+		return args[0][0] == '\0';
+	case 2:
+		if (strcmp(args[0], "!") == 0) {
+			result = EvaluateTest(args + 1, 1);
+			return result == 2 ? 2 : !result;
+		}
+		result = TestUnary(args[0], args[1]);
+		if (result == -1) {
+			fprintf(stderr, "test: %s: unary operator expected\n", args[0]);
+			return 2;
+		}
+		return !result;
+	case 3:
+		result = TestBinary(args[0], args[1], args[2]);
+		if (result == -2) return 2;
+		if (result != -1) return !result;
+		if (strcmp(args[0], "!") == 0) {
+			result = EvaluateTest(args + 1, 2);
+			return result == 2 ? 2 : !result;
+		}
+		if (strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0) {
+			return EvaluateTest(args + 1, 1);
+		}
+		break;
+	case 4:
+		if (strcmp(args[0], "!") == 0) {
+			result = EvaluateTest(args + 1, 3);
+			return result == 2 ? 2 : !result;
+		}
+		if (strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0) {
+			return EvaluateTest(args + 1, 2);
+		}
+		break;
+	}
+	for (i = 1; i < num_args - 1; i++) {
+		if (strcmp(args[i], "-o") == 0) {
+			result = EvaluateTest(args, i);
+			if (result != 1) return result;
+			return EvaluateTest(args + i + 1, num_args - i - 1);
+		}
+	}
+	for (i = 1; i < num_args - 1; i++) {
+		if (strcmp(args[i], "-a") == 0) {
+			result = EvaluateTest(args, i);
+			if (result != 0) return result;
+			return EvaluateTest(args + i + 1, num_args - i - 1);
+		}
+	}
+	fprintf(stderr, "test: syntax error\n");
+	return 2;
+}
+
+// test expr, [ expr ]
+int RunTestBuiltin(struct Command* command) {
+	int num_args = command->num_tokens - 1;
+
+	if (strcmp(command->argv[0], "[") == 0) {
+		if (num_args == 0 || strcmp(command->argv[num_args], "]") != 0) {
+			fprintf(stderr, "[: missing ]\n");
+			return 2;
+		}
+		num_args--;
+	}
+	return EvaluateTest(command->argv + 1, num_args);
+}
+
+// printf //
+
+// Print the backslash escape at sequence[0] == '\\'. Returns the number of chars consumed.
+// in_argument: %b rules, octal needs a leading 0 and \c stops all output (*stop is set)
+int PrintEscape(const char* sequence, bool in_argument, bool* stop) {
+	const char* p = sequence + 1;
+	int value = 0;
+	int num_digits = 0;
+	int max_digits = 3;
+
+	switch (*p) {
+	case 'a': putchar('\a'); return 2;
+	case 'b': putchar('\b'); return 2;
+	case 'f': putchar('\f'); return 2;
+	case 'n': putchar('\n'); return 2;
+	case 'r': putchar('\r'); return 2;
+	case 't': putchar('\t'); return 2;
+	case 'v': putchar('\v'); return 2;
+	case '\\': putchar('\\'); return 2;
+	case 'c':
+		if (in_argument) {
+			*stop = true;
+			return 2;
+		}
+		break;
+	case '\0':
+		putchar('\\');
+		return 1;
+	}
+	if (*p >= '0' && *p <= '7') {
+		if (in_argument && *p == '0') {
+			p++; // \0NNN
+		}
+		while (num_digits < max_digits && *p >= '0' && *p <= '7') {
+			value = value * 8 + (*p++ - '0');
+			num_digits++;
+		}
+		putchar(value);
+		return (int)(p - sequence);
+	}
+	putchar('\\');
+	putchar(*p);
+	return 2;
+}
+
+// numeric printf argument; 'c and "c give the code of c
+bool ParsePrintfNumber(const char* string, bool is_signed, long long* signed_value,
+	unsigned long long* unsigned_value) {
+	char* end;
+
+	if (string[0] == '\'' || string[0] == '"') {
+		*signed_value = (unsigned char)string[1];
+		*unsigned_value = (unsigned char)string[1];
+		return true;
+	}
+	errno = 0;
+	if (is_signed) {
+		*signed_value = strtoll(string, &end, 0);
+	} else {
+		*unsigned_value = strtoull(string, &end, 0);
+	}
+	if (string[0] == '\0') return true; // missing argument is 0
+	if (errno != 0 || *end != '\0') {
+		fprintf(stderr, "printf: %s: invalid number\n", string);
+		return false;
+	}
+	return true;
+}
+
+// printf format [args]: the format is reused until every argument is consumed
+int RunPrintfBuiltin(struct Command* command) {
+	char** args = command->argv + 2;
+	int num_args = command->num_tokens - 2;
+	int next_arg = 0;
+	const char* format;
+	const char* p;
+	char spec[32];
+	size_t spec_length;
+	const char* arg;
+	long long signed_value = 0;
+	unsigned long long unsigned_value = 0;
+	bool stop = false;
+	int result = 0;
+
+	if (command->num_tokens < 2) {
+		fprintf(stderr, "usage: printf format [arguments]\n");
+		return 2;
+	}
+	format = command->argv[1];
+	do {
+		for (p = format; *p != '\0' && !stop; ) {
+			if (*p == '\\') {
+				p += PrintEscape(p, false, &stop);
+				continue;
+			}
+			if (*p != '%') {
+				putchar(*p++);
+				continue;
+			}
+			if (p[1] == '%') {
+				putchar('%');
+				p += 2;
+				continue;
+			}
+			// %[flags][width][.precision]conversion, * is not supported
+			spec_length = strspn(p + 1, "-+ #0123456789.") + 1;
+			if (p[spec_length] == '\0' || spec_length + 4 > sizeof(spec)) {
+				fprintf(stderr, "printf: %s: invalid conversion\n", p);
+				return 1;
+			}
+			memcpy(spec, p, spec_length);
+			arg = next_arg < num_args ? args[next_arg++] : "";
+			switch (p[spec_length]) {
+			case 's':
+				strcpy(spec + spec_length, "s");
+				printf(spec, arg);
+				break;
+			case 'b':
+				for (; *arg != '\0' && !stop; ) {
+					if (*arg == '\\') {
+						arg += PrintEscape(arg, true, &stop);
+					} else {
+						putchar(*arg++);
+					}
+				}
+				break;
+			case 'c':
+				strcpy(spec + spec_length, "c");
+				if (arg[0] != '\0') printf(spec, arg[0]);
+				break;
+			case 'd':
+			case 'i':
+				strcpy(spec + spec_length, "lld");
+				if (!ParsePrintfNumber(arg, true, &signed_value, &unsigned_value)) result = 1;
+				printf(spec, signed_value);
+				break;
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+				strcpy(spec + spec_length, "ll");
+				spec[spec_length + 2] = p[spec_length];
+				spec[spec_length + 3] = '\0';
+				if (!ParsePrintfNumber(arg, false, &signed_value, &unsigned_value)) result = 1;
+				printf(spec, unsigned_value);
+				break;
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'F':
+			case 'g':
+			case 'G':
+				spec[spec_length] = p[spec_length];
+				spec[spec_length + 1] = '\0';
+				printf(spec, strtod(arg, NULL));
+				break;
+			default:
+				fprintf(stderr, "printf: %%%c: invalid conversion\n", p[spec_length]);
+				return 1;
+			}
+			signed_value = 0;
+			unsigned_value = 0;
+			p += spec_length + 1;
+		}
+	} while (!stop && next_arg > 0 && next_arg < num_args);
+	return result;
+}
+
+int RunParallelCommand(struct Command* command) {
+	return RunParallelBuiltin(command);
+}
+
+struct Builtin g_builtins[] = {
+	// name       run                 sets_status  has_program
+	{"exit",      RunExitBuiltin,     false,       false},
+	{"cd",        RunCdBuiltin,       false,       false},
+	{"status",    RunStatusBuiltin,   false,       false},
+	{"hash",      RunHashCommand,     false,       false},
+	{"jobs",      RunJobsCommand,     false,       false},
+	{"fg",        RunFgCommand,       false,       false},
+	{"bg",        RunBgCommand,       false,       false},
+	{"wait",      RunWaitCommand,     true,        false},
+	{"parallel",  RunParallelCommand, false,       false},
+	{"echo",      RunEchoBuiltin,     true,        true},
+	{"true",      RunTrueBuiltin,     true,        true},
+	{"false",     RunFalseBuiltin,    true,        true},
+	{"test",      RunTestBuiltin,     true,        true},
+	{"[",         RunTestBuiltin,     true,        true},
+	{"printf",    RunPrintfBuiltin,   true,        true},
+	{"pwd",       RunPwdBuiltin,      true,        true},
+	{"pin",       RunPinBuiltin,      true,        false},
+	{"export",    RunExportBuiltin,   true,        false},
+	{"unset",     RunUnsetBuiltin,    true,        false},
+	{"history",   RunHistoryBuiltin,  true,        false},
+};
+
+// time //
+
+void PrintTimeLine(const char* label, uint64_t ns) {
+	fprintf(stderr, "%s\t%dm%.3fs\n", label, (int)(ns / 60000000000ull), (ns % 60000000000ull) / 1e9);
+}
+
+// After time pipeline: wall clock since start_ns, the CPU the shell itself used
+// (builtins run in-process) plus what the job's processes and $(...) children used, reaped through wait4
+void PrintTimeReport(uint64_t start_ns, const struct rusage* shell_usage_before) {
+	struct rusage shell_usage;
+	struct JobUsage usage = {0};
+
+	getrusage(RUSAGE_SELF, &shell_usage);
+	usage.user_ns = TimevalNs(shell_usage.ru_utime) - TimevalNs(shell_usage_before->ru_utime);
+	usage.sys_ns = TimevalNs(shell_usage.ru_stime) - TimevalNs(shell_usage_before->ru_stime);
+	usage.voluntary_switches = shell_usage.ru_nvcsw - shell_usage_before->ru_nvcsw;
+	usage.involuntary_switches = shell_usage.ru_nivcsw - shell_usage_before->ru_nivcsw;
+	if (g_has_last_job_usage) {
+		usage.user_ns += g_last_job_usage.user_ns;
+		usage.sys_ns += g_last_job_usage.sys_ns;
+		usage.max_rss_kb = g_last_job_usage.max_rss_kb;
+		usage.voluntary_switches += g_last_job_usage.voluntary_switches;
+		usage.involuntary_switches += g_last_job_usage.involuntary_switches;
+	} else {
+		// builtins only, but their $(...) children count
+		usage.max_rss_kb = shell_usage.ru_maxrss;
+		AddSubstitutionUsage(&usage);
+	}
+
+	fprintf(stderr, "\n");
+	PrintTimeLine("real", MonotonicNs() - start_ns);
+	PrintTimeLine("user", usage.user_ns);
+	PrintTimeLine("sys", usage.sys_ns);
+	fprintf(stderr, "maxrss\t%ld kB\n", usage.max_rss_kb);
+	fprintf(stderr, "csw\t%ld voluntary, %ld involuntary\n",
+		usage.voluntary_switches, usage.involuntary_switches);
+}
+
+struct Builtin* FindBuiltin(const char* name) {
+	size_t i;
+
+	for (i = 0; i < sizeof(g_builtins) / sizeof(g_builtins[0]); i++) {
+		if (strcmp(name, g_builtins[i].name) == 0) return &g_builtins[i];
+	}
+	return NULL;
+}
+
+// Undo RedirectShellFds in reverse order and close what it opened
+void RestoreShellFds(struct Command* command, int* saved_fds) {
+	int i;
+
+	fflush(stdout);
+	for (i = command->num_fd_actions - 1; i >= 0; i--) {
+		if (saved_fds[i] == -2) continue;
+		if (saved_fds[i] == -1) {
+			close(command->fd_actions[i].to_fd);
+		} else {
+			dup2(saved_fds[i], command->fd_actions[i].to_fd);
+			close(saved_fds[i]);
+		}
+	}
+	CloseRedirections(command);
+}
+
+// Point the shell's own fds where command's redirections say, for builtins and { } groups.
+// Each target is saved once in *out_saved_fds for RestoreShellFds. Returns false, with
+// nothing changed, if a file cannot be opened or an fd not be moved
+bool RedirectShellFds(struct Command* command, int** out_saved_fds) {
+	int* saved_fds = NULL;
+	int i;
+	int j;
+
+	fflush(stdout);
+	if (!OpenRedirections(command)) return false;
+	if (command->num_fd_actions > 0) {
+		saved_fds = (int*)ArenaAlloc(&g_command_arena, command->num_fd_actions * sizeof(int));
+	}
+	for (i = 0; i < command->num_fd_actions; i++) {
+		saved_fds[i] = -1; // target was closed, close it again afterwards
+		for (j = 0; j < i; j++) {
+			if (command->fd_actions[j].to_fd == command->fd_actions[i].to_fd) saved_fds[i] = -2;
+		}
+		if (saved_fds[i] == -1) {
+			saved_fds[i] = fcntl(command->fd_actions[i].to_fd, F_DUPFD_CLOEXEC, FIRST_PRIVATE_FD);
+		}
+	}
+	*out_saved_fds = saved_fds;
+	if (!ApplyFdActions(command)) {
+		fprintf(stderr, "%s: %s\n", command->num_tokens > 0 ? command->argv[0] : "redirection",
+			strerror(errno));
+		RestoreShellFds(command, saved_fds);
+		return false;
+	}
+	return true;
+}
+
+// NAME=value in front of a builtin holds for that builtin only: the variables are set and
+// exported, what they were goes into the command arena to be put back by RestoreVariables
+struct Variable* PushAssignments(struct Command* command) {
+	struct Variable* saved = (struct Variable*)ArenaAlloc(&g_command_arena,
+		command->num_assignments * sizeof(struct Variable));
+	struct Variable* variable;
+	char* equals;
+	int i;
+
+	for (i = 0; i < command->num_assignments; i++) {
+		equals = strchr(command->assignments[i], '=');
+		saved[i].name = command->assignments[i];
+		saved[i].name_length = equals - command->assignments[i];
+		variable = FindVariable(saved[i].name, saved[i].name_length);
+		saved[i].value = variable == NULL ? NULL
+			: ArenaStrndup(&g_command_arena, variable->value, strlen(variable->value));
+		saved[i].is_exported = variable != NULL && variable->is_exported;
+		ExportVariable(SetVariable(saved[i].name, saved[i].name_length, equals + 1, strlen(equals + 1)), true);
+	}
+	return saved;
+}
+
+void RestoreVariables(struct Variable* saved, int num_saved) {
+	int i;
+
+	for (i = num_saved - 1; i >= 0; i--) {
+		if (saved[i].value == NULL) {
+			UnsetVariable(saved[i].name, saved[i].name_length);
+		} else {
+			ExportVariable(SetVariable(saved[i].name, saved[i].name_length, saved[i].value,
+				strlen(saved[i].value)), saved[i].is_exported);
+		}
+	}
+}
+
+// Run a builtin in the shell process. Redirections are honored by pointing the shell's
+// own fds elsewhere for the duration of the call instead of forking
+void RunBuiltin(struct Builtin* builtin, struct Command* command) {
+	struct Variable* saved_variables = NULL;
+	int* saved_fds;
+	int result = 1;
+
+	if (command->num_assignments > 0) saved_variables = PushAssignments(command);
+	if (RedirectShellFds(command, &saved_fds)) {
+		result = builtin->run(command);
+		RestoreShellFds(command, saved_fds);
+	}
+	if (saved_variables != NULL) RestoreVariables(saved_variables, command->num_assignments);
+	if (builtin->sets_status) {
+		g_last_exit_code = result;
+		g_was_terminated = false;
+		g_last_parallel_num_tasks = 0;
+		g_last_timeout_stage = TIMEOUT_NOT_FIRED;
+	}
+}
+
+
+// timeout //
+
+// 1.5, 90s, 2m, 1h, 1d. Returns false if text is not a duration
+bool ParseDuration(const char* text, uint64_t* out_ns) {
+	char* end;
+	double seconds = strtod(text, &end);
+
+	if (end == text || !(seconds >= 0)) return false;
+	switch (*end) {
+	case '\0':
+	case 's': break;
+	case 'm': seconds *= 60; break;
+	case 'h': seconds *= 60 * 60; break;
+	case 'd': seconds *= 24 * 60 * 60; break;
+	default: return false;
+	}
+	if (*end != '\0' && end[1] != '\0') return false;
+	*out_ns = (uint64_t)(seconds * 1e9);
+	return true;
+}
+
+// timeout [-s SIG] [-k KILL_AFTER] DURATION pipeline: strip the prefix off command's argv
+// and fill timeout. The job itself then gets a timer, no helper process stands in between.
+// Returns false after reporting a usage error
+bool ParseTimeout(struct Command* command, struct JobTimeout* timeout) {
+	char** tokens = command->argv;
+	int i = 1;
+
+	timeout->signal = SIGTERM;
+	timeout->kill_after_ns = 0;
+	for (; tokens[i] != NULL && tokens[i][0] == '-' && tokens[i][1] != '\0'; i++) {
+		if (strcmp(tokens[i], "-s") == 0 && tokens[i+1] != NULL) {
+			timeout->signal = ParseSignal(tokens[++i]);
+			if (timeout->signal == -1) {
+				fprintf(stderr, "timeout: %s: invalid signal\n", tokens[i]);
+				return false;
+			}
+		} else if (strcmp(tokens[i], "-k") == 0 && tokens[i+1] != NULL) {
+			if (!ParseDuration(tokens[++i], &timeout->kill_after_ns)) {
+				fprintf(stderr, "timeout: %s: invalid duration\n", tokens[i]);
+				return false;
+			}
+		} else {
+			break;
+		}
+	}
+	if (tokens[i] == NULL || tokens[i+1] == NULL || !ParseDuration(tokens[i], &timeout->duration_ns)) {
+		fprintf(stderr, "usage: timeout [-s SIG] [-k KILL_AFTER] DURATION command\n");
+		return false;
+	}
+	command->argv += i + 1;
+	command->num_tokens -= i + 1;
+	return true;
+}
+
+// pin, nice, limit //
+
+// A prefix with a command after it: pin and nice alone are the builtin and the program
+bool IsJobSettingsPrefix(struct Command* command) {
+	char* name = command->argv[0];
+
+	return name != NULL && ((strcmp(name, "pin") == 0 && command->num_tokens > 2)
+		|| (strcmp(name, "nice") == 0 && command->num_tokens > 1) || strcmp(name, "limit") == 0);
+}
+
+// A number, or "unlimited". Returns false if text is neither
+bool ParseLimitValue(const char* text, rlim_t scale, rlim_t* value) {
+	char* end;
+	unsigned long long number;
+
+	if (strcmp(text, "unlimited") == 0) {
+		*value = RLIM_INFINITY;
+		return true;
+	}
+	if (*text < '0' || *text > '9') return false;
+	errno = 0;
+	number = strtoull(text, &end, 10);
+	if (errno != 0 || *end != '\0' || number > RLIM_INFINITY / scale) return false;
+	*value = (rlim_t)number * scale;
+	return true;
+}
+
+// pin CPUS, nice [-n N] or limit [-v KB] [-n FILES] [-t SECONDS] in front of a command: strip it
+// off command's argv into settings, several of them add up. Returns false after a usage error
+bool ParseJobSettings(struct Command* command, struct JobSettings* settings) {
+	char** tokens = command->argv;
+	const char* usage;
+	char* end;
+	int adjustment;
+	int resource;
+	rlim_t scale;
+	rlim_t value;
+	int i = 1;
+	int j;
+
+	if (strcmp(tokens[0], "pin") == 0) {
+		usage = "pin CPUS command";
+		if (!ParseCpuList(tokens[1], &settings->affinity)) {
+			fprintf(stderr, "pin: %s: invalid CPU list\n", tokens[1]);
+			return false;
+		}
+		settings->has_affinity = true;
+		i = 2;
+	} else if (strcmp(tokens[0], "nice") == 0) {
+		usage = "nice [-n N] command";
+		adjustment = DEFAULT_NICE_ADJUSTMENT;
+		if (strcmp(tokens[1], "-n") == 0) {
+			if (tokens[2] == NULL) {
+				fprintf(stderr, "usage: %s\n", usage);
+				return false;
+			}
+			adjustment = (int)strtol(tokens[2], &end, 10);
+			if (end == tokens[2] || *end != '\0') {
+				fprintf(stderr, "nice: %s: invalid adjustment\n", tokens[2]);
+				return false;
+			}
+			i = 3;
+		}
+		settings->nice += adjustment;
+	} else {
+		usage = "limit [-v KB] [-n FILES] [-t SECONDS] command";
+		for (; tokens[i] != NULL && tokens[i][0] == '-'; i += 2) {
+			if (strcmp(tokens[i], "-v") == 0) {
+				resource = RLIMIT_AS;
+				scale = 1024;
+			} else if (strcmp(tokens[i], "-n") == 0) {
+				resource = RLIMIT_NOFILE;
+				scale = 1;
+			} else if (strcmp(tokens[i], "-t") == 0) {
+				resource = RLIMIT_CPU;
+				scale = 1;
+			} else {
+				break;
+			}
+			if (tokens[i+1] == NULL) {
+				fprintf(stderr, "usage: %s\n", usage);
+				return false;
+			}
+			if (!ParseLimitValue(tokens[i+1], scale, &value)) {
+				fprintf(stderr, "limit: %s: invalid limit\n", tokens[i+1]);
+				return false;
+			}
+			// the same resource again replaces the earlier value
+			for (j = 0; j < settings->num_limits && settings->limits[j].resource != resource; j++) {}
+			if (j == settings->num_limits && settings->num_limits < MAX_JOB_LIMITS) settings->num_limits++;
+			settings->limits[j].resource = resource;
+			settings->limits[j].value = value;
+		}
+		if (tokens[i] != NULL && tokens[i][0] == '-') {
+			fprintf(stderr, "limit: %s: invalid option\n", tokens[i]);
+			return false;
+		}
+	}
+	if (tokens[i] == NULL) {
+		fprintf(stderr, "usage: %s\n", usage);
+		return false;
+	}
+	command->argv += i;
+	command->num_tokens -= i;
+	return true;
+}
+
+
+// Plan //
+
+// Recursive descent over the tokens of one line
+struct PlanCompiler {
+	struct Token* tokens;
+	int num_tokens;
+	int position;
+	int* heredocs_before; // [i]: here-docs among tokens[0..i-1]
+	bool is_incomplete; // the syntax error was running out of tokens, more lines may complete them
+};
+
+struct PlanNode* NewPlanNode(NodeType type, struct PlanNode* left, struct PlanNode* right) {
+	struct PlanNode* node = (struct PlanNode*)ArenaAlloc(&g_plan_arena, sizeof(struct PlanNode));
+
+	memset(node, 0, sizeof(*node));
+	node->type = type;
+	node->left = left;
+	node->right = right;
+	return node;
+}
+
+// the text tokens[start..end) were typed as
+void SetPlanNodeText(struct PlanCompiler* compiler, struct PlanNode* node, int start, int end) {
+	struct Token* last = &compiler->tokens[end - 1];
+
+	node->text = ArenaStrndup(&g_plan_arena, compiler->tokens[start].source,
+		last->source + last->source_length - compiler->tokens[start].source);
+}
+
+void SetPlanNodeTokens(struct PlanCompiler* compiler, struct PlanNode* node, int start, int end) {
+	node->tokens = &compiler->tokens[start];
+	node->num_tokens = end - start;
+	node->first_heredoc = compiler->heredocs_before[start];
+	SetPlanNodeText(compiler, node, start, end);
+}
+
+// { } for in while until do done are only special as an unquoted word of their own
+// where a command starts
+bool IsReservedWord(struct PlanCompiler* compiler, const char* word) {
+	struct Token* token = &compiler->tokens[compiler->position];
+
+	return compiler->position < compiler->num_tokens && token->type == TOKEN_WORD
+		&& token->source_length == (int)strlen(word) && strcmp(token->text, word) == 0;
+}
+
+bool IsListEnd(struct PlanCompiler* compiler) {
+	return compiler->position == compiler->num_tokens
+		|| compiler->tokens[compiler->position].type == TOKEN_RPAREN || IsReservedWord(compiler, "}")
+		|| IsReservedWord(compiler, "do") || IsReservedWord(compiler, "done");
+}
+
+void SkipNewlines(struct PlanCompiler* compiler) {
+	while (compiler->position < compiler->num_tokens
+		&& compiler->tokens[compiler->position].type == TOKEN_NEWLINE) {
+		compiler->position++;
+	}
+}
+
+// Nothing is printed when the tokens ran out, the caller may read another line and try again
+void PrintSyntaxError(struct PlanCompiler* compiler) {
+	if (compiler->position == compiler->num_tokens) {
+		compiler->is_incomplete = true;
+	} else {
+		fprintf(stderr, "syntax error near '%s'\n", compiler->tokens[compiler->position].text);
+	}
+}
+
+// The ")" or reserved word that closes a construct, it is skipped
+bool ExpectClosing(struct PlanCompiler* compiler, const char* closing) {
+	bool is_found = strcmp(closing, ")") == 0 ? compiler->position < compiler->num_tokens
+		&& compiler->tokens[compiler->position].type == TOKEN_RPAREN : IsReservedWord(compiler, closing);
+
+	if (is_found) {
+		compiler->position++;
+	} else if (compiler->position == compiler->num_tokens) {
+		PrintSyntaxError(compiler);
+	} else {
+		fprintf(stderr, "syntax error: missing '%s'\n", closing);
+	}
+	return is_found;
+}
+
+// Words and redirections split by "|", the tokens are kept as they are for RunPipelineNode
+struct PlanNode* CompilePipeline(struct PlanCompiler* compiler) {
+	struct Token* tokens = compiler->tokens;
+	int start = compiler->position;
+	bool is_command_start = true;
+	struct PlanNode* node;
+
+	while (compiler->position < compiler->num_tokens) {
+		struct Token* token = &tokens[compiler->position];
+		if (token->type == TOKEN_WORD) {
+			is_command_start = false;
+		} else if (token->type == TOKEN_REDIRECT) {
+			if (compiler->position + 1 == compiler->num_tokens || token[1].type != TOKEN_WORD) {
+				fprintf(stderr, "syntax error: '%s' needs a file name\n", token->text);
+				return NULL;
+			}
+			compiler->position++;
+			is_command_start = false;
+		} else if (token->type == TOKEN_PIPE && !is_command_start) {
+			is_command_start = true;
+		} else if (token->type == TOKEN_NEWLINE && is_command_start && compiler->position > start) {
+			// a | at the end of a line, PreparePipeline drops the newline
+		} else {
+			break;
+		}
+		compiler->position++;
+	}
+	if (is_command_start) {
+		PrintSyntaxError(compiler);
+		return NULL;
+	}
+	node = NewPlanNode(NODE_PIPELINE, NULL, NULL);
+	SetPlanNodeTokens(compiler, node, start, compiler->position);
+	return node;
+}
+
+struct PlanNode* CompileList(struct PlanCompiler* compiler);
+
+// The redirections after ) } or done, which apply to the whole construct starting at tokens[start].
+// Only an operator may follow them
+bool CompileRedirections(struct PlanCompiler* compiler, struct PlanNode* node, int start) {
+	int redirections_start = compiler->position;
+
+	while (compiler->position + 1 < compiler->num_tokens
+		&& compiler->tokens[compiler->position].type == TOKEN_REDIRECT
+		&& compiler->tokens[compiler->position + 1].type == TOKEN_WORD) {
+		compiler->position += 2;
+	}
+	if (compiler->position < compiler->num_tokens
+		&& (compiler->tokens[compiler->position].type == TOKEN_WORD
+		|| compiler->tokens[compiler->position].type == TOKEN_REDIRECT
+		|| compiler->tokens[compiler->position].type == TOKEN_LPAREN)) {
+		PrintSyntaxError(compiler);
+		return false;
+	}
+	// the tokens are only its redirections, the text is the whole construct
+	node->tokens = &compiler->tokens[redirections_start];
+	node->num_tokens = compiler->position - redirections_start;
+	node->first_heredoc = compiler->heredocs_before[redirections_start];
+	SetPlanNodeText(compiler, node, start, compiler->position);
+	return true;
+}
+
+// ( list ) and { list; }
+struct PlanNode* CompileGroup(struct PlanCompiler* compiler, NodeType type) {
+	int start = compiler->position++;
+	struct PlanNode* body = CompileList(compiler);
+	struct PlanNode* node;
+
+	if (body == NULL || !ExpectClosing(compiler, type == NODE_SUBSHELL ? ")" : "}")) return NULL;
+	node = NewPlanNode(type, body, NULL);
+	return CompileRedirections(compiler, node, start) ? node : NULL;
+}
+
+// for NAME in word... (";" | newline) do list done
+struct PlanNode* CompileFor(struct PlanCompiler* compiler) {
+	int start = compiler->position++;
+	struct Token* name = &compiler->tokens[compiler->position];
+	int words_start;
+	struct PlanNode* node;
+	bool is_name;
+	int i;
+
+	if (compiler->position == compiler->num_tokens) {
+		PrintSyntaxError(compiler);
+		return NULL;
+	}
+	is_name = name->type == TOKEN_WORD && name->source_length == (int)strlen(name->text) && IsNameStart(name->text[0]);
+	for (i = 1; is_name && name->text[i] != '\0'; i++) {
+		is_name = IsNameChar(name->text[i]);
+	}
+	if (!is_name) {
+		fprintf(stderr, "syntax error: bad for loop variable '%s'\n", name->text);
+		return NULL;
+	}
+	compiler->position++;
+	if (!ExpectClosing(compiler, "in")) return NULL;
+
+	words_start = compiler->position;
+	while (compiler->position < compiler->num_tokens && compiler->tokens[compiler->position].type == TOKEN_WORD) {
+		compiler->position++;
+	}
+	node = NewPlanNode(NODE_FOR, NULL, NULL);
+	node->name = name->text;
+	node->words = &compiler->tokens[words_start];
+	node->num_words = compiler->position - words_start;
+	if (compiler->position == compiler->num_tokens || (compiler->tokens[compiler->position].type != TOKEN_SEMICOLON
+		&& compiler->tokens[compiler->position].type != TOKEN_NEWLINE)) {
+		PrintSyntaxError(compiler);
+		return NULL;
+	}
+	compiler->position++;
+	SkipNewlines(compiler);
+	if (!ExpectClosing(compiler, "do")) return NULL;
+	node->left = CompileList(compiler);
+	if (node->left == NULL || !ExpectClosing(compiler, "done")) return NULL;
+	return CompileRedirections(compiler, node, start) ? node : NULL;
+}
+
+// while list do list done, until only turns the test around
+struct PlanNode* CompileWhile(struct PlanCompiler* compiler, NodeType type) {
+	int start = compiler->position++;
+	struct PlanNode* condition = CompileList(compiler);
+	struct PlanNode* body;
+	struct PlanNode* node;
+
+	if (condition == NULL || !ExpectClosing(compiler, "do")) return NULL;
+	body = CompileList(compiler);
+	if (body == NULL || !ExpectClosing(compiler, "done")) return NULL;
+	node = NewPlanNode(type, condition, body);
+	return CompileRedirections(compiler, node, start) ? node : NULL;
+}
+
+struct PlanNode* CompileCommand(struct PlanCompiler* compiler) {
+	if (compiler->position < compiler->num_tokens && compiler->tokens[compiler->position].type == TOKEN_LPAREN) {
+		return CompileGroup(compiler, NODE_SUBSHELL);
+	}
+	if (IsReservedWord(compiler, "{")) {
+		return CompileGroup(compiler, NODE_GROUP);
+	}
+	if (IsReservedWord(compiler, "for")) {
+		return CompileFor(compiler);
+	}
+	if (IsReservedWord(compiler, "while")) {
+		return CompileWhile(compiler, NODE_WHILE);
+	}
+	if (IsReservedWord(compiler, "until")) {
+		return CompileWhile(compiler, NODE_UNTIL);
+	}
+	return CompilePipeline(compiler);
+}
+
+// command (&& command | || command)...
+struct PlanNode* CompileAndOr(struct PlanCompiler* compiler) {
+	int start = compiler->position;
+	struct PlanNode* node = CompileCommand(compiler);
+	struct PlanNode* right;
+	TokenType type;
+
+	while (node != NULL && compiler->position < compiler->num_tokens) {
+		type = compiler->tokens[compiler->position].type;
+		if (type != TOKEN_AND && type != TOKEN_OR) break;
+		compiler->position++;
+		SkipNewlines(compiler);
+		right = CompileCommand(compiler);
+		if (right == NULL) return NULL;
+		node = NewPlanNode(type == TOKEN_AND ? NODE_AND : NODE_OR, node, right);
+		SetPlanNodeText(compiler, node, start, compiler->position);
+	}
+	return node;
+}
+
+// list:     and_or ((";" | "&" | newline) and_or)* [";" | "&" | newline]
+// and_or:   command (("&&" | "||") command)*
+// command:  pipeline | ("(" list ")" | "{" list "}" | loop) redirection*
+// loop:     "for" name "in" word* (";" | newline) "do" list "done"
+//         | ("while" | "until") list "do" list "done"
+// pipeline: words and redirections separated by "|"
+// Newlines may also follow "&&" "||" "|". Returns NULL after reporting a syntax error
+struct PlanNode* CompileList(struct PlanCompiler* compiler) {
+	struct PlanNode* list = NULL;
+	struct PlanNode* item;
+	TokenType type;
+
+	while (1) {
+		SkipNewlines(compiler);
+		if (IsListEnd(compiler)) break;
+		item = CompileAndOr(compiler);
+		if (item == NULL) return NULL;
+		if (compiler->position < compiler->num_tokens) {
+			type = compiler->tokens[compiler->position].type;
+			if (type == TOKEN_BACKGROUND) {
+				item = NewPlanNode(NODE_BACKGROUND, item, NULL);
+				compiler->position++;
+			} else if (type == TOKEN_SEMICOLON || type == TOKEN_NEWLINE) {
+				compiler->position++;
+			} else if (!IsListEnd(compiler)) {
+				PrintSyntaxError(compiler);
+				return NULL;
+			}
+		}
+		list = list == NULL ? item : NewPlanNode(NODE_SEQUENCE, list, item);
+	}
+	if (list == NULL) {
+		PrintSyntaxError(compiler);
+	}
+	return list;
+}
+
+void ClearPlanCache(void) {
+	memset(g_plan_cache, 0, sizeof(g_plan_cache));
+	g_num_compiled_plans = 0;
+	ArenaReset(&g_plan_arena);
+}
+
+// The plan of a command line, compiled on first sight and cached under the line itself,
+// so a line repeated in a script is not tokenized again. Returns NULL on a syntax error.
+// A line that ends inside a loop or a group, or after && || |, sets *is_incomplete and gets a plan
+// without root that is not cached: only its here-docs are there, to be read before the next line
+struct Plan* CompilePlan(const char* input_string, bool* is_incomplete) {
+	unsigned int bucket = HashString(input_string) % PLAN_CACHE_BUCKETS;
+	struct PlanCompiler compiler;
+	struct Plan* plan;
+	int i;
+
+	*is_incomplete = false;
+	for (plan = g_plan_cache[bucket]; plan != NULL; plan = plan->next) {
+		if (strcmp(plan->line, input_string) == 0) return plan;
+	}
+	g_num_compiled_plans++; // failed ones too, their tokens stay in the arena all the same
+
+	plan = (struct Plan*)ArenaAlloc(&g_plan_arena, sizeof(struct Plan));
+	memset(plan, 0, sizeof(*plan));
+	// the tokens point into the line, so it has to outlive the input buffer
+	plan->line = ArenaStrndup(&g_plan_arena, input_string, strlen(input_string));
+	compiler.num_tokens = ParseCommand(&g_plan_arena, plan->line, &compiler.tokens);
+	if (compiler.num_tokens == -1) return NULL;
+	compiler.position = 0;
+	compiler.is_incomplete = false;
+	compiler.heredocs_before = (int*)ArenaAlloc(&g_plan_arena, (compiler.num_tokens + 1) * sizeof(int));
+	compiler.heredocs_before[0] = 0;
+	for (i = 0; i < compiler.num_tokens; i++) {
+		compiler.heredocs_before[i+1] = compiler.heredocs_before[i]
+			+ (compiler.tokens[i].type == TOKEN_REDIRECT && (compiler.tokens[i].redirection == REDIRECT_HEREDOC
+			|| compiler.tokens[i].redirection == REDIRECT_HEREDOC_STRIP));
+	}
+	plan->num_heredocs = compiler.heredocs_before[compiler.num_tokens];
+	plan->heredocs = (struct Token**)ArenaAlloc(&g_plan_arena, plan->num_heredocs * sizeof(struct Token*));
+	for (i = 0; i < compiler.num_tokens; i++) {
+		if (compiler.heredocs_before[i+1] > compiler.heredocs_before[i]) {
+			plan->heredocs[compiler.heredocs_before[i]] = &compiler.tokens[i];
+		}
+	}
+
+	if (compiler.num_tokens > 0) {
+		plan->root = CompileList(&compiler);
+		if (compiler.is_incomplete) {
+			*is_incomplete = true;
+			plan->root = NULL;
+			return plan;
+		}
+		if (plan->root == NULL) return NULL;
+		if (compiler.position < compiler.num_tokens) {
+			PrintSyntaxError(&compiler);
+			return NULL;
+		}
+	}
+	plan->next = g_plan_cache[bucket];
+	g_plan_cache[bucket] = plan;
+	return plan;
+}
+
+// One more line of a command line a loop, a group or a subshell left open: its here-docs are
+// read and *depth moves by what it opens and closes. Those are counted by their reserved words
+// and parentheses where a command starts, as CompileCommand finds them, so the whole text is
+// compiled again once they may all be closed instead of for every line of a long body.
+// A line that does not tokenize sets *depth to 0, compiling reports the error.
+// Returns -1 if reading a here-doc was interrupted
+int ScanOpenLine(const char* line, int* depth) {
+	struct ArenaMark mark = ArenaGetMark(&g_command_arena);
+	struct Token* tokens;
+	struct Plan heredoc_plan;
+	bool is_command_start = true;
+	bool is_reserved;
+	int num_tokens = ParseCommand(&g_command_arena, ArenaStrndup(&g_command_arena, line, strlen(line)), &tokens);
+	int i;
+
+	if (num_tokens == -1) {
+		*depth = 0;
+		ArenaRelease(&g_command_arena, mark);
+		return 0;
+	}
+	memset(&heredoc_plan, 0, sizeof(heredoc_plan));
+	heredoc_plan.num_heredocs = g_num_heredoc_bodies;
+	for (i = 0; i < num_tokens; i++) {
+		if (tokens[i].type != TOKEN_WORD) {
+			if (tokens[i].type == TOKEN_LPAREN) (*depth)++;
+			if (tokens[i].type == TOKEN_RPAREN) (*depth)--;
+			if (tokens[i].type == TOKEN_REDIRECT && (tokens[i].redirection == REDIRECT_HEREDOC
+				|| tokens[i].redirection == REDIRECT_HEREDOC_STRIP)) {
+				heredoc_plan.num_heredocs++;
+			}
+			is_command_start = tokens[i].type != TOKEN_REDIRECT && tokens[i].type != TOKEN_RPAREN;
+			continue;
+		}
+		is_reserved = is_command_start && tokens[i].source_length == (int)strlen(tokens[i].text);
+		if (is_reserved && (strcmp(tokens[i].text, "for") == 0 || strcmp(tokens[i].text, "while") == 0
+			|| strcmp(tokens[i].text, "until") == 0 || strcmp(tokens[i].text, "{") == 0)) {
+			(*depth)++;
+		} else if (is_reserved && (strcmp(tokens[i].text, "done") == 0 || strcmp(tokens[i].text, "}") == 0)) {
+			(*depth)--;
+		}
+		// a while or until condition, a group and a loop body start with a command
+		is_command_start = is_reserved && (strcmp(tokens[i].text, "while") == 0
+			|| strcmp(tokens[i].text, "until") == 0 || strcmp(tokens[i].text, "{") == 0
+			|| strcmp(tokens[i].text, "do") == 0);
+	}
+	// the tokens are not needed any more, unless here-doc bodies go after them
+	if (heredoc_plan.num_heredocs == g_num_heredoc_bodies) {
+		ArenaRelease(&g_command_arena, mark);
+		return 0;
+	}
+	heredoc_plan.heredocs = (struct Token**)ArenaAlloc(&g_command_arena,
+		heredoc_plan.num_heredocs * sizeof(struct Token*));
+	heredoc_plan.num_heredocs = g_num_heredoc_bodies;
+	for (i = 0; i < num_tokens; i++) {
+		if (tokens[i].type == TOKEN_REDIRECT && (tokens[i].redirection == REDIRECT_HEREDOC
+			|| tokens[i].redirection == REDIRECT_HEREDOC_STRIP)) {
+			heredoc_plan.heredocs[heredoc_plan.num_heredocs++] = &tokens[i];
+		}
+	}
+	return ReadHereDocuments(&heredoc_plan);
+}
+
+// A fresh copy of a plan node's tokens with $ expansions done, split into the stages of
+// pipeline and with the line's here-doc bodies attached. Returns false after a syntax error
+bool PreparePipeline(struct PlanNode* node, struct Pipeline* pipeline) {
+	struct Token* tokens;
+	int num_tokens = ExpandVariables(node->tokens, node->num_tokens, &tokens);
+
+	if (num_tokens == -1) return false;
+	if (num_tokens == 0) {
+		pipeline->num_stages = 0;
+		return true;
+	}
+	if (ParsePipeline(tokens, num_tokens, pipeline) == -1) return false;
+	AttachHereDocuments(pipeline->stages, pipeline->num_stages, node->first_heredoc);
+	return true;
+}
+
+// The redirections after ) } or done, turned into a command without argv
+bool PrepareGroupRedirections(struct PlanNode* node, struct Command* command) {
+	struct Token* tokens;
+	int num_tokens = ExpandVariables(node->tokens, node->num_tokens, &tokens);
+
+	if (num_tokens == -1) return false;
+	if (ProcessIORedirection(command, tokens, num_tokens) != 0) {
+		if (command->num_tokens > 0) fprintf(stderr, "%s: ambiguous redirect\n", command->argv[0]);
+		return false;
+	}
+	AttachHereDocuments(command, 1, node->first_heredoc);
+	return true;
+}
+
+// One pipeline of the plan: builtin, exec in place, or a job.
+// is_tail: nothing of the line runs after it
+void RunPipelineNode(struct PlanNode* node, bool is_tail) {
+	struct Pipeline pipeline;
+	struct Command* command;
+	struct Builtin* builtin;
+	uint64_t trace_time;
+	bool is_timed;
+	struct JobTimeout timeout;
+	bool has_timeout = false;
+	struct JobSettings settings;
+	const char* settings_name = NULL; // the first of pin, nice, limit
+	int num_substitutions;
+	uint64_t time_start = 0;
+	struct rusage shell_usage_before;
+
+	trace_time = TraceClock();
+	num_substitutions = g_num_substitutions;
+	memset(&g_substitution_usage, 0, sizeof(g_substitution_usage));
+	if (!PreparePipeline(node, &pipeline)) {
+		g_last_exit_code = EXECUTE_FAILED_ERROR_CODE;
+		g_was_terminated = false;
+		return;
+	}
+	g_trace.expand_ns = TraceClock() - trace_time; // together with the split
+	if (pipeline.num_stages == 0) {
+		return; // only empty expansions
+	}
+	g_trace.num_stages = pipeline.num_stages;
+	command = &pipeline.stages[0];
+
+	// NAME=value alone: the status is the last $(...)'s, 0 without any
+	if (command->argv[0] == NULL) {
+		AssignVariables(command);
+		if (g_num_substitutions == num_substitutions) {
+			g_last_exit_code = 0;
+			g_was_terminated = false;
+		}
+		return;
+	}
+
+	// time pipeline: run the rest of the pipeline, then report what it cost
+	is_timed = strcmp(command->argv[0], "time") == 0 && !g_is_bg_command;
+	if (is_timed) {
+		command->argv++;
+		command->num_tokens--;
+		if (command->num_tokens == 0 && pipeline.num_stages > 1) {
+			fprintf(stderr, "syntax error: time needs a command\n");
+			return;
+		}
+		time_start = MonotonicNs();
+		getrusage(RUSAGE_SELF, &shell_usage_before);
+		g_has_last_job_usage = false;
+	}
+
+	// timeout ... pipeline: the job runs under a timer. pin, nice, limit ... pipeline: its processes
+	// get the settings. In any order, programs only
+	memset(&settings, 0, sizeof(settings));
+	while (command->argv[0] != NULL) {
+		if (!has_timeout && strcmp(command->argv[0], "timeout") == 0) {
+			if (!ParseTimeout(command, &timeout)) {
+				g_last_exit_code = TIMEOUT_FAILED_EXIT_CODE;
+				g_was_terminated = false;
+				return;
+			}
+			has_timeout = true;
+		} else if (IsJobSettingsPrefix(command)) {
+			if (settings_name == NULL) settings_name = command->argv[0];
+			if (!ParseJobSettings(command, &settings)) {
+				g_last_exit_code = SETTINGS_FAILED_EXIT_CODE;
+				g_was_terminated = false;
+				return;
+			}
+		} else {
+			break;
+		}
+	}
+
+	// Get command name	
+	char* command_name = command->argv[0];
+
+	// Built-in commands, only when they are not part of a pipeline
+	builtin = pipeline.num_stages == 1 && command_name != NULL ? FindBuiltin(command_name) : NULL;
+	if (command_name == NULL) {
+		// a bare time
+	} else if (has_timeout && builtin != NULL && !builtin->has_program) {
+		fprintf(stderr, "timeout: %s: shell builtins cannot be timed out\n", command_name);
+		g_last_exit_code = TIMEOUT_FAILED_EXIT_CODE;
+		g_was_terminated = false;
+	} else if (settings_name != NULL && builtin != NULL && !builtin->has_program) {
+		fprintf(stderr, "%s: %s: shell builtins run inside the shell\n", settings_name, command_name);
+		g_last_exit_code = SETTINGS_FAILED_EXIT_CODE;
+		g_was_terminated = false;
+	} else if (builtin != NULL && !(g_is_bg_command && builtin->has_program) && !has_timeout
+		&& settings_name == NULL) {
+		trace_time = TraceClock();
+		RunBuiltin(builtin, command);
+		g_trace.builtin_ns = TraceClock() - trace_time;
+		g_trace.is_builtin = true;
+	} else if (pipeline.num_stages == 1 && is_tail
+		&& (g_is_subshell || (g_is_command_string && IsInputExhausted()))
+		&& !g_is_bg_command && g_num_jobs == 0 && g_trace_fd == -1 && !is_timed && !has_timeout
+		&& settings_name == NULL) {
+		ExecuteInPlace(command);
+	} else {
+		// Spawn a child and have that child execute command
+		ExecuteCommand(&pipeline, node->text, has_timeout ? &timeout : NULL,
+			settings_name != NULL ? &settings : NULL);
+	}
+	if (is_timed) {
+		PrintTimeReport(time_start, &shell_usage_before);
+	}
+
+	if (g_trace_fd != -1) {
+		WriteTraceRecord(node->text);
+		memset(&g_trace, 0, sizeof(g_trace));
+		g_trace.start = TraceClock();
+	}
+}
+
+// In the child of a fork that goes on running the plan: the parent's jobs are not its own,
+// SIGINT, SIGTERM and SIGTSTP act the default way again, and it needs an epoll set of its
+// own, the parent's one is shared across fork
+void EnterSubshell(void) {
+	sigset_t default_signals;
+	int slot;
+
+	g_is_subshell = true;
+	g_is_interactive = false;
+	if (g_terminal_fd != -1) {
+		close(g_terminal_fd); // no job control in here, its jobs stay in its group
+		g_terminal_fd = -1;
+	}
+	for (slot = 0; slot < g_job_high_water; slot++) {
+		if (g_jobs[slot].is_used) FreeJob(slot);
+	}
+	free(g_jobs);
+	g_jobs = NULL;
+	g_job_capacity = 0;
+	g_num_unwatched_processes = 0;
+
+	sigemptyset(&default_signals);
+	sigaddset(&default_signals, SIGINT);
+	sigaddset(&default_signals, SIGTERM);
+	sigaddset(&default_signals, SIGTSTP);
+	sigdelset(&g_blocked_signal_set, SIGINT);
+	sigdelset(&g_blocked_signal_set, SIGTERM);
+	sigdelset(&g_blocked_signal_set, SIGTSTP);
+	sigprocmask(SIG_UNBLOCK, &default_signals, NULL);
+	close(g_epoll_fd);
+	close(g_signal_fd);
+	SetupEventLoop();
+}
+
+void ExecutePlan(struct PlanNode* node, bool is_tail);
+
+// ( list ) and lists run with "&": a forked copy of the shell runs body and exits with its
+// status, the parent handles it as a one process job. redirect: opened redirections, or NULL
+void RunSubshell(struct PlanNode* body, struct Command* redirect, char* text) {
+	pid_t pgid = NewJobProcessGroup();
+	pid_t pid;
+	int slot;
+
+	fflush(stdout);
+	slot = AllocateJob(text, 1);
+	pid = fork();
+	if (pid == 0) {
+		if (pgid != KEEP_SHELL_PGROUP) setpgid(0, 0);
+		if (TakesTerminal(pgid)) tcsetpgrp(g_terminal_fd, getpid());
+		EnterSubshell();
+		if (redirect != NULL && !ApplyFdActions(redirect)) {
+			perror("dup2()");
+			exit(EXECUTE_FAILED_ERROR_CODE);
+		}
+		g_is_bg_command = false;
+		ExecutePlan(body, true);
+		exit(LastStatusCode());
+	}
+	if (pid == -1) {
+		perror("fork()");
+	} else if (pgid != KEEP_SHELL_PGROUP) {
+		setpgid(pid, pid);
+		g_jobs[slot].pgid = pid;
+		if (TakesTerminal(pgid)) GiveTerminal(pid);
+	}
+	if (redirect != NULL) CloseRedirections(redirect);
+	AddJobProcess(slot, pid);
+	WaitOrWatchJob(slot);
+}
+
+// Once per word: the words are expanded when the loop starts, the body's own tokens in every
+// iteration, which gives the command arena back after each one. Status 0 without any
+void RunForLoop(struct PlanNode* node) {
+	struct Token* words;
+	int num_words = ExpandVariables(node->words, node->num_words, &words);
+	struct ArenaMark mark;
+	size_t name_length = strlen(node->name);
+	int i;
+
+	if (num_words == 0) {
+		g_last_exit_code = 0;
+		g_was_terminated = false;
+		return;
+	}
+	for (i = 0; i < num_words && !g_signal_caught; i++) {
+		// rewritten in place once its line is big enough, the variable keeps the last value
+		SetVariable(node->name, name_length, words[i].text, strlen(words[i].text));
+		mark = ArenaGetMark(&g_command_arena);
+		ExecutePlan(node->left, false);
+		ArenaRelease(&g_command_arena, mark);
+		// a loop of builtins would not see SIGINT otherwise
+		if (i % LOOP_EVENT_INTERVAL == LOOP_EVENT_INTERVAL - 1) HandleEvents(0);
+	}
+}
+
+// while and until: the test and the body run from the plan as they are, like a for body.
+// The status is the body's last one, 0 if it never ran
+void RunWhileLoop(struct PlanNode* node) {
+	struct ArenaMark mark;
+	bool is_done;
+	int status = 0;
+	int iteration = 0;
+
+	while (!g_signal_caught) {
+		mark = ArenaGetMark(&g_command_arena);
+		ExecutePlan(node->left, false);
+		is_done = g_signal_caught || (LastStatusCode() == 0) == (node->type == NODE_UNTIL);
+		if (!is_done) {
+			ExecutePlan(node->right, false);
+			status = LastStatusCode();
+		}
+		ArenaRelease(&g_command_arena, mark);
+		if (is_done) break;
+		if (++iteration % LOOP_EVENT_INTERVAL == 0) HandleEvents(0);
+	}
+	g_last_exit_code = status;
+	g_was_terminated = false;
+}
+
+// { list; } and loops, run by the shell itself
+void RunCompound(struct PlanNode* node, bool is_tail) {
+	if (node->type == NODE_FOR) {
+		RunForLoop(node);
+	} else if (node->type == NODE_GROUP) {
+		ExecutePlan(node->left, is_tail);
+	} else {
+		RunWhileLoop(node);
+	}
+}
+
+// { list; } and loops with redirections: the shell's own fds are pointed elsewhere meanwhile
+void RunGroup(struct PlanNode* node, bool is_tail) {
+	struct Command redirect;
+	int* saved_fds;
+
+	if (node->num_tokens == 0) {
+		RunCompound(node, is_tail);
+		return;
+	}
+	if (!PrepareGroupRedirections(node, &redirect) || !RedirectShellFds(&redirect, &saved_fds)) {
+		g_last_exit_code = EXECUTE_FAILED_ERROR_CODE;
+		g_was_terminated = false;
+		return;
+	}
+	RunCompound(node, false);
+	RestoreShellFds(&redirect, saved_fds);
+}
+
+// ( list ) redirections: opened here, applied in the child
+void RunSubshellNode(struct PlanNode* node) {
+	struct Command redirect;
+
+	if (node->num_tokens == 0) {
+		RunSubshell(node->left, NULL, node->text);
+		return;
+	}
+	if (!PrepareGroupRedirections(node, &redirect) || !OpenRedirections(&redirect)) {
+		g_last_exit_code = EXECUTE_FAILED_ERROR_CODE;
+		g_was_terminated = false;
+		return;
+	}
+	RunSubshell(node->left, &redirect, node->text);
+}
+
+// Walk the plan. A list stops early once SIGINT or SIGTERM reached the shell.
+// is_tail: nothing of the line runs after node, the last program may replace the shell
+void ExecutePlan(struct PlanNode* node, bool is_tail) {
+	switch (node->type) {
+	case NODE_PIPELINE:
+		RunPipelineNode(node, is_tail);
+		break;
+	case NODE_SEQUENCE:
+		ExecutePlan(node->left, false);
+		if (!g_signal_caught) ExecutePlan(node->right, is_tail);
+		break;
+	case NODE_AND:
+		ExecutePlan(node->left, false);
+		if (!g_signal_caught && LastStatusCode() == 0) ExecutePlan(node->right, is_tail);
+		break;
+	case NODE_OR:
+		ExecutePlan(node->left, false);
+		if (!g_signal_caught && LastStatusCode() != 0) ExecutePlan(node->right, is_tail);
+		break;
+	case NODE_BACKGROUND:
+		if (!g_bg_command_enable) {
+			ExecutePlan(node->left, is_tail); // fore-ground only mode
+			break;
+		}
+		g_is_bg_command = true;
+		if (node->left->type == NODE_PIPELINE) {
+			RunPipelineNode(node->left, false);
+		} else if (node->left->type == NODE_SUBSHELL) {
+			RunSubshellNode(node->left);
+		} else {
+			// && || { } and loops in the background need a shell of their own
+			RunSubshell(node->left, NULL, node->left->text);
+		}
+		g_is_bg_command = false;
+		break;
+	case NODE_GROUP:
+	case NODE_FOR:
+	case NODE_WHILE:
+	case NODE_UNTIL:
+		RunGroup(node, is_tail);
+		break;
+	case NODE_SUBSHELL:
+		RunSubshellNode(node);
+		break;
+	}
+}
+
+// Command substitution //
+
+// Append everything fd has to give to out, reading straight into its spare room, which doubles
+// whenever it runs low. NUL bytes cannot be part of a word and are dropped
+void ReadSubstitution(struct ArenaString* out, int fd) {
+	ssize_t num_read;
+	char* end;
+	char* p;
+
+	while (1) {
+		if (out->capacity - out->length < (size_t)SUBSTITUTION_READ_MIN) {
+			ArenaStringReserve(&g_command_arena, out, SUBSTITUTION_READ_MIN);
+		}
+		num_read = read(fd, out->data + out->length, out->capacity - out->length);
+		if (num_read == -1 && errno == EINTR) continue;
+		if (num_read <= 0) break;
+		end = out->data + out->length + num_read;
+		for (p = out->data + out->length; p < end; p++) {
+			if (*p != '\0') out->data[out->length++] = *p;
+		}
+	}
+}
+
+// A builtin that writes output, alone on its line: it runs in the shell with stdout on a memfd.
+// Returns false if that could not be set up
+bool RunSubstitutionBuiltin(struct ArenaString* out, struct PlanNode* node, struct Builtin* builtin) {
+	struct Pipeline pipeline;
+	int saved_stdout;
+	int memfd;
+
+	if (!PreparePipeline(node, &pipeline)) return true;
+	if (pipeline.num_stages == 0) return true;
+	memfd = memfd_create("substitution", MFD_CLOEXEC);
+	if (memfd == -1) return false;
+	fflush(stdout);
+	saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+	if (dup2(memfd, STDOUT_FILENO) == -1) {
+		close(memfd);
+		if (saved_stdout != -1) close(saved_stdout);
 		return false;
 	}
+	RunBuiltin(builtin, &pipeline.stages[0]);
+	fflush(stdout);
+	if (saved_stdout == -1) {
+		close(STDOUT_FILENO);
+	} else {
+		dup2(saved_stdout, STDOUT_FILENO);
+		close(saved_stdout);
+	}
+	lseek(memfd, 0, SEEK_SET);
+	ReadSubstitution(out, memfd);
+	close(memfd);
 	return true;
 }
 
-// side effect: this will change current_working_dir
-void GetCurrentWorkingDir(char current_working_dir[]) {
-	char* getcwd_result;
-	//getcwd_result = getcwd(current_working_dir, sizeof(current_working_dir));
-	getcwd_result = getcwd(current_working_dir, PATH_MAX-1);
-	if ( getcwd_result == NULL ) {
-		perror("getcwd() error\n");	
-		perror("Working Directory unchanged\n");
-		return;
-	} 
+// The $(...) or `...` starting at source: its list runs with stdout on a pipe that is read
+// into out, less the trailing newlines, and its status becomes the last status. A lone builtin
+// like echo or printf does not need a fork. Returns the number of characters consumed
+size_t AppendSubstitution(struct ArenaString* out, const char* source, size_t length) {
+	int substitution_length = SubstitutionLength(source, length);
+	struct Plan* plan;
+	struct PlanNode* root;
+	struct Builtin* builtin;
+	bool is_incomplete;
+	char* inner;
+	size_t inner_length;
+	size_t start = out->length;
+	size_t i;
+	int pipe_fds[2];
+	int child_exit_status;
+	struct rusage usage;
+	pid_t pid;
+
+	if (substitution_length == -1) {
+		// an unclosed ` in a here-doc body is just a character
+		ArenaStringAppend(&g_command_arena, out, source, 1);
+		return 1;
+	}
+	g_num_substitutions++;
+	if (source[0] == '`') {
+		// \\ \` \$ are escapes in there, the rest is taken as it is
+		inner = (char*)ArenaAlloc(&g_command_arena, substitution_length);
+		inner_length = 0;
+		for (i = 1; i + 1 < (size_t)substitution_length; i++) {
+			if (source[i] == '\\' && strchr("\\`$", source[i+1]) != NULL) i++;
+			inner[inner_length++] = source[i];
+		}
+		inner[inner_length] = '\0';
+	} else {
+		inner = ArenaStrndup(&g_command_arena, source + 2, substitution_length - 3);
+	}
+
+	plan = CompilePlan(inner, &is_incomplete);
+	if (is_incomplete) fprintf(stderr, "syntax error: unexpected end of substitution\n");
+	if (plan == NULL || is_incomplete) {
+		g_last_exit_code = EXECUTE_FAILED_ERROR_CODE;
+		g_was_terminated = false;
+		return substitution_length;
+	}
+	if (plan->num_heredocs > 0) {
+		fprintf(stderr, "here-documents are not supported in a substitution\n");
+		g_last_exit_code = EXECUTE_FAILED_ERROR_CODE;
+		g_was_terminated = false;
+		return substitution_length;
+	}
+	root = plan->root;
+	if (root == NULL) {
+		g_last_exit_code = 0;
+		g_was_terminated = false;
+		return substitution_length;
+	}
+
+	builtin = NULL;
+	if (root->type == NODE_PIPELINE && root->num_tokens > 0 && root->tokens[0].type == TOKEN_WORD
+		&& !root->tokens[0].has_expansion) {
+		builtin = FindBuiltin(root->tokens[0].text);
+		for (i = 0; builtin != NULL && i < (size_t)root->num_tokens; i++) {
+			if (root->tokens[i].type == TOKEN_PIPE) builtin = NULL;
+		}
+	}
+	if (builtin != NULL && builtin->has_program && RunSubstitutionBuiltin(out, root, builtin)) {
+		// in-process
+	} else if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+		perror("pipe()");
+		g_last_exit_code = EXECUTE_FAILED_ERROR_CODE;
+		g_was_terminated = false;
+	} else {
+		fflush(stdout);
+		fflush(stderr);
+		pid = fork();
+		if (pid == 0) {
+			// in the shell's group, ^C reaches it with the foreground job
+			close(pipe_fds[0]);
+			dup2(pipe_fds[1], STDOUT_FILENO);
+			close(pipe_fds[1]);
+			EnterSubshell();
+			g_is_bg_command = false;
+			ExecutePlan(root, true);
+			fflush(stdout);
+			exit(LastStatusCode());
+		}
+		close(pipe_fds[1]);
+		if (pid == -1) {
+			perror("fork()");
+			g_last_exit_code = EXECUTE_FAILED_ERROR_CODE;
+			g_was_terminated = false;
+		} else {
+			ReadSubstitution(out, pipe_fds[0]);
+			while (wait4(pid, &child_exit_status, 0, &usage) == -1 && errno == EINTR) {}
+			AddUsage(&g_substitution_usage, &usage);
+			if (WIFSIGNALED(child_exit_status)) {
+				g_last_terminate_signal_code = WTERMSIG(child_exit_status);
+				g_was_terminated = true;
+				if (g_last_terminate_signal_code == SIGINT) g_signal_caught = true;
+			} else {
+				g_last_exit_code = WEXITSTATUS(child_exit_status);
+				g_was_terminated = false;
+			}
+		}
+		close(pipe_fds[0]);
+	}
+	while (out->length > start && out->data[out->length-1] == '\n') {
+		out->length--;
+	}
+	return substitution_length;
 }
 
-// using cwd()
-void PrintCurrentWorkingDir() {
-	char current_working_dir[PATH_MAX-1];
-	memset(current_working_dir, '\0', PATH_MAX-1);
-	GetCurrentWorkingDir(current_working_dir);
-	fprintf(stdout, "Current working directory: %s\n", current_working_dir);
+// --serve //
+
+// Grow a malloc'd buffer to at least length bytes, doubling
+void ReserveBuffer(char** buffer, size_t* capacity, size_t length) {
+	if (length <= *capacity) return;
+	if (*capacity == 0) *capacity = SERVE_READ_SIZE;
+	while (*capacity < length) *capacity *= 2;
+	*buffer = (char*)realloc(*buffer, *capacity);
 }
 
-// using chdir()
-void PrintChDirError() {
-	perror("chdir() error\n");
-	int error_code = errno; // errno is from <linux/limits.h>
-	if (error_code == EACCES) perror("Search permission was denied\n");
-	if (error_code == EFAULT) perror("new dir points outside your accessible address space\n");
-	if (error_code == EIO) perror("An I/O error occurred\n");
-	if (error_code == ELOOP) perror("Too many symbolic links were encountered in resolving new dir\n");
-	if (error_code == ENOENT) perror("The new dir does not exist\n");
-	if (error_code == ENOMEM) perror ("In sufficient kernel memory\n");
-	if (error_code == ENOTDIR) perror("A component of new dir is not a directory\n");		
+void WatchServeFd(int operation, int fd, uint32_t events, EventKind kind, uint64_t payload) {
+	struct epoll_event event = {0};
+
+	event.events = events;
+	event.data.u64 = MakeEventData(kind, payload);
+	epoll_ctl(g_epoll_fd, operation, fd, &event);
 }
 
-void ChangeDirToHome(char new_working_dir[]) {
-	char* home_dir = NULL;
-	home_dir = getenv("HOME");
-	strcpy(new_working_dir, home_dir);
-	int change_result;	
-	change_result = chdir(new_working_dir);
-	if (change_result != 0) {
-		PrintChDirError();	
-	}	
+void AppendServeFrame(struct ServeClient* client, uint32_t request_id, ServeFrameType type,
+	const void* payload, uint32_t length) {
+	struct ServeFrame frame;
+
+	frame.request_id = request_id;
+	frame.type = type;
+	frame.length = length;
+	ReserveBuffer(&client->output, &client->output_capacity, client->output_length + sizeof(frame) + length);
+	memcpy(client->output + client->output_length, &frame, sizeof(frame));
+	memcpy(client->output + client->output_length + sizeof(frame), payload, length);
+	client->output_length += sizeof(frame) + length;
 }
 
+void FlushServeClient(int slot);
 
-void SetCurrentWorkingDir(char* command_tokens[], int num_tokens) {
-	char current_working_dir[PATH_MAX-1];
-	memset(current_working_dir, '\0', PATH_MAX-1);
-	char new_working_dir[PATH_MAX-1];
-	memset(new_working_dir, '\0', PATH_MAX-1);
-	char targeted_dir[PATH_MAX-1];
-	memset(targeted_dir, '\0', PATH_MAX-1);
+void FreeServeRequest(int index) {
+	g_serve_requests[index].client = -1;
+	g_serve_requests[index].next_free = g_first_free_serve_request;
+	g_first_free_serve_request = index;
+	g_num_serve_requests--;
+	if (g_num_serve_requests == 0) {
+		// none left: the next ones start at the front again
+		g_first_free_serve_request = -1;
+		g_serve_request_high_water = 0;
+	}
+}
 
-	// if no arg supplied, change dir to $HOME
-	if (num_tokens == 1) {
-		ChangeDirToHome(new_working_dir);
+// Both pipes are at end of file and the process is reaped: the status goes to the client
+// after all of the output. A hung up client only gets its slot back
+void FinishServeRequest(int index) {
+	struct ServeRequest* request = &g_serve_requests[index];
+	struct ServeClient* client = &g_serve_clients[request->client];
+	int32_t status = WIFSIGNALED(request->wait_status) ? 128 + WTERMSIG(request->wait_status)
+		: WEXITSTATUS(request->wait_status);
+	int slot = request->client;
+
+	FreeServeRequest(index);
+	client->num_requests--;
+	if (client->fd == -1) return;
+	AppendServeFrame(client, request->id, SERVE_EXIT, &status, sizeof(status));
+	FlushServeClient(slot);
+}
+
+// Gone or misbehaving: the connection is closed and what runs for it gets SIGHUP,
+// its output is dropped from now on
+void HangUpServeClient(int slot) {
+	struct ServeClient* client = &g_serve_clients[slot];
+	struct ServeRequest* request;
+	int stream;
+	int i;
+
+	close(client->fd); // also drops it from the epoll set
+	client->fd = -1;
+	free(client->input);
+	free(client->output);
+	client->input = client->output = NULL;
+	client->input_length = client->input_capacity = 0;
+	client->output_length = client->output_sent = client->output_capacity = 0;
+	for (i = 0; i < g_serve_request_high_water; i++) {
+		request = &g_serve_requests[i];
+		if (request->client != slot) continue;
+		for (stream = 0; stream < 2; stream++) {
+			if (request->output_fds[stream] != -1) close(request->output_fds[stream]);
+			request->output_fds[stream] = -1;
+		}
+		if (request->is_exited) {
+			FinishServeRequest(i);
+		} else {
+			killpg(request->pid, SIGHUP);
+			killpg(request->pid, SIGCONT);
+		}
+	}
+}
+
+// Send what the socket takes now, the rest once it is writable again. When all is out,
+// the requests paused for this client are read again
+void FlushServeClient(int slot) {
+	struct ServeClient* client = &g_serve_clients[slot];
+	struct ServeRequest* request;
+	ssize_t num_sent;
+	int stream;
+	int i;
+
+	while (client->output_sent < client->output_length) {
+		num_sent = send(client->fd, client->output + client->output_sent,
+			client->output_length - client->output_sent, MSG_NOSIGNAL);
+		if (num_sent == -1 && errno == EINTR) continue;
+		if (num_sent == -1 && errno == EAGAIN) {
+			if (!client->is_waiting_writable) {
+				WatchServeFd(EPOLL_CTL_MOD, client->fd, EPOLLIN | EPOLLOUT, EVENT_SERVE_CLIENT, slot);
+				client->is_waiting_writable = true;
+			}
+			return;
+		}
+		if (num_sent == -1) {
+			HangUpServeClient(slot);
+			return;
+		}
+		client->output_sent += num_sent;
+	}
+	client->output_length = 0;
+	client->output_sent = 0;
+	if (client->is_waiting_writable) {
+		WatchServeFd(EPOLL_CTL_MOD, client->fd, EPOLLIN, EVENT_SERVE_CLIENT, slot);
+		client->is_waiting_writable = false;
+	}
+	for (i = 0; i < g_serve_request_high_water; i++) {
+		request = &g_serve_requests[i];
+		if (request->client != slot || !request->is_paused) continue;
+		request->is_paused = false;
+		for (stream = 0; stream < 2; stream++) {
+			if (request->output_fds[stream] == -1) continue;
+			WatchServeFd(EPOLL_CTL_MOD, request->output_fds[stream], EPOLLIN, EVENT_SERVE_OUTPUT, i * 2 + stream);
+		}
+	}
+}
+
+// What a request wrote to its stdout (stream 0) or stderr (1), read straight into a frame
+// in its client's output. A client that does not keep up leaves it in the pipe, which in the
+// end blocks the request
+void ReadServeOutput(int index, int stream) {
+	struct ServeRequest* request = &g_serve_requests[index];
+	struct ServeClient* client;
+	struct ServeFrame frame;
+	ssize_t num_read;
+	int fd = request->output_fds[stream];
+
+	if (request->client == -1 || fd == -1) return;
+	client = &g_serve_clients[request->client];
+	if (client->output_length - client->output_sent >= SERVE_OUTPUT_MAX) {
+		request->is_paused = true;
+		WatchServeFd(EPOLL_CTL_MOD, fd, 0, EVENT_SERVE_OUTPUT, index * 2 + stream);
 		return;
 	}
-	strcpy(targeted_dir, command_tokens[1]);
+	ReserveBuffer(&client->output, &client->output_capacity,
+		client->output_length + sizeof(frame) + SERVE_READ_SIZE);
+	num_read = read(fd, client->output + client->output_length + sizeof(frame), SERVE_READ_SIZE);
+	if (num_read == -1 && (errno == EAGAIN || errno == EINTR)) return;
+	if (num_read <= 0) {
+		close(fd); // also drops it from the epoll set
+		request->output_fds[stream] = -1;
+		if (request->is_exited && request->output_fds[1 - stream] == -1) FinishServeRequest(index);
+		return;
+	}
+	frame.request_id = request->id;
+	frame.type = stream == 0 ? SERVE_STDOUT : SERVE_STDERR;
+	frame.length = (uint32_t)num_read;
+	memcpy(client->output + client->output_length, &frame, sizeof(frame));
+	client->output_length += sizeof(frame) + num_read;
+	FlushServeClient(request->client);
+}
 
-	// if it's absolute path, put it right on
-	if (targeted_dir[0] == '/') {
-		strcpy(new_working_dir, targeted_dir);
-	// if it's relative path, concat it with current dir
+void ReapServeRequest(int index) {
+	struct ServeRequest* request = &g_serve_requests[index];
+	int wait_status;
+
+	if (request->client == -1 || request->is_exited) return;
+	// not wait4: a request runs for its client, the server has no time or status -v to add it to
+	if (waitpid(request->pid, &wait_status, WNOHANG) != request->pid) return;
+	if (request->pidfd != -1) {
+		close(request->pidfd);
+		request->pidfd = -1;
+	}
+	request->is_exited = true;
+	request->wait_status = wait_status;
+	if (request->output_fds[0] == -1 && request->output_fds[1] == -1) FinishServeRequest(index);
+}
+
+// Pop a request entry off the free list, or take the next never used one,
+// doubling the array when it is full. The caller sets its client
+int AllocateServeRequest(void) {
+	int index;
+
+	if (g_first_free_serve_request != -1) {
+		index = g_first_free_serve_request;
+		g_first_free_serve_request = g_serve_requests[index].next_free;
 	} else {
-		GetCurrentWorkingDir(current_working_dir);	
-		sprintf(new_working_dir, "%s/%s", current_working_dir, targeted_dir);
+		if (g_serve_request_high_water == g_num_serve_request_slots) {
+			g_num_serve_request_slots = g_num_serve_request_slots == 0 ? INITIAL_JOB_CAPACITY
+				: g_num_serve_request_slots * 2;
+			g_serve_requests = (struct ServeRequest*)realloc(g_serve_requests,
+				g_num_serve_request_slots * sizeof(struct ServeRequest));
+			if (g_serve_requests == NULL) {
+				perror("realloc()");
+				exit(1);
+			}
+		}
+		index = g_serve_request_high_water++;
 	}
-	
-	int change_dir_result;	
-	change_dir_result = chdir(new_working_dir);
-	if (change_dir_result != 0) {
-		PrintChDirError();
+	g_num_serve_requests++;
+	return index;
+}
+
+// A lone program with nothing to expand needs no shell of its own: it is launched straight from
+// the server like the stage of a job, in a group of its own. fd 2 is already the request's.
+// Returns false if the request has to run in a forked copy of the shell instead
+bool SpawnServeProgram(struct ServeRequest* request, struct PlanNode* root, int stdout_fd) {
+	struct Pipeline pipeline;
+	struct Command* command;
+	int i;
+
+	if (root->type != NODE_PIPELINE) return false;
+	for (i = 0; i < root->num_tokens; i++) {
+		if (root->tokens[i].type == TOKEN_PIPE || root->tokens[i].has_expansion) return false;
 	}
+	if (!PreparePipeline(root, &pipeline) || pipeline.num_stages != 1) return false;
+	command = &pipeline.stages[0];
+	if (command->argv[0] == NULL || FindBuiltin(command->argv[0]) != NULL || strcmp(command->argv[0], "time") == 0
+		|| strcmp(command->argv[0], "timeout") == 0 || IsJobSettingsPrefix(command)) {
+		return false;
+	}
+	if (!OpenRedirections(command)) {
+		request->pid = -1;
+	} else if (g_spawn_backend == SPAWN_BACKEND_FORK) {
+		request->pid = ForkAndExecute(command, g_serve_null_fd, stdout_fd, 0, NULL);
+	} else {
+		request->pid = SpawnAndExecute(command, g_serve_null_fd, stdout_fd, 0);
+	}
+	CloseRedirections(command);
+	return true;
 }
 
-bool IsBackgroundCommand(char* command_tokens[], int num_token) {
-	if (!strcmp(command_tokens[num_token-1], "&")) {
-		return true;	
+// Compile the command line in the server, where the plan stays cached for the next request
+// with the same line, then run it in a forked copy of the shell that leads a group of its own,
+// stdin on /dev/null and stdout and stderr on pipes the server reads. A syntax error is reported
+// on the request's stderr
+void StartServeRequest(int slot, uint32_t request_id, const char* text, uint32_t length) {
+	struct ServeRequest* request;
+	struct Plan* plan;
+	bool is_incomplete;
+	int stdout_pipe[2];
+	int stderr_pipe[2];
+	int32_t status = EXECUTE_FAILED_ERROR_CODE;
+	bool is_spawned;
+	char* line;
+	int stream;
+	int index;
+
+	if (pipe2(stdout_pipe, O_CLOEXEC) == -1) {
+		AppendServeFrame(&g_serve_clients[slot], request_id, SERVE_EXIT, &status, sizeof(status));
+		return;
+	}
+	if (pipe2(stderr_pipe, O_CLOEXEC) == -1) {
+		close(stdout_pipe[0]);
+		close(stdout_pipe[1]);
+		AppendServeFrame(&g_serve_clients[slot], request_id, SERVE_EXIT, &status, sizeof(status));
+		return;
+	}
+	index = AllocateServeRequest();
+	request = &g_serve_requests[index];
+	request->client = slot;
+	request->id = request_id;
+	request->pid = -1;
+	request->pidfd = -1;
+	request->output_fds[0] = stdout_pipe[0];
+	request->output_fds[1] = stderr_pipe[0];
+	request->is_paused = false;
+	request->is_exited = false;
+	g_serve_clients[slot].num_requests++;
+
+	line = ArenaStrndup(&g_command_arena, text, length);
+	if (g_num_compiled_plans >= PLAN_CACHE_MAX) {
+		ClearPlanCache();
+	}
+	dup2(stderr_pipe[1], STDERR_FILENO);
+	plan = CompilePlan(line, &is_incomplete);
+	if (is_incomplete) {
+		fprintf(stderr, "syntax error: unexpected end of file\n");
+	} else if (plan != NULL && plan->num_heredocs > 0) {
+		fprintf(stderr, "here-documents are not supported over --serve\n");
+	}
+	is_spawned = plan != NULL && !is_incomplete && plan->num_heredocs == 0 && plan->root != NULL
+		&& SpawnServeProgram(request, plan->root, stdout_pipe[1]);
+	fflush(stderr);
+	dup2(g_serve_stderr_fd, STDERR_FILENO);
+
+	if (plan == NULL || is_incomplete || plan->num_heredocs > 0) {
+		request->is_exited = true;
+		request->wait_status = SYNTAX_ERROR_EXIT_CODE << 8;
+	} else if (plan->root == NULL) {
+		request->is_exited = true;
+		request->wait_status = 0;
+	} else if (is_spawned) {
+		if (request->pid == -1) {
+			request->is_exited = true;
+			request->wait_status = EXECUTE_FAILED_ERROR_CODE << 8;
+		}
+	} else {
+		fflush(stdout);
+		request->pid = fork();
+		if (request->pid == 0) {
+			setpgid(0, 0);
+			dup2(g_serve_null_fd, STDIN_FILENO);
+			dup2(stdout_pipe[1], STDOUT_FILENO);
+			dup2(stderr_pipe[1], STDERR_FILENO);
+			EnterSubshell();
+			g_is_bg_command = false;
+			ExecutePlan(plan->root, true);
+			fflush(stdout);
+			exit(LastStatusCode());
+		}
+		if (request->pid == -1) {
+			perror("fork()");
+			request->is_exited = true;
+			request->wait_status = EXECUTE_FAILED_ERROR_CODE << 8;
+		} else {
+			setpgid(request->pid, request->pid);
+		}
+	}
+	if (!request->is_exited) {
+		request->pidfd = OpenPidfd(request->pid);
+		if (request->pidfd != -1) {
+			WatchServeFd(EPOLL_CTL_ADD, request->pidfd, EPOLLIN, EVENT_SERVE_REQUEST, index);
+		}
+	}
+	close(stdout_pipe[1]);
+	close(stderr_pipe[1]);
+	for (stream = 0; stream < 2; stream++) {
+		fcntl(request->output_fds[stream], F_SETFL, O_NONBLOCK);
+		WatchServeFd(EPOLL_CTL_ADD, request->output_fds[stream], EPOLLIN, EVENT_SERVE_OUTPUT, index * 2 + stream);
 	}
-	return false;
 }
 
-// NOTE: this will change command_tokens and num_tokens
-int TrimAmpersand(char* command_tokens[], int num_tokens) {
-	if (command_tokens[num_tokens-1] != NULL) {
-		//free(command_tokens[num_tokens-1]);
-		command_tokens[num_tokens-1] = NULL;
+// Take what the client sent and start a request for every whole SERVE_RUN frame.
+// Anything else, or a command line too long, closes the connection
+void ReadServeClient(int slot) {
+	struct ServeClient* client = &g_serve_clients[slot];
+	struct ServeFrame frame;
+	size_t offset = 0;
+	ssize_t num_read;
+
+	ReserveBuffer(&client->input, &client->input_capacity, client->input_length + SERVE_READ_SIZE);
+	num_read = read(client->fd, client->input + client->input_length, SERVE_READ_SIZE);
+	if (num_read == -1 && (errno == EAGAIN || errno == EINTR)) return;
+	if (num_read <= 0) {
+		HangUpServeClient(slot);
+		return;
+	}
+	client->input_length += num_read;
+	while (client->input_length - offset >= sizeof(frame)) {
+		memcpy(&frame, client->input + offset, sizeof(frame));
+		if (frame.type != SERVE_RUN || frame.length > SERVE_COMMAND_MAX) {
+			fprintf(stderr, "tinysh: --serve: bad frame, connection closed\n");
+			HangUpServeClient(slot);
+			return;
+		}
+		if (client->input_length - offset - sizeof(frame) < frame.length) break;
+		StartServeRequest(slot, frame.request_id, client->input + offset + sizeof(frame), frame.length);
+		offset += sizeof(frame) + frame.length;
+	}
+	memmove(client->input, client->input + offset, client->input_length - offset);
+	client->input_length -= offset;
+	FlushServeClient(slot);
+}
+
+void AcceptServeClients(void) {
+	struct ServeClient* client;
+	int old_slots;
+	int slot;
+	int fd;
+
+	while ((fd = accept4(g_serve_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		for (slot = 0; slot < g_num_serve_client_slots; slot++) {
+			if (g_serve_clients[slot].fd == -1 && g_serve_clients[slot].num_requests == 0) break;
+		}
+		if (slot == g_num_serve_client_slots) {
+			old_slots = g_num_serve_client_slots;
+			g_num_serve_client_slots = old_slots == 0 ? INITIAL_JOB_CAPACITY : old_slots * 2;
+			g_serve_clients = (struct ServeClient*)realloc(g_serve_clients,
+				g_num_serve_client_slots * sizeof(struct ServeClient));
+			memset(&g_serve_clients[old_slots], 0,
+				(g_num_serve_client_slots - old_slots) * sizeof(struct ServeClient));
+			for (slot = old_slots; slot < g_num_serve_client_slots; slot++) {
+				g_serve_clients[slot].fd = -1;
+			}
+			slot = old_slots;
+		}
+		client = &g_serve_clients[slot];
+		memset(client, 0, sizeof(*client));
+		client->fd = fd;
+		WatchServeFd(EPOLL_CTL_ADD, fd, EPOLLIN, EVENT_SERVE_CLIENT, slot);
+	}
+}
+
+// Drain the signalfd. Returns true on SIGINT or SIGTERM, which stop the server
+bool HandleServeSignals(void) {
+	struct signalfd_siginfo info;
+	bool is_stopping = false;
+	int i;
+
+	while (read(g_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM) {
+			is_stopping = true;
+		} else if (info.ssi_signo == SIGCHLD) {
+			// only the requests without a pidfd need a look
+			for (i = 0; i < g_serve_request_high_water; i++) {
+				if (g_serve_requests[i].pidfd == -1) ReapServeRequest(i);
+			}
+		}
+	}
+	return is_stopping;
+}
+
+// Listen on a Unix socket at path, taking over a socket file no server answers on any more
+int ListenServeSocket(const char* path) {
+	struct sockaddr_un address;
+	bool is_bound;
+	int probe_fd;
+	int fd;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "tinysh: --serve: %s: path too long\n", path);
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket()");
+		return -1;
+	}
+	is_bound = bind(fd, (struct sockaddr*)&address, sizeof(address)) == 0;
+	if (!is_bound && errno == EADDRINUSE) {
+		probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (probe_fd != -1 && connect(probe_fd, (struct sockaddr*)&address, sizeof(address)) == -1
+			&& errno == ECONNREFUSED) {
+			unlink(path);
+			is_bound = bind(fd, (struct sockaddr*)&address, sizeof(address)) == 0;
+		} else {
+			errno = EADDRINUSE;
+		}
+		if (probe_fd != -1) close(probe_fd);
+	}
+	if (!is_bound || listen(fd, SOMAXCONN) == -1) {
+		fprintf(stderr, "tinysh: --serve: %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// What still runs gets SIGTERM, the socket file goes
+void StopServer(const char* path) {
+	int i;
+
+	for (i = 0; i < g_serve_request_high_water; i++) {
+		if (g_serve_requests[i].client != -1 && !g_serve_requests[i].is_exited) {
+			killpg(g_serve_requests[i].pid, SIGTERM);
+		}
+	}
+	unlink(path);
+	exit(0);
+}
+
+// tinysh --serve path: one long-lived shell runs the command lines clients send over a Unix
+// socket at path, each in a forked copy of itself, all of them at once. Output and status
+// stream back in frames, see struct ServeFrame. Runs until SIGINT or SIGTERM
+void RunServer(const char* path) {
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	uint64_t payload;
+	int num_events;
+	int i;
+
+	g_serve_listen_fd = ListenServeSocket(path);
+	if (g_serve_listen_fd == -1) exit(EXECUTE_FAILED_ERROR_CODE);
+	g_serve_null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	g_serve_stderr_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, FIRST_PRIVATE_FD);
+	SetInputWatched(false);
+	WatchServeFd(EPOLL_CTL_ADD, g_serve_listen_fd, EPOLLIN, EVENT_SERVE_LISTEN, 0);
+
+	while (1) {
+		ArenaReset(&g_command_arena);
+		num_events = epoll_wait(g_epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+		if (num_events == -1) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait()");
+			exit(1);
+		}
+		for (i = 0; i < num_events; i++) {
+			// an entry freed and reused earlier in this batch only gets a read that finds nothing
+			payload = events[i].data.u64 & (((uint64_t)1 << EVENT_KIND_SHIFT) - 1);
+			switch ((EventKind)(events[i].data.u64 >> EVENT_KIND_SHIFT)) {
+			case EVENT_SIGNAL:
+				if (HandleServeSignals()) StopServer(path);
+				break;
+			case EVENT_SERVE_LISTEN:
+				AcceptServeClients();
+				break;
+			case EVENT_SERVE_CLIENT:
+				if (g_serve_clients[payload].fd == -1) break;
+				if (events[i].events & EPOLLOUT) FlushServeClient((int)payload);
+				if (g_serve_clients[payload].fd != -1 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+					ReadServeClient((int)payload);
+				}
+				break;
+			case EVENT_SERVE_OUTPUT:
+				ReadServeOutput((int)(payload / 2), (int)(payload % 2));
+				break;
+			case EVENT_SERVE_REQUEST:
+				ReapServeRequest((int)payload);
+				break;
+			default:
+				break; // the shell's own input and jobs, there are none
+			}
+		}
 	}
-	num_tokens--;
-	return num_tokens;
 }
 
+// tinysh --client path [-j N] [command]: run command, or else every line of stdin, on the
+// --serve shell at path, with up to N requests in flight. Output is written as it comes.
+// Returns the command's status, or the number of lines that failed like parallel does
+int RunClient(const char* path, int window, const char* command) {
+	struct sockaddr_un address;
+	struct ServeFrame frame;
+	char* payload = NULL;
+	size_t payload_capacity = 0;
+	char* line = NULL;
+	size_t line_capacity = 0;
+	ssize_t line_length;
+	const char* text;
+	uint32_t next_id = 0;
+	int num_in_flight = 0;
+	bool is_input_done = false;
+	int32_t status = 0;
+	int num_failed = 0;
+	int fd;
+
+	signal(SIGPIPE, SIG_IGN); // a server that went away is reported instead
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "tinysh: --client: %s: path too long\n", path);
+		return EXECUTE_FAILED_ERROR_CODE;
+	}
+	strcpy(address.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+		fprintf(stderr, "tinysh: --client: %s: %s\n", path, strerror(errno));
+		return EXECUTE_FAILED_ERROR_CODE;
+	}
+	while (1) {
+		while (!is_input_done && num_in_flight < window) {
+			if (command != NULL) {
+				text = command;
+				frame.length = strlen(command);
+				is_input_done = true;
+			} else {
+				line_length = getline(&line, &line_capacity, stdin);
+				if (line_length == -1) {
+					is_input_done = true;
+					break;
+				}
+				if (line_length > 0 && line[line_length-1] == '\n') line[--line_length] = '\0';
+				if (line_length == 0) continue;
+				text = line;
+				frame.length = (uint32_t)line_length;
+			}
+			frame.request_id = next_id++;
+			frame.type = SERVE_RUN;
+			if (!WriteAll(fd, (const char*)&frame, sizeof(frame)) || !WriteAll(fd, text, frame.length)) {
+				fprintf(stderr, "tinysh: --client: %s\n", strerror(errno));
+				return EXECUTE_FAILED_ERROR_CODE;
+			}
+			num_in_flight++;
+		}
+		if (num_in_flight == 0) break;
+		if (!ReadAll(fd, (char*)&frame, sizeof(frame))) {
+			fprintf(stderr, "tinysh: --client: the server closed the connection\n");
+			return EXECUTE_FAILED_ERROR_CODE;
+		}
+		ReserveBuffer(&payload, &payload_capacity, frame.length);
+		if (!ReadAll(fd, payload, frame.length)) {
+			fprintf(stderr, "tinysh: --client: the server closed the connection\n");
+			return EXECUTE_FAILED_ERROR_CODE;
+		}
+		if (frame.type == SERVE_STDOUT) {
+			WriteAll(STDOUT_FILENO, payload, frame.length);
+		} else if (frame.type == SERVE_STDERR) {
+			WriteAll(STDERR_FILENO, payload, frame.length);
+		} else if (frame.type == SERVE_EXIT && frame.length == sizeof(status)) {
+			memcpy(&status, payload, sizeof(status));
+			if (status != 0) num_failed++;
+			num_in_flight--;
+		}
+	}
+	close(fd);
+	if (command != NULL) return status;
+	return num_failed < PARALLEL_MAX_EXIT_CODE ? num_failed : PARALLEL_MAX_EXIT_CODE;
+}
 
 int main(int in_argument_count, char ** in_arguments) {
 	char* input_string = NULL; // input buffer
-	int num_tokens = 0;
-	char* command_tokens[MAX_NUM_TOKENS];
+	struct Plan* plan;
+	bool is_incomplete;
+	bool is_continued;
+	struct ArenaMark plan_mark;
+	struct ArenaString lines;
+	char* line;
+	int depth; // loops, groups and subshells still open, see ScanOpenLine
+	const char* trace_path = NULL;
+	const char* serve_path = NULL;
+	int client_window = SERVE_CLIENT_WINDOW;
+	uint64_t trace_time;
+	int argument_index = 1;
+
+	// tinysh [--trace file] [-c command | script | --serve socket]
+	// tinysh --client socket [-j N] [command]
+	if (argument_index + 1 < in_argument_count && strcmp(in_arguments[argument_index], "--client") == 0) {
+		argument_index += 2;
+		if (argument_index + 1 < in_argument_count && strcmp(in_arguments[argument_index], "-j") == 0) {
+			client_window = atoi(in_arguments[argument_index + 1]);
+			argument_index += 2;
+		}
+		if (client_window < 1 || argument_index + 1 < in_argument_count) {
+			fprintf(stderr, "usage: tinysh --client socket [-j N] [command]\n");
+			exit(2);
+		}
+		return RunClient(in_arguments[2], client_window,
+			argument_index < in_argument_count ? in_arguments[argument_index] : NULL);
+	}
+	ImportEnvironment();
+	if (argument_index + 1 < in_argument_count && strcmp(in_arguments[argument_index], "--trace") == 0) {
+		trace_path = in_arguments[argument_index + 1];
+		argument_index += 2;
+	}
+	if (argument_index + 1 < in_argument_count && strcmp(in_arguments[argument_index], "--serve") == 0) {
+		serve_path = in_arguments[argument_index + 1];
+		g_is_interactive = false;
+	} else if (argument_index < in_argument_count) {
+		if (strcmp(in_arguments[argument_index], "-c") == 0) {
+			if (argument_index + 1 >= in_argument_count) {
+				fprintf(stderr, "tinysh: -c: option requires an argument\n");
+				exit(2);
+			}
+			UseCommandString(in_arguments[argument_index + 1]);
+		} else if (in_arguments[argument_index][0] == '-' && in_arguments[argument_index][1] != '\0') {
+			fprintf(stderr, "usage: tinysh [--trace file] [-c command | script | --serve socket]\n");
+			exit(2);
+		} else {
+			OpenScript(in_arguments[argument_index]);
+		}
+	}
+	SetupTrace(trace_path);
 
 	// Signal config
+	snprintf(g_shell_pid_string, sizeof(g_shell_pid_string), "%d", (int)getpid());
 	SetupBlockSignals();
-	SetupSignalHandlers();
-
-	InitTokenBuffer(command_tokens); // tokens arrays which args are parse into
+	SetupTerminal();
+	InitSpawnBackend();
+	// TINYSH_CPUS=list: a default affinity for the shell and all it runs, like pin list
+	if (getenv("TINYSH_CPUS") != NULL && getenv("TINYSH_CPUS")[0] != '\0') {
+		SetShellAffinity(getenv("TINYSH_CPUS"));
+	}
+	SetupEventLoop();
+	SetupHistory();
+	if (serve_path != NULL) {
+		RunServer(serve_path);
+	}
 
 	// Infinte user input loop
 	while (1) {
-		printf(": "); 
+		// tokens, argv and expansions of the previous line all go at once
+		ArenaReset(&g_command_arena);
+
+		if (g_is_interactive) {
+			printf(": "); 
+			fflush(stdout);
+		}
 
 		g_signal_caught = false;
 
+		memset(&g_trace, 0, sizeof(g_trace));
+		g_trace.start = TraceClock();
 		input_string = GetUserCommand(input_string);	
+		trace_time = TraceClock();
+		g_trace.read_ns = trace_time - g_trace.start;
 
 		if (g_signal_caught) continue;
+		if (input_string == NULL) exit(LastStatusCode()); // EOF
+		input_string = ExpandHistory(input_string);
+		if (input_string == NULL) continue;
+		AddHistory(input_string);
 
-		
-		num_tokens = ParseCommand(input_string, command_tokens);
-		if (num_tokens == -1) {
-			ResetTokenBuffer(command_tokens, num_tokens); 
-			perror("Bad file");
-			continue;
+		g_num_heredoc_bodies = 0;
+		// only here, between lines: a $(...) compiles its own while a plan runs
+		if (g_num_compiled_plans >= PLAN_CACHE_MAX) {
+			ClearPlanCache();
 		}
-
-		if (IsEmptyCommand(num_tokens) || HasCommentSyntax(command_tokens[0]) ) {
-			ResetTokenBuffer(command_tokens, num_tokens);
-			continue;
+		plan_mark = ArenaGetMark(&g_plan_arena);
+		plan = CompilePlan(input_string, &is_incomplete);
+		if (is_incomplete) {
+			ArenaStringInit(&g_command_arena, &lines, strlen(input_string) + 256);
+			ArenaStringAppend(&g_command_arena, &lines, input_string, strlen(input_string));
 		}
-
-		// If background command, set flags
-		if (IsBackgroundCommand(command_tokens, num_tokens)) {
-			num_tokens = TrimAmpersand(command_tokens, num_tokens);	
-			if (g_bg_command_enable == true) {
-				g_is_bg_command = true;
-			} else {
-				g_is_bg_command = false;
+		// a loop or a group goes on until it is closed, here-docs come right after their line.
+		// The text is compiled again only once what it opens may be closed, and a plan that is
+		// still incomplete goes from the plan arena before the next one
+		line = input_string;
+		depth = 0;
+		is_continued = false;
+		while (plan != NULL && is_incomplete) {
+			if (ScanOpenLine(line, &depth) == -1) {
+				plan = NULL;
+				break;
 			}
-		} else {
-			g_is_bg_command = false;
+			if (is_continued && depth <= 0) {
+				ArenaRelease(&g_plan_arena, plan_mark);
+				plan = CompilePlan(ArenaStringFinish(&lines), &is_incomplete);
+				if (plan == NULL || !is_incomplete) break;
+			}
+			if (g_is_interactive) {
+				printf("> ");
+				fflush(stdout);
+			}
+			line = GetUserCommand(NULL);
+			if (line == NULL) {
+				if (!g_signal_caught) fprintf(stderr, "syntax error: unexpected end of file\n");
+				plan = NULL;
+				break;
+			}
+			AddHistory(line);
+			is_continued = true;
+			ArenaStringAppend(&g_command_arena, &lines, "\n", 1);
+			ArenaStringAppend(&g_command_arena, &lines, line, strlen(line));
 		}
-		
-		ExpandDollaSign(command_tokens, num_tokens);
-		
-		// Get command name	
-		char command_name[MAX_ARG_LENGTH];
-		memset(command_name, '\0', sizeof(command_name));	
-		strcpy(command_name, command_tokens[0]);
-
-		// Built-in commands
-		if (strcmp(command_name, "exit") == 0) {
-			exit(0);	
-		} else if (strcmp(command_name, "cd") == 0) {
-			PrintCurrentWorkingDir();
-			if(!IsValidCDCommand(command_tokens, num_tokens)) continue;
-			SetCurrentWorkingDir(command_tokens, num_tokens);
-			PrintCurrentWorkingDir();
-		} else if (strcmp(command_name, "status") == 0) {
-			PrintLastStatus();			
-		} else {
-			// Fork a child and have that child execute command
-			ExecuteCommand(num_tokens, command_tokens);
+		g_trace.parse_ns = TraceClock() - trace_time;
+		// syntax error, empty line or comment
+		if (plan == NULL || plan->root == NULL) {
+			continue;
+		}
+		if (ReadHereDocuments(plan) == -1) {
+			continue;
 		}
-		// Clean command token array every loop before read new input
-		ResetTokenBuffer(command_tokens, num_tokens); 
+
+		ExecutePlan(plan->root, true);
 	}
 	
 	return 0;